@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bloom.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pdlfs-common/xxhash.h>
+
+#include "common.h"
+
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+
+void bloom_init(bloom_t* b, size_t num_keys, int bits_per_key) {
+  size_t bits;
+  void* mem;
+
+  if (bits_per_key < 1) bits_per_key = 1;
+  if (num_keys < 1) num_keys = 1;
+  /* k = ln2 * bits per key minimizes the false-positive rate */
+  b->k = static_cast<int>(bits_per_key * 0.69);
+  if (b->k < 1) b->k = 1;
+  if (b->k > 30) b->k = 30;
+
+  bits = num_keys * bits_per_key;
+  b->nblocks = (bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+  if (posix_memalign(&mem, 64, b->nblocks * BLOOM_BLOCK_BITS / 8) != 0) {
+    ABORT("posix_memalign");
+  }
+  b->blocks = static_cast<uint64_t*>(mem);
+  bloom_clear(b);
+}
+
+void bloom_clear(bloom_t* b) {
+  memset(b->blocks, 0, b->nblocks * BLOOM_BLOCK_BITS / 8);
+}
+
+void bloom_destroy(bloom_t* b) {
+  free(b->blocks);
+  b->blocks = NULL;
+  b->nblocks = 0;
+}
+
+int bloom_add(bloom_t* b, const char* key, size_t key_len) {
+  const uint64_t h = pdlfs::xxhash64(key, key_len, 0);
+  /* the high half of the hash picks the block */
+  const uint64_t i = ((h >> 32) * static_cast<uint64_t>(b->nblocks)) >> 32;
+  uint64_t* const blk = b->blocks + BLOOM_BLOCK_WORDS * i;
+  /* bit positions come from the top bits of a multiplicative sequence */
+  uint64_t x = h | 1;
+  int found = 1;
+
+  for (int j = 0; j < b->k; j++) {
+    x *= 0x9E3779B97F4A7C15ULL;
+    const uint32_t pos = static_cast<uint32_t>(x >> 55); /* 0 .. 511 */
+    const uint64_t mask = 1ULL << (pos % 64);
+    uint64_t* const w = &blk[pos / 64];
+    if ((*w & mask) == 0) {
+      __sync_fetch_and_or(w, mask);
+      found = 0;
+    }
+  }
+
+  return found;
+}
+
+/* false-positive rate of a single block holding num_keys keys */
+static double block_fp(const bloom_t* b, int num_keys) {
+  return pow(1 - pow(1 - 1.0 / BLOOM_BLOCK_BITS, b->k * num_keys), b->k);
+}
+
+double bloom_expected_fps(const bloom_t* b, unsigned long long n) {
+  const int steps = 64;
+  double sum = 0;
+
+  /*
+   * the i-th key lands in a block holding Poisson(i / nblocks) keys and is
+   * a false positive at that block's rate.  integrate this over i = 0 .. n
+   * (midpoint rule).  this accounts for blocks filling up unevenly, which
+   * is what makes blocked filters a bit less accurate than plain ones.
+   */
+  if (n == 0) return 0;
+  for (int s = 0; s < steps; s++) {
+    const double lambda = (s + 0.5) * n / steps / b->nblocks;
+    const int max_keys = static_cast<int>(lambda + 10 * sqrt(lambda) + 10);
+    double p = exp(-lambda); /* Poisson(lambda) pmf at 0 */
+    double fp = 0;
+    for (int l = 0; l <= max_keys; l++) {
+      fp += p * block_fp(b, l);
+      p *= lambda / (l + 1);
+    }
+    sum += fp;
+  }
+
+  return sum * n / steps;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bloom.h  blocked bloom filters for approximate membership checks
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * a blocked bloom filter: each key sets all its bits within a single
+ * 512-bit (one cache line) block, so an add or a lookup touches exactly
+ * one cache line.  bits are set with atomic ors, so multiple threads may
+ * add keys at the same time without a lock.  the filter never reports a
+ * new key as new falsely, but may report a new key as already added at a
+ * small false-positive rate set by the bits per key.
+ */
+typedef struct bloom {
+  uint64_t* blocks; /* nblocks * 8 words */
+  size_t nblocks;
+  int k; /* bits per key */
+} bloom_t;
+
+/* size a filter for num_keys keys at bits_per_key bits per key */
+void bloom_init(bloom_t* b, size_t num_keys, int bits_per_key);
+void bloom_clear(bloom_t* b);
+void bloom_destroy(bloom_t* b);
+
+/*
+ * bloom_add: add a key.  return 1 if all its bits were already set (the
+ * key is likely to have been added before), or 0 otherwise.
+ */
+int bloom_add(bloom_t* b, const char* key, size_t key_len);
+
+/*
+ * bloom_expected_fps: the expected number of keys bloom_add reported as
+ * added before, when in fact they were new, after n distinct keys were
+ * added to an initially empty filter.
+ */
+double bloom_expected_fps(const bloom_t* b, unsigned long long n);
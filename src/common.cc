@@ -29,6 +29,8 @@
  */
 
 #include "common.h"
+#include "crc32c.h"
+#include "xxhash_batch.h"
 
 #include <assert.h>
 #include <dirent.h>
@@ -139,6 +141,8 @@ void check_sse42() {
   } else {
     logf(LOG_INFO, "[sse] SSE4_2 is not available");
   }
+  logf(LOG_INFO, "[sse] batch hashing kernels: %s", xxhash_batch_impl());
+  logf(LOG_INFO, "[sse] crc32c: %s", crc32c_impl());
 }
 
 /* read a line from file */
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_X86 1
+#include <nmmintrin.h>
+#endif
+
+/* crc32c polynomial, bit-reversed */
+#define POLY 0x82f63b78U
+
+/*
+ * the sse4.2 version runs three independent crc32 streams over adjacent
+ * blocks to hide the latency of the instruction, then shifts the first
+ * two crcs over the blocks that follow them and folds everything back
+ * together.  LONG blocks are used while there is enough input, then
+ * SHORT ones, then one stream for the rest.
+ */
+#define LONG 8192
+#define SHORT 256
+
+namespace {
+
+uint32_t crc32c_table[8][256];   /* slicing-by-8 */
+uint32_t crc32c_long[4][256];    /* shift a crc over LONG zero bytes */
+uint32_t crc32c_short[4][256];   /* shift a crc over SHORT zero bytes */
+
+/* gf2_matrix_times: multiply a 32x32 gf(2) matrix by a vector */
+uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+/* gf2_matrix_square: square = mat * mat */
+void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_matrix_times(mat, mat[n]);
+  }
+}
+
+/* crc32c_zeros_op: build the operator that applies len zero bytes to a
+ * crc.  len must be a power of 2 */
+void crc32c_zeros_op(uint32_t* even, size_t len) {
+  uint32_t odd[32];
+  uint32_t row = 1;
+  odd[0] = POLY; /* one zero bit */
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2_matrix_square(even, odd); /* two zero bits */
+  gf2_matrix_square(odd, even); /* four zero bits */
+  /* the first square below gives one zero byte, then each one doubles */
+  do {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (len == 0) return;
+    gf2_matrix_square(odd, even);
+    len >>= 1;
+  } while (len);
+  memcpy(even, odd, sizeof(odd));
+}
+
+/* crc32c_zeros: turn the operator for len zero bytes into tables */
+void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+  uint32_t op[32];
+  crc32c_zeros_op(op, len);
+  for (uint32_t n = 0; n < 256; n++) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
+
+inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+void crc32c_init_tables() {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+    }
+    crc32c_table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = crc32c_table[0][n];
+    for (int k = 1; k < 8; k++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[k][n] = crc;
+    }
+  }
+  crc32c_zeros(crc32c_long, LONG);
+  crc32c_zeros(crc32c_short, SHORT);
+}
+
+uint32_t crc32c_scalar(uint32_t crc, const char* data, size_t n) {
+  const unsigned char* next = reinterpret_cast<const unsigned char*>(data);
+  uint64_t word;
+
+  crc = ~crc;
+  while (n != 0 && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    n--;
+  }
+  while (n >= 8) {
+    memcpy(&word, next, 8); /* assumes little endian */
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^
+          crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+    next += 8;
+    n -= 8;
+  }
+  while (n != 0) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    n--;
+  }
+  return ~crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc,
+                                                        const char* data,
+                                                        size_t n) {
+  const char* next = data;
+  const char* end;
+  uint64_t crc0, crc1, crc2;
+  uint64_t word;
+
+  crc0 = ~crc;
+  while (n != 0 && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
+    crc0 = _mm_crc32_u8(uint32_t(crc0), *next++);
+    n--;
+  }
+  while (n >= LONG * 3) {
+    crc1 = crc2 = 0;
+    end = next + LONG;
+    do {
+      crc0 = _mm_crc32_u64(crc0, *reinterpret_cast<const uint64_t*>(next));
+      crc1 = _mm_crc32_u64(
+          crc1, *reinterpret_cast<const uint64_t*>(next + LONG));
+      crc2 = _mm_crc32_u64(
+          crc2, *reinterpret_cast<const uint64_t*>(next + LONG * 2));
+      next += 8;
+    } while (next < end);
+    crc0 = crc32c_shift(crc32c_long, uint32_t(crc0)) ^ crc1;
+    crc0 = crc32c_shift(crc32c_long, uint32_t(crc0)) ^ crc2;
+    next += LONG * 2;
+    n -= LONG * 3;
+  }
+  while (n >= SHORT * 3) {
+    crc1 = crc2 = 0;
+    end = next + SHORT;
+    do {
+      crc0 = _mm_crc32_u64(crc0, *reinterpret_cast<const uint64_t*>(next));
+      crc1 = _mm_crc32_u64(
+          crc1, *reinterpret_cast<const uint64_t*>(next + SHORT));
+      crc2 = _mm_crc32_u64(
+          crc2, *reinterpret_cast<const uint64_t*>(next + SHORT * 2));
+      next += 8;
+    } while (next < end);
+    crc0 = crc32c_shift(crc32c_short, uint32_t(crc0)) ^ crc1;
+    crc0 = crc32c_shift(crc32c_short, uint32_t(crc0)) ^ crc2;
+    next += SHORT * 2;
+    n -= SHORT * 3;
+  }
+  while (n >= 8) {
+    memcpy(&word, next, 8);
+    crc0 = _mm_crc32_u64(crc0, word);
+    next += 8;
+    n -= 8;
+  }
+  while (n != 0) {
+    crc0 = _mm_crc32_u8(uint32_t(crc0), *next++);
+    n--;
+  }
+  return ~uint32_t(crc0);
+}
+#endif /* CRC32C_X86 */
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const char*, size_t);
+
+struct impl {
+  crc32c_fn fn;
+  const char* name;
+};
+
+impl resolved = {crc32c_scalar, "scalar"};
+pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* build the tables and pick the implementation, once */
+void crc32c_resolve() {
+  crc32c_init_tables();
+#if defined(CRC32C_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    resolved.fn = crc32c_sse42;
+    resolved.name = "sse4.2";
+  }
+#endif
+}
+
+const impl* get_impl() {
+  pthread_once(&once, crc32c_resolve);
+  return &resolved;
+}
+
+}  // namespace
+
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t n) {
+  return get_impl()->fn(crc, data, n);
+}
+
+const char* crc32c_impl() { return get_impl()->name; }
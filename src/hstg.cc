@@ -82,6 +82,17 @@ void hstg_add(hstg_t& h, double d) {
   h[3] += d;              /* sum */
 }
 
+void hstg_merge(hstg_t& dst, const hstg_t& src) {
+  if (src[0] == 0) return;
+  if (dst[0] == 0 || dst[1] < src[1]) dst[1] = src[1]; /* max */
+  if (dst[0] == 0 || dst[2] > src[2]) dst[2] = src[2]; /* min */
+  dst[0] += src[0];                                    /* num */
+  dst[3] += src[3];                                    /* sum */
+  for (int b = 0; b < MON_NUM_BUCKETS; b++) {
+    dst[4 + b] += src[4 + b];
+  }
+}
+
 double hstg_ptile(const hstg_t& h, double p) {
   double threshold = h[0] * (p / 100.0);
   double sum = 0;
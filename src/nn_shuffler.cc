@@ -33,27 +33,28 @@
 #include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
+#include "shuffle_codec.h"
 
+#include <algorithm>
 #include <vector>
 
 /*
  * a set of mutex shared among the main thread and the bg shuffle threads.
  */
-static pthread_mutex_t mtx[5] = {
+static pthread_mutex_t mtx[4] = {
     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_MUTEX_INITIALIZER};
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
 
-static pthread_cond_t cv[5] = {
-    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+static pthread_cond_t cv[4] = {
     PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
-    PTHREAD_COND_INITIALIZER};
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
 
 /* used when waiting for all bg threads to terminate */
 static const int bg_cv = 0;
@@ -64,11 +65,8 @@ static const int rpc_cv = 1;
 /* used when waiting for the next available rpc callback slot */
 static const int cb_cv = 2;
 
-/* used when waiting for a busy rpc queue */
-static const int qu_cv = 3;
-
 /* used when waiting for work items */
-static const int wk_cv = 4;
+static const int wk_cv = 3;
 
 /* true iff in shutdown seq */
 static int shutting_down = 0; /* XXX: better if this is atomic */
@@ -77,24 +75,162 @@ static int shutting_down = 0; /* XXX: better if this is atomic */
 static int num_bg = 0;
 
 /* workers */
-static std::vector<void*> wk_items;
 static int num_wk = 0; /* number of worker threads running */
-static size_t items_submitted = 0;
-static size_t items_completed = 0;
-#define MAX_WORK_ITEM 256
+static size_t items_submitted = 0; /* atomic */
+static size_t items_completed = 0; /* atomic */
+
+/* without workers, the fraction of time the progress thread spent
+ * executing rpcs over recent windows. rpcs that arrive while it is busy
+ * wait in mercury's queue where we cannot count them, so this stands in
+ * for the worker backlog when granting credits. touched only by the
+ * progress thread. */
+#define INLINE_WINDOW_MICROS 10000 /* 10 ms */
+static struct {
+  uint64_t start; /* start of the current window */
+  uint64_t busy;  /* micros spent in rpcs in the current window */
+  double util;    /* busy fraction of the last full window */
+} inl = {0, 0, 0};
+
+/* per-thread buffers for decoding and applying incoming rpcs */
+struct rpc_bufs {
+  char buf[MAX_RPC_MESSAGE + SHUFFLE_CODEC_OVERHEAD];
+  /* decoded payload when the codec is on */
+  char raw[MAX_RPC_MESSAGE];
+  char scratch[SHUFFLE_CODEC_SCRATCH(MAX_RPC_MESSAGE)];
+};
+
+/*
+ * incoming rpcs are handed from the mercury progress thread to the workers
+ * through a bounded lock-free mpmc ring.  each slot carries a sequence
+ * number telling whether it is ready to be pushed or popped for a given lap
+ * around the ring, so producers and consumers only race on the head and
+ * tail indices with a CAS.  idle workers sleep on wk_cv after announcing
+ * themselves in wk_sleepers, and a push only takes the lock to wake them
+ * if there is anyone to wake.
+ */
+#define WK_RING_SZ 1024 /* must be a power of 2 */
+typedef struct wk_slot {
+  size_t seq;
+  void* item;
+} wk_slot_t;
+static wk_slot_t wk_ring[WK_RING_SZ];
+static size_t wk_head __attribute__((aligned(64))) = 0; /* next pop */
+static size_t wk_tail __attribute__((aligned(64))) = 0; /* next push */
+static int wk_sleepers __attribute__((aligned(64))) = 0;
+
+static void wk_ring_init() {
+  for (size_t i = 0; i < WK_RING_SZ; i++) {
+    wk_ring[i].seq = i;
+    wk_ring[i].item = NULL;
+  }
+  wk_head = wk_tail = 0;
+}
+
+/* wk_push: add an item to the ring. return 0 if the ring is full. */
+static int wk_push(void* item) {
+  size_t pos = __atomic_load_n(&wk_tail, __ATOMIC_RELAXED);
+  for (;;) {
+    wk_slot_t* const slot = &wk_ring[pos & (WK_RING_SZ - 1)];
+    const size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    const intptr_t dif = intptr_t(seq) - intptr_t(pos);
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&wk_tail, pos, pos + 1)) {
+        slot->item = item;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+      pos = __atomic_load_n(&wk_tail, __ATOMIC_RELAXED);
+    } else if (dif < 0) {
+      return 0; /* full */
+    } else {
+      pos = __atomic_load_n(&wk_tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* wk_pop: take an item from the ring and store the number of items that
+ * were in it (including ours) in *depth. return NULL if the ring is empty. */
+static void* wk_pop(size_t* depth) {
+  size_t pos = __atomic_load_n(&wk_head, __ATOMIC_RELAXED);
+  for (;;) {
+    wk_slot_t* const slot = &wk_ring[pos & (WK_RING_SZ - 1)];
+    const size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    const intptr_t dif = intptr_t(seq) - intptr_t(pos + 1);
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&wk_head, pos, pos + 1)) {
+        void* const item = slot->item;
+        __atomic_store_n(&slot->seq, pos + WK_RING_SZ, __ATOMIC_RELEASE);
+        *depth = __atomic_load_n(&wk_tail, __ATOMIC_RELAXED) - pos;
+        return item;
+      }
+      pos = __atomic_load_n(&wk_head, __ATOMIC_RELAXED);
+    } else if (dif < 0) {
+      return NULL; /* empty */
+    } else {
+      pos = __atomic_load_n(&wk_head, __ATOMIC_RELAXED);
+    }
+  }
+}
 
 /* rpc queue */
 static std::vector<int> rpcq_order; /* flush order */
+typedef struct rpcbuf {
+  uint32_t sz;  /* aggregated size of all pending writes */
+  int lepo;     /* epoch number for the last write */
+  int flying;   /* non-zero when the buffer is being sent */
+  char* buf;    /* slab memory for the writes (NULL if empty) */
+  char* zbuf;   /* codec frame and scratch space (NULL if codec is off) */
+} rpcbuf_t;
+/* each queue has its own lock and wait state so that writers to different
+ * peers never contend, and queues are cache line aligned so that their
+ * locks do not share lines either. a queue has one or more buffers.
+ * writers fill bufs[cur] while the others may be in flight, and only
+ * block when all buffers of the queue are being sent. */
 typedef struct rpcq {
-  uint32_t sz; /* aggregated size of all pending writes */
-  int lepo;    /* epoch number for the last write */
-  int busy;    /* non-zero when queue is locked and is being flushed */
-  char* buf;   /* heap-allocated memory for the queue */
-} rpcq_t;
+  pthread_mutex_t mtx; /* protects all fields below except nrpcs */
+  pthread_cond_t cv;   /* signaled when a buffer is sent */
+  rpcbuf_t* bufs;      /* rpcq_nbufs buffers (NULL if not a receiver) */
+  int cur;             /* buffer being filled */
+  int busy;            /* number of buffers being sent */
+  int nrpcs;   /* async rpcs sent to the peer and not yet replied */
+  int credits; /* max such rpcs granted by the peer */
+  /* nrpcs and credits are protected by mtx[cb_cv] */
+  uint64_t blocked_micros; /* time writers waited on us this epoch */
+  int lru_prev;            /* links in the pool's lru list */
+  int lru_next;            /* (protected by the pool's lock) */
+} __attribute__((aligned(64))) rpcq_t;
 static rpcq_t* rpcqs = NULL;
 static size_t max_rpcq_sz = 0; /* buffer size per rpc queue */
+static int rpcq_nbufs = 1;     /* buffers per rpc queue */
 static int nrpcqs = 0;         /* number of queues */
 
+/* queue buffers are not allocated up front. a buffer takes a slab from a
+ * shared pool when its first write arrives and returns it once sent, so
+ * memory follows the number of partially filled queues rather than the
+ * world size. the pool grows in chunks up to a byte budget. when it runs
+ * out, the partial buffer that has been waiting the longest is sent early
+ * to free its slab. queues holding a partial buffer are kept on an lru
+ * list for that, oldest first. lock order is queue -> pool. slabs are
+ * returned with no queue lock held (see slab_put). */
+#define SLAB_CHUNK (1 << 20) /* bytes allocated each time the pool grows */
+#define MIN_SLABS 16
+typedef struct slab_pool {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv; /* signaled when a slab is returned */
+  void* free;        /* free slabs linked through their first word */
+  std::vector<void*>* chunks;
+  size_t buf_sz;    /* bytes for writes at the front of a slab */
+  size_t slab_sz;   /* buf_sz plus codec space */
+  size_t nslabs;    /* slabs carved from chunks so far */
+  size_t max_slabs; /* budget */
+  size_t inuse;
+  size_t peak;                  /* max slabs in use this epoch */
+  unsigned long long evictions; /* buffers sent early this epoch */
+  int lru_head;
+  int lru_tail;
+} slab_pool_t;
+static slab_pool_t pool;
+
 /* rpc callback slots */
 #define MAX_OUTSTANDING_RPC 128 /* hard limit */
 static hg_handle_t hg_hdls[MAX_OUTSTANDING_RPC] = {0};
@@ -103,17 +239,56 @@ static int cb_flags[MAX_OUTSTANDING_RPC] = {0};
 static int cb_allowed = 1; /* soft limit */
 static int cb_left = 1;
 
+/* besides the global limit above, each peer grants a window of async rpcs
+ * a sender may keep in flight to it. the window comes back with every
+ * reply and shrinks as rpcs pile up in front of the peer's workers, so
+ * senders back off from busy peers and keep the global slots for idle
+ * ones. */
+static int peer_credits = 1; /* max window */
+
+/* set by senders to get the looper into busy polling (spin mode only) */
+static int looper_kick = 0;
+
+/* the auto-tuner adjusts the batch size of rpc queues and the window of
+ * outstanding async rpcs once per epoch. rpc latency and bytes are
+ * sampled as rpcs complete and summed over all ranks at the end of each
+ * epoch so every rank makes the same decision. the window is cut in half
+ * when latency rises well above the best seen so far and grows by one
+ * otherwise. the batch size shrinks by a quarter when aggregate throughput
+ * drops and grows by a fixed step otherwise. the configured buffer size
+ * and rpc window are the upper bounds. */
+#define TUNE_LAT_SLACK 0.5  /* latency rise treated as congestion */
+#define TUNE_TPUT_SLACK 0.1 /* throughput drop treated as a regression */
+static struct tuner {
+  int on;
+  int epoch;
+  size_t bmin; /* batch size bounds */
+  size_t bmax;
+  size_t bstep;
+  int wmin; /* rpc window bounds */
+  int wmax;
+  double min_lat;   /* best avg rpc latency seen so far */
+  double last_tput; /* aggregate throughput of the last epoch */
+  /* samples for the current epoch (atomic) */
+  unsigned long long rpcs;
+  unsigned long long bytes;
+  unsigned long long lat_micros;
+  unsigned long long first_send;
+} tn = {0};
+static size_t rpcq_target = 0; /* current batch size (<= max_rpcq_sz) */
+
+static void tuner_sample(hg_uint32_t sz, uint64_t start) {
+  __sync_bool_compare_and_swap(&tn.first_send, 0, start);
+  __sync_fetch_and_add(&tn.lat_micros, now_micros() - start);
+  __sync_fetch_and_add(&tn.bytes, sz);
+  __sync_fetch_and_add(&tn.rpcs, 1);
+}
+
 /* per-thread rusage */
 typedef struct rpcu {
   struct rusage r0;
   struct rusage r1;
   char tag[16];
-
-#define RPCU_ALLTHREADS 0
-#define RPCU_MAIN 1
-#define RPCU_LOOPER 2
-#define RPCU_HGPRO 3
-#define RPCU_WORKER 4
 } rpcu_t;
 /* 0:ALL, 1:main, 2:looper, 3:hg_progress, 4:worker */
 static rpcu_t rpcus[5] = {0};
@@ -192,29 +367,33 @@ void rpc_explain_timeout() {
 }
 }  // namespace
 
-/* rpc_work(): dedicated thread function to process rpc. each work item
- * represents an incoming rpc (encoding a batch of writes). */
+/* rpc_work(): worker thread function to process rpc. each work item
+ * represents an incoming rpc (encoding a batch of writes). workers share
+ * nothing but the work ring, each decoding into its own buffers. */
 static void* rpc_work(void* arg) {
+  rpc_bufs_t* bufs;
   write_info info;
   size_t total_writes; /* total individual writes processed */
   size_t total_bytes;  /* total rpc msg size */
-  std::vector<void*> todo;
-  std::vector<void*>::iterator it;
-  size_t num_items;
+  size_t total_rpcs;   /* total rpcs processed */
+  uint64_t busy;       /* time spent processing rpcs */
+  uint64_t start;
+  hstg_t iq_dep;
+  rpcu_t u;
+  size_t depth;
   hg_return_t hret;
   hg_handle_t h;
   int s;
 
-  total_writes = total_bytes = 0;
-  hstg_reset_min(nnctx.iq_dep);
-  num_items = 0;
+  total_writes = total_bytes = total_rpcs = 0;
+  busy = 0;
+  memset(&iq_dep, 0, sizeof(hstg_t));
+  hstg_reset_min(iq_dep);
+  memset(&u, 0, sizeof(u));
+  strcpy(u.tag, "deliv");
 
-  /*
-   * mercury by default will only pull at most 256 incoming requests from the
-   * underlying network transport so here we also reserve 256 slots. This 256
-   * limit can be removed from mercury at the compile time.
-   */
-  todo.reserve(MAX_WORK_ITEM);
+  bufs = static_cast<rpc_bufs_t*>(malloc(sizeof(rpc_bufs_t)));
+  if (bufs == NULL) ABORT("malloc");
 #ifndef NDEBUG
   if (pctx.verbose || pctx.my_rank == 0) {
     logf(LOG_INFO, "[bg] rpc worker up (rank %d)", pctx.my_rank);
@@ -222,40 +401,41 @@ static void* rpc_work(void* arg) {
 #endif
 
 #if defined(__linux)
-  rpcu_start(RUSAGE_THREAD, &rpcus[RPCU_WORKER]);
+  rpcu_start(RUSAGE_THREAD, &u);
 #endif
 
   while (true) {
-    todo.clear();
-    pthread_mtx_lock(&mtx[wk_cv]);
-    items_completed += num_items;
-    if (items_completed == items_submitted) {
-      pthread_cv_notifyall(&cv[wk_cv]);
-    }
-    pthread_mtx_unlock(&mtx[wk_cv]);
-    num_items = 0;
     s = is_shuttingdown();
     if (s == 0) {
-      pthread_mtx_lock(&mtx[wk_cv]);
-      while (wk_items.empty() && is_shuttingdown() == 0) {
-        pthread_cv_wait(&cv[wk_cv], &mtx[wk_cv]);
-      }
-      todo.swap(wk_items);
-      pthread_mtx_unlock(&mtx[wk_cv]);
-      if (!todo.empty()) {
-        num_items = todo.size();
-        hstg_add(nnctx.iq_dep, num_items);
-        for (it = todo.begin(); it != todo.end(); ++it) {
-          h = static_cast<hg_handle_t>(*it);
-          if (h != NULL) {
-            hret = nn_shuffler_write_rpc_handler(h, &info);
-            if (hret != HG_SUCCESS) {
-              RPC_FAILED("fail to exec rpc", hret);
-            }
-            total_writes += info.num_writes;
-            total_bytes += info.sz;
-          }
+      h = static_cast<hg_handle_t>(wk_pop(&depth));
+      if (h == NULL) {
+        pthread_mtx_lock(&mtx[wk_cv]);
+        __sync_fetch_and_add(&wk_sleepers, 1);
+        while ((h = static_cast<hg_handle_t>(wk_pop(&depth))) == NULL &&
+               is_shuttingdown() == 0) {
+          pthread_cv_wait(&cv[wk_cv], &mtx[wk_cv]);
         }
+        __sync_fetch_and_sub(&wk_sleepers, 1);
+        pthread_mtx_unlock(&mtx[wk_cv]);
+        if (h == NULL) {
+          continue;
+        }
+      }
+      hstg_add(iq_dep, depth);
+      start = now_micros();
+      hret = nn_shuffler_write_rpc_handler(h, &info, bufs);
+      if (hret != HG_SUCCESS) {
+        RPC_FAILED("fail to exec rpc", hret);
+      }
+      busy += now_micros() - start;
+      total_writes += info.num_writes;
+      total_bytes += info.sz;
+      total_rpcs++;
+      if (__sync_add_and_fetch(&items_completed, 1) ==
+          __sync_fetch_and_add(&items_submitted, 0)) {
+        pthread_mtx_lock(&mtx[wk_cv]);
+        pthread_cv_notifyall(&cv[wk_cv]);
+        pthread_mtx_unlock(&mtx[wk_cv]);
       }
     } else if (s < 0) {
 #ifndef NDEBUG
@@ -280,18 +460,24 @@ static void* rpc_work(void* arg) {
   }
 
 #if defined(__linux)
-  rpcu_end(RUSAGE_THREAD, &rpcus[RPCU_WORKER]);
+  rpcu_end(RUSAGE_THREAD, &u);
 #endif
-  rpcu_accumulate(&nnctx.r[RPCU_WORKER], &rpcus[RPCU_WORKER]);
+  free(bufs);
 
   pthread_mtx_lock(&mtx[bg_cv]);
+  rpcu_accumulate(&nnctx.r[RPCU_WORKER], &u);
+  nnctx.r[RPCU_WORKER].busy_micros += busy;
+  if (busy > nnctx.max_wk_busy) nnctx.max_wk_busy = busy;
+  if (busy < nnctx.min_wk_busy) nnctx.min_wk_busy = busy;
+  hstg_merge(nnctx.iq_dep, iq_dep);
+  nnctx.total_writes += total_writes;
+  nnctx.total_msgsz += total_bytes;
+  nnctx.total_rpcs += total_rpcs;
   assert(num_wk > 0);
   num_wk--;
   pthread_cv_notifyall(&cv[bg_cv]);
   pthread_mtx_unlock(&mtx[bg_cv]);
 
-  nnctx.total_writes = total_writes;
-  nnctx.total_msgsz = total_bytes;
 #ifndef NDEBUG
   if (pctx.verbose || pctx.my_rank == 0) {
     logf(LOG_INFO, "[bg] rpc worker down (rank %d)", pctx.my_rank);
@@ -306,7 +492,8 @@ void nn_shuffler_bgwait() {
   useconds_t delay;
   delay = 1000; /* 1000 us */
   pthread_mtx_lock(&mtx[wk_cv]);
-  while (items_completed < items_submitted) {
+  while (__sync_fetch_and_add(&items_completed, 0) <
+         __sync_fetch_and_add(&items_submitted, 0)) {
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[wk_cv]);
       if (pctx.trace != NULL) {
@@ -326,16 +513,34 @@ void nn_shuffler_bgwait() {
 
 /* nn_shuffler_write_rpc_handler_wrapper: server-side rpc handler wrapper */
 hg_return_t nn_shuffler_write_rpc_handler_wrapper(hg_handle_t h) {
+  /* without workers, rpcs are executed by the progress thread only */
+  static rpc_bufs_t* bufs = NULL;
   if (num_wk == 0) {
-    return nn_shuffler_write_rpc_handler(h, NULL);
+    if (bufs == NULL) {
+      bufs = static_cast<rpc_bufs_t*>(malloc(sizeof(rpc_bufs_t)));
+      if (bufs == NULL) ABORT("malloc");
+    }
+    const uint64_t start = now_micros();
+    const hg_return_t hret = nn_shuffler_write_rpc_handler(h, NULL, bufs);
+    const uint64_t end = now_micros();
+    if (inl.start == 0) inl.start = start;
+    inl.busy += end - start;
+    if (end - inl.start >= INLINE_WINDOW_MICROS) {
+      inl.util = double(inl.busy) / double(end - inl.start);
+      inl.start = end;
+      inl.busy = 0;
+    }
+    return hret;
   }
-  pthread_mtx_lock(&mtx[wk_cv]);
-  wk_items.push_back(static_cast<void*>(h));
-  if (wk_items.size() == 1) {
+  __sync_fetch_and_add(&items_submitted, 1);
+  while (!wk_push(static_cast<void*>(h))) {
+    sched_yield(); /* ring full: workers are behind */
+  }
+  if (__sync_fetch_and_add(&wk_sleepers, 0) != 0) {
+    pthread_mtx_lock(&mtx[wk_cv]);
     pthread_cv_notifyall(&cv[wk_cv]);
+    pthread_mtx_unlock(&mtx[wk_cv]);
   }
-  items_submitted++;
-  pthread_mtx_unlock(&mtx[wk_cv]);
 
   return HG_SUCCESS;
 }
@@ -364,13 +569,46 @@ void nn_shuffler_debug(int src, int dst, int me, int hp) {
 }
 }  // namespace
 
-/* nn_shuffler_write_rpc_handler: server-side rpc handler */
-hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
-  /* here we assume we will only get called by a single thread.
-   * this thread is either a dedicated mercury progressing thread, or a separate
-   * rpc worker thread. */
-  static char buf[MAX_RPC_MESSAGE];
+/*
+ * nn_shuffler_credits: the window of async rpcs we grant to each sender.
+ * full while our workers keep up, then shrinking with the num of rpcs
+ * waiting for them. without workers, full while the progress thread is
+ * busy with rpcs at most half of the time, then shrinking to 1 as it
+ * approaches being busy all the time.
+ */
+static int nn_shuffler_credits() {
+  size_t backlog;
+  int c;
+
+  if (num_wk == 0) {
+    if (inl.util <= 0.5) {
+      return peer_credits;
+    }
+    c = int(peer_credits * (1 - inl.util) / 0.5);
+    return std::max(1, c);
+  }
+  backlog = __sync_fetch_and_add(&items_submitted, 0) -
+            __sync_fetch_and_add(&items_completed, 0);
+  if (backlog <= WK_RING_SZ / 4) {
+    return peer_credits;
+  } else if (backlog >= WK_RING_SZ) {
+    return 1;
+  }
+  c = int(peer_credits * (WK_RING_SZ - backlog) / (WK_RING_SZ * 3 / 4));
+
+  return std::max(1, c);
+}
 
+/* nn_shuffler_write_rpc_handler: server-side rpc handler */
+hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info,
+                                          rpc_bufs_t* bufs) {
+  /* bufs belong to the calling thread, which is either the mercury
+   * progressing thread or one of the rpc workers. */
+  char* const buf = bufs->buf;
+  char* msg;
+  uint32_t msg_sz;
+  uint64_t start;
+  long rv;
   char* input;
   uint32_t input_left;
   hg_return_t hret;
@@ -378,13 +616,14 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
   write_in_t write_in;
   write_info_t write_info;
   char* req;
-  unsigned int req_sz;
+  size_t req_sz;
+  size_t len_sz;
   int epoch;
   int src;
   int dst;
-  int target_rank;
+  int target_ranks[2];
   int rank;
-  int rv;
+  int n;
 
   assert(nnctx.mssg != NULL);
   rank = mssg_get_rank(nnctx.mssg);
@@ -415,45 +654,55 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
               src);
     }
   }
-  write_out.rv = 0;
-  input_left = write_info.sz = write_in.sz;
+  write_info.sz = write_in.sz;
   epoch = write_in.epo;
   write_info.num_writes = 0;
-  input = buf;
 
-  /* decode and execute writes */
-  while (input_left != 0) {
-    if (input_left < 1) {
-      ABORT("premature end of msg");
-    }
-    req_sz = static_cast<unsigned char>(input[0]);
-    input_left -= 1;
-    input += 1;
-    if (input_left < req_sz) {
-      ABORT("premature end of msg");
+  msg = buf;
+  msg_sz = write_in.sz;
+  if (nnctx.shctx->codec != SHUFFLE_CODEC_NONE) {
+    start = now_micros();
+    rv = shuffle_codec_decode(buf, write_in.sz, bufs->raw, sizeof(bufs->raw),
+                              bufs->scratch);
+    if (rv < 0) {
+      ABORT("rpc msg corrupted (bad codec frame)");
     }
-    req = input;
-    input_left -= req_sz;
-    input += req_sz;
+    msg = bufs->raw;
+    msg_sz = static_cast<uint32_t>(rv);
+    __sync_fetch_and_add(&pctx.mctx.codec_dec_micros, now_micros() - start);
+  }
 
-    if (nnctx.paranoid_checks) {
-      target_rank = shuffle_target(nnctx.shctx, req, req_sz);
-      if (rank != target_rank) {
-        nn_shuffler_debug(src, dst, rank, target_rank);
-        ABORT("rpc msg misdirected");
+  /* check that every write has been sent to the right place */
+  if (nnctx.paranoid_checks) {
+    input_left = msg_sz;
+    input = msg;
+    while (input_left != 0) {
+      len_sz = shuffle_getlen(input, input_left, &req_sz);
+      if (len_sz == 0) {
+        ABORT("bad req size in msg");
       }
-    }
+      input_left -= len_sz;
+      input += len_sz;
+      if (input_left < req_sz) {
+        ABORT("premature end of msg");
+      }
+      req = input;
+      input_left -= req_sz;
+      input += req_sz;
 
-    rv = shuffle_handle(nnctx.shctx, req, req_sz, epoch, src, dst);
-    write_info.num_writes++;
-    if (write_out.rv == 0) {
-      write_out.rv = rv;
-    }
-    if (rv != 0) {
-      break;
+      n = shuffle_candidates(nnctx.shctx, req, req_sz, target_ranks);
+      if (rank != target_ranks[0] && (n < 2 || rank != target_ranks[1])) {
+        nn_shuffler_debug(src, dst, rank, target_ranks[0]);
+        ABORT("rpc msg misdirected");
+      }
     }
   }
 
+  /* execute all writes as a single batch */
+  write_out.rv = shuffle_handle_batch(nnctx.shctx, msg, msg_sz, epoch, src,
+                                      dst, &write_info.num_writes);
+  write_out.credits = nn_shuffler_credits();
+
   hret = HG_Respond(h, NULL, NULL, &write_out);
   if (hret != HG_SUCCESS) {
     RPC_FAILED("HG_Respond", hret);
@@ -478,6 +727,9 @@ hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info) {
   int cache;
   write_async_cb_t* write_cb;
   write_out_t write_out;
+  rpcq_t* rpcq;
+  uint64_t lat;
+  int credits = 1;
   int rv;
 
   assert(info->type == HG_CB_FORWARD);
@@ -494,20 +746,31 @@ hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info) {
     RPC_FAILED("HG_Get_output", hret);
   } else {
     rv = write_out.rv;
+    credits = write_out.credits;
   }
 
   HG_Free_output(h, &write_out);
+  lat = now_micros() - write_cb->start;
   shuffle_msg_replied(write_cb->arg1, write_cb->arg2);
+  if (tn.on) {
+    tuner_sample(write_cb->sz, write_cb->start);
+  }
 
-  /* return rpc callback slot */
+  /* return rpc callback slot and peer credit */
+  rpcq = &rpcqs[write_cb->peer];
   pthread_mtx_lock(&mtx[cb_cv]);
   cache = nnctx.cache_hlds && (h == hg_hdls[write_cb->slot]);
   cb_flags[write_cb->slot] = 0;
   assert(cb_left < cb_allowed);
-  if (cb_left == 0 || cb_left == cb_allowed - 1) {
+  assert(rpcq->nrpcs > 0);
+  if (cb_left == 0 || cb_left == cb_allowed - 1 ||
+      rpcq->nrpcs >= rpcq->credits) {
     pthread_cv_notifyall(&cv[cb_cv]);
   }
   cb_left++;
+  rpcq->nrpcs--;
+  rpcq->credits = std::max(1, std::min(credits, peer_credits));
+  hstg_add(nnctx.rpc_lat, lat);
   pthread_mtx_unlock(&mtx[cb_cv]);
   if (!cache) {
     HG_Destroy(h);
@@ -530,6 +793,7 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   hg_addr_t peer_addr;
   hg_handle_t h;
   write_async_cb_t* write_cb;
+  rpcq_t* rpcq;
   time_t now;
   struct timespec abstime;
   useconds_t delay;
@@ -553,9 +817,10 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
 
   delay = 1000; /* 1000 us */
 
-  /* wait for slot */
+  /* wait for slot and peer credit */
+  rpcq = &rpcqs[peer_rank];
   pthread_mtx_lock(&mtx[cb_cv]);
-  while (cb_left == 0) { /* no slots available */
+  while (cb_left == 0 || rpcq->nrpcs >= rpcq->credits) {
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[cb_cv]);
       if (pctx.trace != NULL) {
@@ -573,7 +838,7 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
       e = pthread_cv_timedwait(&cv[cb_cv], &mtx[cb_cv], &abstime);
       if (e == ETIMEDOUT) {
         rpc_explain_timeout();
-        ABORT("timeout waiting for rpc slot");
+        ABORT("timeout waiting for rpc slot or peer credit");
       }
     }
   }
@@ -587,6 +852,7 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   cb_flags[slot] = 1;
   assert(cb_left > 0);
   cb_left--;
+  rpcq->nrpcs++;
 
   pthread_mtx_unlock(&mtx[cb_cv]);
 
@@ -612,18 +878,39 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   }
 
   write_cb->slot = slot;
+  write_cb->peer = peer_rank;
   write_cb->arg1 = arg1;
   write_cb->arg2 = arg2;
+  write_cb->start = now_micros();
+  write_cb->sz = write_in->sz;
 
   hret = HG_Forward(h, nn_shuffler_write_async_handler, write_cb, write_in);
 
   if (hret != HG_SUCCESS) {
     RPC_FAILED("HG_Forward", hret);
   }
+  if (nnctx.hg_spin != 0) {
+    looper_kick = 1;
+  }
 
   return 0;
 }
 
+/*
+ * nn_shuffler_backlog: return the number of rpcs sent to a peer and not yet
+ * replied, plus the number of its buffers being flushed right now. reads are
+ * unlocked so the result is only a hint that may already be stale.
+ */
+int nn_shuffler_backlog(int peer_rank) {
+  rpcq_t* rpcq;
+
+  assert(peer_rank < nrpcqs);
+  rpcq = &rpcqs[peer_rank];
+
+  return __sync_fetch_and_add(&rpcq->nrpcs, 0) +
+         *static_cast<volatile int*>(&rpcq->busy);
+}
+
 /* nn_shuffler_waitcb: block until all outstanding rpc finishes */
 void nn_shuffler_waitcb() {
   time_t now;
@@ -725,6 +1012,9 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
   if (hret != HG_SUCCESS) {
     RPC_FAILED("HG_Forward", hret);
   }
+  if (nnctx.hg_spin != 0) {
+    looper_kick = 1;
+  }
 
   delay = 1000; /* 1000 us */
 
@@ -774,49 +1064,189 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
   return rv;
 }
 
-/* nn_shuffler_enqueue:
- *   encode a req and append it into a corresponding rpc queue */
-void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
-                         int peer_rank, int rank) {
-  write_in_t write_in;
-  rpcq_t* rpcq;
-  int rpcq_idx;
-  time_t now;
-  struct timespec abstime;
-  useconds_t delay;
-  int world_sz;
-  int rv;
-  void* arg1;
-  void* arg2;
-  int e;
+/* nn_shuffler_encode: replace the payload of a write_in with a codec frame
+ * built from the queued writes. the frame lives in the buffer's zbuf so
+ * the buffer must stay in flight until the rpc is sent. */
+static void nn_shuffler_encode(rpcbuf_t* b, write_in_t* write_in) {
+  const uint64_t start = now_micros();
+  size_t len_sz;
+  size_t req_sz;
+  size_t sz;
+
+  assert(b->zbuf != NULL && b->sz != 0);
+  len_sz = shuffle_getlen(b->buf, b->sz, &req_sz);
+  assert(len_sz != 0);
+  /* queued writes are [len][req] records, with names right after len */
+  sz = shuffle_codec_encode(nnctx.shctx->codec, b->buf, b->sz,
+                            len_sz + req_sz, len_sz, nnctx.shctx->fname_len,
+                            b->zbuf,
+                            b->zbuf + max_rpcq_sz + SHUFFLE_CODEC_OVERHEAD);
+  write_in->msg = b->zbuf;
+  write_in->sz = sz;
+
+  __sync_fetch_and_add(&pctx.mctx.codec_raw_bytes, b->sz);
+  __sync_fetch_and_add(&pctx.mctx.codec_wire_bytes, sz);
+  __sync_fetch_and_add(&pctx.mctx.codec_enc_micros, now_micros() - start);
+}
 
-  assert(nnctx.mssg != NULL);
-  assert(rank == mssg_get_rank(nnctx.mssg));
-  world_sz = mssg_get_count(nnctx.mssg);
+/* slab_lru_add: append a queue to the lru list. called with the pool's
+ * lock held. */
+static void slab_lru_add(int q) {
+  rpcqs[q].lru_prev = pool.lru_tail;
+  rpcqs[q].lru_next = -1;
+  if (pool.lru_tail != -1) {
+    rpcqs[pool.lru_tail].lru_next = q;
+  } else {
+    pool.lru_head = q;
+  }
+  pool.lru_tail = q;
+}
 
-  if (nnctx.paranoid_checks) {
-    if (!shuffle_is_rank_receiver(nnctx.shctx, peer_rank)) {
-      ABORT("peer rank is not a receiver");
+/* slab_lru_del: remove a queue from the lru list. called with the pool's
+ * lock held. */
+static void slab_lru_del(int q) {
+  if (rpcqs[q].lru_prev != -1) {
+    rpcqs[rpcqs[q].lru_prev].lru_next = rpcqs[q].lru_next;
+  } else {
+    pool.lru_head = rpcqs[q].lru_next;
+  }
+  if (rpcqs[q].lru_next != -1) {
+    rpcqs[rpcqs[q].lru_next].lru_prev = rpcqs[q].lru_prev;
+  } else {
+    pool.lru_tail = rpcqs[q].lru_prev;
+  }
+  rpcqs[q].lru_prev = rpcqs[q].lru_next = -1;
+}
+
+/* slab_grow: carve a new chunk into slabs. called with the pool's lock
+ * held and only when the pool is still under budget. */
+static void slab_grow() {
+  size_t n;
+  char* chunk;
+
+  assert(pool.nslabs < pool.max_slabs);
+  n = SLAB_CHUNK / pool.slab_sz;
+  if (n < 1) n = 1;
+  if (n > pool.max_slabs - pool.nslabs) n = pool.max_slabs - pool.nslabs;
+  chunk = static_cast<char*>(malloc(n * pool.slab_sz));
+  if (chunk == NULL) ABORT("malloc");
+  pool.chunks->push_back(chunk);
+  for (size_t i = 0; i < n; i++) {
+    void* const slab = chunk + i * pool.slab_sz;
+    *static_cast<void**>(slab) = pool.free;
+    pool.free = slab;
+  }
+  pool.nslabs += n;
+}
+
+/* slab_put: give a sent buffer's slab back to the pool. called without the
+ * queue's lock: the buffer is still flying, so only its sender touches it,
+ * and a writer blocked in slab_get() on the same queue holds that lock
+ * while it waits for the pool. */
+static void slab_put(rpcbuf_t* b) {
+  assert(b->buf != NULL);
+  pthread_mtx_lock(&pool.mtx);
+  *reinterpret_cast<void**>(b->buf) = pool.free;
+  pool.free = b->buf;
+  assert(pool.inuse > 0);
+  pool.inuse--;
+  pthread_cv_notifyall(&pool.cv);
+  pthread_mtx_unlock(&pool.mtx);
+  b->buf = b->zbuf = NULL;
+}
+
+static void nn_shuffler_sendq(rpcq_t* rpcq, int peer_rank, int rank);
+
+/* slab_get: attach a slab to the empty buffer being filled and put the
+ * queue on the lru list. called with the queue's lock held. if the pool
+ * is out of budget, other queues are trylocked in lru order and the first
+ * one we get is sent early. return the time we waited in micros. */
+static uint64_t slab_get(rpcq_t* rpcq, int rank) {
+  rpcbuf_t* const b = &rpcq->bufs[rpcq->cur];
+  const int me = static_cast<int>(rpcq - rpcqs);
+  struct timespec abstime;
+  uint64_t start;
+  rpcq_t* victim;
+  void* slab;
+  int q;
+
+  assert(b->buf == NULL && b->sz == 0 && b->flying == 0);
+  start = 0;
+
+  pthread_mtx_lock(&pool.mtx);
+  while (pool.free == NULL) {
+    if (pool.nslabs < pool.max_slabs) {
+      slab_grow();
+      continue;
     }
-    if (peer_rank < 0 || peer_rank >= world_sz) {
-      ABORT("invalid peer rank");
+    if (start == 0) {
+      start = now_micros();
+    }
+    victim = NULL;
+    for (q = pool.lru_head; q != -1; q = rpcqs[q].lru_next) {
+      if (q != me && pthread_mutex_trylock(&rpcqs[q].mtx) == 0) {
+        victim = &rpcqs[q];
+        break;
+      }
+    }
+    if (victim != NULL) {
+      pool.evictions++;
+      pthread_mtx_unlock(&pool.mtx);
+      /* holding its lock, the victim is still partial and not in flight */
+      nn_shuffler_sendq(victim, q, rank);
+      pthread_mtx_unlock(&victim->mtx);
+      pthread_mtx_lock(&pool.mtx);
+    } else {
+      /* all partial buffers are busy, wait for slabs in flight */
+      if (now_micros() - start > uint64_t(nnctx.timeout) * 1000000) {
+        rpc_explain_timeout();
+        ABORT("timeout waiting for rpc buffer memory");
+      }
+      clock_gettime(CLOCK_REALTIME, &abstime);
+      abstime.tv_nsec += 1000 * 1000; /* 1 ms */
+      if (abstime.tv_nsec >= 1000 * 1000 * 1000) {
+        abstime.tv_nsec -= 1000 * 1000 * 1000;
+        abstime.tv_sec++;
+      }
+      pthread_cv_timedwait(&pool.cv, &pool.mtx, &abstime);
     }
   }
+  slab = pool.free;
+  pool.free = *static_cast<void**>(slab);
+  pool.inuse++;
+  if (pool.inuse > pool.peak) {
+    pool.peak = pool.inuse;
+  }
+  slab_lru_add(me);
+  pthread_mtx_unlock(&pool.mtx);
 
-  pthread_mtx_lock(&mtx[qu_cv]);
+  b->buf = static_cast<char*>(slab);
+  if (nnctx.shctx->codec != SHUFFLE_CODEC_NONE) {
+    b->zbuf = b->buf + pool.buf_sz;
+  }
 
-  rpcq_idx = peer_rank; /* we have one queue per rank */
-  assert(rpcq_idx < nrpcqs);
-  rpcq = &rpcqs[rpcq_idx];
-  assert(rpcq != NULL);
-  assert(rpcq->buf != NULL);
+  return (start != 0) ? now_micros() - start : 0;
+}
+
+/* nn_shuffler_waitq: wait until the buffer being filled is no longer in
+ * flight, or with drain set, until no buffer of the queue is. called with
+ * the queue's lock held. return the time we waited in micros. */
+static uint64_t nn_shuffler_waitq(rpcq_t* rpcq, int drain) {
+  time_t now;
+  struct timespec abstime;
+  useconds_t delay;
+  uint64_t start;
+  int e;
 
   delay = 1000; /* 1000 us */
+  start = 0;
 
-  /* wait for queue */
-  while (rpcq->busy != 0) {
+  while (drain ? rpcq->busy != 0 : rpcq->bufs[rpcq->cur].flying != 0) {
+    if (start == 0) {
+      start = now_micros();
+    }
     if (pctx.testin) {
-      pthread_mtx_unlock(&mtx[qu_cv]);
+      pthread_mtx_unlock(&rpcq->mtx);
       if (pctx.trace != NULL) {
         fprintf(pctx.trace, "[ENQUEUE-WAIT] %d us\n", int(delay));
       }
@@ -824,13 +1254,13 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
       usleep(delay);
       delay <<= 1;
 
-      pthread_mtx_lock(&mtx[qu_cv]);
+      pthread_mtx_lock(&rpcq->mtx);
     } else {
       now = time(NULL);
       abstime.tv_sec = now + nnctx.timeout;
       abstime.tv_nsec = 0;
 
-      e = pthread_cv_timedwait(&cv[qu_cv], &mtx[qu_cv], &abstime);
+      e = pthread_cv_timedwait(&rpcq->cv, &rpcq->mtx, &abstime);
       if (e == ETIMEDOUT) {
         rpc_explain_timeout();
         ABORT("timeout waiting for rpc queue to flush");
@@ -838,116 +1268,309 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
     }
   }
 
-  /* flush queue if full */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
-    if (rpcq->sz > MAX_RPC_MESSAGE) {
-      /* happens when the total size of queued data is greater than
-       * the size limit for an rpc message */
-      ABORT("rpc overflow");
-    } else {
-      rpcq->busy = 1; /* force other writers to block */
-      /* unlock when sending the rpc */
-      pthread_mtx_unlock(&mtx[qu_cv]);
-      write_in.dst = peer_rank;
-      write_in.src = rank;
-      write_in.epo = rpcq->lepo;
-      write_in.sz = rpcq->sz;
-      write_in.msg = rpcq->buf;
-      write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
-      if (!nnctx.force_sync) {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
-      } else {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send(&write_in, peer_rank);
-        shuffle_msg_replied(arg1, arg2);
-      }
-      if (rv != 0) {
-        ABORT("plfsdir peer write failed");
-      }
-      pthread_mtx_lock(&mtx[qu_cv]);
-      pthread_cv_notifyall(&cv[qu_cv]);
-      rpcq->busy = 0;
-      rpcq->sz = 0;
+  return (start != 0) ? now_micros() - start : 0;
+}
+
+/* nn_shuffler_sendq: send out all writes in the buffer being filled as one
+ * rpc. called with the queue's lock held. the buffer is marked in flight
+ * and writers are moved to a spare buffer if one is free. the lock is
+ * released while the rpc is being sent so that writers to the same peer
+ * only wait for us when the queue is out of buffers, and writers to other
+ * peers are unaffected. */
+static void nn_shuffler_sendq(rpcq_t* rpcq, int peer_rank, int rank) {
+  rpcbuf_t* const b = &rpcq->bufs[rpcq->cur];
+  write_in_t write_in;
+  void* arg1;
+  void* arg2;
+  int rv;
+  int i;
+
+  assert(b->flying == 0 && b->sz != 0);
+  if (b->sz > MAX_RPC_MESSAGE) {
+    /* happens when the total size of queued data is greater than
+     * the size limit for an rpc message */
+    ABORT("rpc overflow");
+  }
+
+  b->flying = 1; /* force other writers to move on or block */
+  rpcq->busy++;
+  pthread_mtx_lock(&pool.mtx);
+  slab_lru_del(static_cast<int>(rpcq - rpcqs));
+  pthread_mtx_unlock(&pool.mtx);
+  for (i = 1; i < rpcq_nbufs; i++) {
+    const int j = (rpcq->cur + i) % rpcq_nbufs;
+    if (rpcq->bufs[j].flying == 0) {
+      rpcq->cur = j;
+      break;
+    }
+  }
+  /* unlock when sending the rpc */
+  pthread_mtx_unlock(&rpcq->mtx);
+  write_in.dst = peer_rank;
+  write_in.src = rank;
+  write_in.epo = b->lepo;
+  write_in.sz = b->sz;
+  write_in.msg = b->buf;
+  if (b->zbuf != NULL) {
+    nn_shuffler_encode(b, &write_in);
+  }
+  write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
+  if (!nnctx.force_sync) {
+    shuffle_msg_sent(0, &arg1, &arg2);
+    rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
+  } else {
+    const uint64_t start = now_micros();
+    shuffle_msg_sent(0, &arg1, &arg2);
+    rv = nn_shuffler_write_send(&write_in, peer_rank);
+    shuffle_msg_replied(arg1, arg2);
+    pthread_mtx_lock(&mtx[cb_cv]);
+    hstg_add(nnctx.rpc_lat, now_micros() - start);
+    pthread_mtx_unlock(&mtx[cb_cv]);
+    if (tn.on) {
+      tuner_sample(write_in.sz, start);
+    }
+  }
+  if (rv != 0) {
+    ABORT("plfsdir peer write failed");
+  }
+  slab_put(b);
+  pthread_mtx_lock(&rpcq->mtx);
+  b->flying = 0;
+  b->sz = 0;
+  rpcq->busy--;
+  /* writers were blocked on us if no spare buffer was free */
+  if (rpcq->bufs[rpcq->cur].flying != 0) {
+    rpcq->cur = static_cast<int>(b - rpcq->bufs);
+  }
+  pthread_cv_notifyall(&rpcq->cv);
+}
+
+/* nn_shuffler_reserve:
+ *   make room for a req in a corresponding rpc queue and return where
+ *   its req_sz bytes go. the queue stays locked until nn_shuffler_commit */
+char* nn_shuffler_reserve(size_t req_sz, int epoch, int peer_rank,
+                          int rank) {
+  const size_t len_sz = shuffle_lensz(req_sz);
+  rpcbuf_t* b;
+  rpcq_t* rpcq;
+  char* slot;
+  int rpcq_idx;
+  int world_sz;
+
+  assert(nnctx.mssg != NULL);
+  assert(rank == mssg_get_rank(nnctx.mssg));
+  world_sz = mssg_get_count(nnctx.mssg);
+
+  if (nnctx.paranoid_checks) {
+    if (!shuffle_is_rank_receiver(nnctx.shctx, peer_rank)) {
+      ABORT("peer rank is not a receiver");
+    }
+    if (peer_rank < 0 || peer_rank >= world_sz) {
+      ABORT("invalid peer rank");
     }
   }
 
-  /* enqueue */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
+  rpcq_idx = peer_rank; /* we have one queue per rank */
+  assert(rpcq_idx < nrpcqs);
+  rpcq = &rpcqs[rpcq_idx];
+  assert(rpcq != NULL);
+  assert(rpcq->bufs != NULL);
+
+  pthread_mtx_lock(&rpcq->mtx);
+
+  /* wait for queue */
+  rpcq->blocked_micros += nn_shuffler_waitq(rpcq, 0);
+
+  /* flush queue if full. other writers may have partially filled the
+   * spare buffer we switched to while we were sending, so check again */
+  b = &rpcq->bufs[rpcq->cur];
+  while (b->sz != 0 && b->sz + len_sz + req_sz > rpcq_target) {
+    nn_shuffler_sendq(rpcq, peer_rank, rank);
+    rpcq->blocked_micros += nn_shuffler_waitq(rpcq, 0);
+    b = &rpcq->bufs[rpcq->cur];
+  }
+
+  if (b->buf == NULL) {
+    rpcq->blocked_micros += slab_get(rpcq, rank);
+  }
+
+  if (b->sz + len_sz + req_sz > max_rpcq_sz) {
     /* happens when the memory reserved for the queue is smaller than
      * a single write */
     ABORT("rpc overflow");
-  } else {
-    rpcq->lepo = epoch;
-    rpcq->buf[rpcq->sz] = req_sz;
-    memcpy(rpcq->buf + rpcq->sz + 1, req, req_sz);
-    rpcq->sz += req_sz + 1;
   }
 
-  pthread_mtx_unlock(&mtx[qu_cv]);
+  b->lepo = epoch;
+  shuffle_putlen(b->buf + b->sz, req_sz);
+  slot = b->buf + b->sz + len_sz;
+  b->sz += len_sz + req_sz;
+
+  return slot;
+}
+
+/* nn_shuffler_commit:
+ *   unlock the rpc queue after the reserved req has been filled */
+void nn_shuffler_commit(int peer_rank) {
+  assert(peer_rank < nrpcqs);
+  pthread_mtx_unlock(&rpcqs[peer_rank].mtx);
+}
+
+/* nn_shuffler_enqueue:
+ *   encode a req and append it into a corresponding rpc queue */
+void nn_shuffler_enqueue(char* req, size_t req_sz, int epoch,
+                         int peer_rank, int rank) {
+  memcpy(nn_shuffler_reserve(req_sz, epoch, peer_rank, rank), req, req_sz);
+  nn_shuffler_commit(peer_rank);
 }
 
 /* nn_shuffler_flushq: force flushing all rpc queue */
 void nn_shuffler_flushq() {
-  write_in_t write_in;
   rpcq_t* rpcq;
-  void* arg1;
-  void* arg2;
   int peer_rank_idx;
   int peer_rank;
   int rank;
-  int rv;
 
   assert(nnctx.mssg != NULL);
   rank = mssg_get_rank(nnctx.mssg);
 
-  pthread_mtx_lock(&mtx[qu_cv]);
-
   for (peer_rank_idx = 0; peer_rank_idx < nrpcqs; peer_rank_idx++) {
     peer_rank = rpcq_order[peer_rank_idx];
     rpcq = &rpcqs[peer_rank];
-    if (rpcq->sz == 0) { /* skip empty queue */
+    if (rpcq->bufs == NULL) { /* not a receiver */
       continue;
-    } else if (rpcq->sz > MAX_RPC_MESSAGE) {
-      ABORT("rpc overflow");
-    } else {
-      rpcq->busy = 1; /* force other writers to block */
-      /* unlock when sending the rpc */
-      pthread_mtx_unlock(&mtx[qu_cv]);
-      write_in.dst = peer_rank;
-      write_in.src = rank;
-      write_in.epo = rpcq->lepo;
-      write_in.sz = rpcq->sz;
-      write_in.msg = rpcq->buf;
-      write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
-      if (!nnctx.force_sync) {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
-      } else {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send(&write_in, peer_rank);
-        shuffle_msg_replied(arg1, arg2);
-      }
-      if (rv != 0) {
-        ABORT("plfsdir peer write failed");
-      }
-      pthread_mtx_lock(&mtx[qu_cv]);
-      pthread_cv_notifyall(&cv[qu_cv]);
-      rpcq->busy = 0;
-      rpcq->sz = 0;
     }
+    pthread_mtx_lock(&rpcq->mtx);
+    /* concurrent writers may be flushing the queue */
+    nn_shuffler_waitq(rpcq, 0);
+    if (rpcq->bufs[rpcq->cur].sz != 0) { /* skip empty queue */
+      nn_shuffler_sendq(rpcq, peer_rank, rank);
+    }
+    /* wait for all buffers to be sent so all writes are out on return */
+    nn_shuffler_waitq(rpcq, 1);
+    pthread_mtx_unlock(&rpcq->mtx);
+  }
+}
+
+/* nn_shuffler_tune: adjust batch size and rpc window from the samples of
+ * the epoch that just ended. must be called by all ranks with no rpc in
+ * flight. */
+void nn_shuffler_tune() {
+  unsigned long long sum[3];
+  unsigned long long loc[3];
+  unsigned long long dura;
+  unsigned long long max_dura;
+  const char* why;
+  double lat;
+  double tput;
+  size_t batch;
+  int window;
+
+  if (!tn.on) {
+    return;
+  }
+
+  loc[0] = tn.rpcs;
+  loc[1] = tn.bytes;
+  loc[2] = tn.lat_micros;
+  dura = (tn.first_send != 0) ? now_micros() - tn.first_send : 0;
+  MPI_Allreduce(loc, sum, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  MPI_Allreduce(&dura, &max_dura, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX,
+                MPI_COMM_WORLD);
+  tn.rpcs = tn.bytes = tn.lat_micros = 0;
+  tn.first_send = 0;
+  tn.epoch++;
+  if (sum[0] == 0 || max_dura == 0) {
+    return; /* nothing was sent */
+  }
+
+  lat = double(sum[2]) / sum[0];
+  tput = double(sum[1]) / max_dura * 1000000;
+  window = cb_allowed;
+  batch = rpcq_target;
+
+  if (tn.min_lat == 0 || lat < tn.min_lat) {
+    tn.min_lat = lat;
+  }
+  if (!nnctx.force_sync && lat > tn.min_lat * (1 + TUNE_LAT_SLACK)) {
+    window = std::max(tn.wmin, window / 2);
+    why = "latency up";
+  } else if (tn.last_tput != 0 && tput < tn.last_tput * (1 - TUNE_TPUT_SLACK)) {
+    batch = std::max(tn.bmin, batch - batch / 4);
+    why = "throughput down";
+  } else {
+    if (!nnctx.force_sync) window = std::min(tn.wmax, window + 1);
+    batch = std::min(tn.bmax, batch + tn.bstep);
+    why = "probing";
   }
+  tn.last_tput = tput;
 
-  pthread_mtx_unlock(&mtx[qu_cv]);
+  if (pctx.my_rank == 0) {
+    logf(LOG_INFO,
+         "[tune] epoch %d: %s rpcs, %s/s, avg latency %.0f us (best %.0f us)"
+         "\n>>> %s: rpc window %d -> %d, batch %s -> %s",
+         tn.epoch, pretty_num(sum[0]).c_str(), pretty_size(tput).c_str(), lat,
+         tn.min_lat, why, cb_allowed, window,
+         pretty_size(rpcq_target).c_str(), pretty_size(batch).c_str());
+  }
+
+  rpcq_target = batch;
+  pthread_mtx_lock(&mtx[cb_cv]);
+  assert(cb_left == cb_allowed);
+  cb_allowed = cb_left = window;
+  pthread_mtx_unlock(&mtx[cb_cv]);
+}
+
+/* nn_shuffler_qmem: collect and reset the peak memory held by rpc queue
+ * buffers and the number of buffers sent early this epoch */
+void nn_shuffler_qmem(uint64_t* peak, uint64_t* evictions) {
+  pthread_mtx_lock(&pool.mtx);
+  *peak = uint64_t(pool.peak) * pool.slab_sz;
+  *evictions = pool.evictions;
+  pool.peak = pool.inuse;
+  pool.evictions = 0;
+  pthread_mtx_unlock(&pool.mtx);
+}
+
+/* nn_shuffler_blocked: collect and reset the time writers spent blocked
+ * on each rpc queue this epoch */
+void nn_shuffler_blocked(uint64_t* total, uint64_t* max, int* max_peer) {
+  rpcq_t* rpcq;
+  uint64_t t;
+  int i;
+
+  *total = *max = 0;
+  *max_peer = -1;
+  for (i = 0; i < nrpcqs; i++) {
+    rpcq = &rpcqs[i];
+    if (rpcq->bufs == NULL) { /* not a receiver */
+      continue;
+    }
+    pthread_mtx_lock(&rpcq->mtx);
+    t = rpcq->blocked_micros;
+    rpcq->blocked_micros = 0;
+    pthread_mtx_unlock(&rpcq->mtx);
+    if (t != 0 && pctx.testin && pctx.trace != NULL) {
+      fprintf(pctx.trace, "[BLOCKED] %llu us on r%d\n",
+              static_cast<unsigned long long>(t), i);
+    }
+    if (t > *max) {
+      *max = t;
+      *max_peer = i;
+    }
+    *total += t;
+  }
 }
 
 /* bg_work(): dedicated thread function to drive mercury progress */
 static void* bg_work(void* foo) {
   hg_return_t hret;
   unsigned int actual_count;
+  unsigned int triggered;
   uint64_t intvl;
   uint64_t last_progress;
+  uint64_t last_active; /* last time there was anything to trigger */
   uint64_t now;
+  unsigned int timeout;
   int n;
   int s;
 
@@ -964,6 +1587,7 @@ static void* bg_work(void* foo) {
 
   /* the last time we do mercury progress */
   last_progress = 0;
+  last_active = 0;
   hstg_reset_min(nnctx.hg_intvl);
 #if defined(__linux)
   rpcu_start(RUSAGE_THREAD, &rpcus[RPCU_LOOPER]);
@@ -973,12 +1597,28 @@ static void* bg_work(void* foo) {
   n = 0;
 
   while (true) {
+    triggered = 0;
     do {
       hret = HG_Trigger(nnctx.hg_ctx, 0, 1, &actual_count);
+      if (hret == HG_SUCCESS) triggered += actual_count;
     } while (hret == HG_SUCCESS && actual_count != 0);
     if (hret != HG_SUCCESS && hret != HG_TIMEOUT) {
       RPC_FAILED("HG_Trigger", hret);
     }
+    /* in spin mode we poll without blocking for up to the spin budget
+     * after the last send, reply, or incoming rpc. otherwise we block in
+     * HG_Progress as usual. looper_kick is only seen here, so a send made
+     * while we are blocked does not cut the current HG_Progress short */
+    timeout = nnctx.hg_timeout;
+    if (nnctx.hg_spin != 0) {
+      now = now_micros();
+      if (triggered != 0 || __sync_lock_test_and_set(&looper_kick, 0) != 0) {
+        last_active = now;
+      }
+      if (now - last_active < uint64_t(nnctx.hg_spin)) {
+        timeout = 0;
+      }
+    }
     s = is_shuttingdown();
     if (s == 0) {
       now = now_micros_coarse() / 1000; /* ms */
@@ -994,9 +1634,9 @@ static void* bg_work(void* foo) {
       }
       last_progress = now;
       if (nnctx.hg_rusage) {
-        hret = nn_progress_rusage(nnctx.hg_ctx, nnctx.hg_timeout);
+        hret = nn_progress_rusage(nnctx.hg_ctx, timeout);
       } else {
-        hret = HG_Progress(nnctx.hg_ctx, nnctx.hg_timeout);
+        hret = HG_Progress(nnctx.hg_ctx, timeout);
       }
       if (hret != HG_SUCCESS && hret != HG_TIMEOUT) {
         n++;
@@ -1097,9 +1737,12 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
   pthread_t pid;
   char msg[200];
   const char* env;
+  size_t req_sz;
+  uint64_t max_mem;
   int nbufs;
   int rv;
   int i;
+  int j;
 
   nnctx.shctx = ctx;
   shuffle_prepare_uri(nnctx.my_addr);
@@ -1134,6 +1777,17 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
     }
   }
 
+  env = maybe_getenv("SHUFFLE_Mercury_spin_micros");
+  if (env == NULL) {
+    nnctx.hg_spin = 0;
+  } else {
+    nnctx.hg_spin = atoi(env);
+    if (nnctx.hg_spin < 0) {
+      nnctx.hg_spin = 0;
+    }
+  }
+  hstg_reset_min(nnctx.rpc_lat);
+
   env = maybe_getenv("SHUFFLE_Mercury_progress_warn_interval");
   if (env == NULL) {
     nnctx.hg_max_interval = DEFAULT_HG_INTERVAL;
@@ -1168,7 +1822,20 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
 
   cb_left = cb_allowed;
 
-  if (is_envset("SHUFFLE_Hash_sig")) nnctx.hash_sig = 1;
+  env = maybe_getenv("SHUFFLE_Peer_credits");
+  if (env == NULL) {
+    peer_credits = DEFAULT_PEER_CREDITS;
+  } else {
+    peer_credits = atoi(env);
+    if (peer_credits > MAX_OUTSTANDING_RPC) {
+      peer_credits = MAX_OUTSTANDING_RPC;
+    } else if (peer_credits <= 0) {
+      peer_credits = 1;
+    }
+  }
+
+  nnctx.hash_sig = 1;
+  if (is_envset("SHUFFLE_Skip_checksums")) nnctx.hash_sig = 0;
   if (is_envset("SHUFFLE_Force_sync_rpc")) nnctx.force_sync = 1;
   if (is_envset("SHUFFLE_Paranoid_checks")) nnctx.paranoid_checks = 1;
   if (is_envset("SHUFFLE_Random_flush")) nnctx.random_flush = 1;
@@ -1237,28 +1904,122 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
       max_rpcq_sz = 128;
     }
   }
+  /* each queue must hold at least one write */
+  req_sz = ctx->fname_len + 1 + ctx->data_len + ctx->extra_data_len;
+  if (max_rpcq_sz < shuffle_lensz(req_sz) + req_sz) {
+    if (pctx.my_rank == 0) {
+      logf(LOG_WARN, "RPC BUFFER SIZE SMALLER THAN A WRITE - RAISED TO %d",
+           int(shuffle_lensz(req_sz) + req_sz));
+    }
+    max_rpcq_sz = shuffle_lensz(req_sz) + req_sz;
+  }
 
-  nbufs = 0; /* number sender buffers we actually allocated */
+  rpcq_target = max_rpcq_sz;
+  if (is_envset("SHUFFLE_Autotune")) {
+    tn.on = 1;
+    tn.bmax = max_rpcq_sz;
+    env = maybe_getenv("SHUFFLE_Autotune_min_buffer");
+    if (env == NULL) {
+      tn.bmin = DEFAULT_AUTOTUNE_MIN_BUFFER;
+    } else {
+      tn.bmin = atoi(env);
+    }
+    /* each batch must hold at least one write */
+    tn.bmin = std::max(tn.bmin, shuffle_lensz(req_sz) + req_sz);
+    tn.bmin = std::min(tn.bmin, tn.bmax);
+    tn.bstep = std::max((tn.bmax - tn.bmin) / 8, tn.bmin);
+    tn.wmax = cb_allowed; /* parsed above */
+    tn.wmin = 1;
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO,
+           "rpc auto-tuning on: batch %s to %s (step %s), "
+           "rpc window 1 to %d",
+           pretty_size(tn.bmin).c_str(), pretty_size(tn.bmax).c_str(),
+           pretty_size(tn.bstep).c_str(), tn.wmax);
+    }
+  }
+
+  env = maybe_getenv("SHUFFLE_Num_buffers_per_queue");
+  if (env == NULL) {
+    rpcq_nbufs = DEFAULT_BUFFERS_PER_QUEUE;
+  } else {
+    rpcq_nbufs = atoi(env);
+    if (rpcq_nbufs < 1) {
+      rpcq_nbufs = 1;
+    } else if (rpcq_nbufs > MAX_BUFFERS_PER_QUEUE) {
+      rpcq_nbufs = MAX_BUFFERS_PER_QUEUE;
+    }
+  }
 
-  rpcqs = static_cast<rpcq_t*>(malloc(nrpcqs * sizeof(rpcq_t)));
+  env = maybe_getenv("SHUFFLE_Max_buffer_memory");
+  if (env == NULL) {
+    max_mem = DEFAULT_MAX_BUFFER_MEMORY;
+  } else {
+    max_mem = strtoull(env, NULL, 10);
+  }
+
+  rv = pthread_mutex_init(&pool.mtx, NULL);
+  if (rv) ABORT("pthread_mutex_init");
+  rv = pthread_cond_init(&pool.cv, NULL);
+  if (rv) ABORT("pthread_cond_init");
+  pool.buf_sz = (max_rpcq_sz + 63) & ~size_t(63);
+  pool.slab_sz = pool.buf_sz;
+  if (ctx->codec != SHUFFLE_CODEC_NONE) {
+    pool.slab_sz += (max_rpcq_sz + SHUFFLE_CODEC_OVERHEAD +
+                     SHUFFLE_CODEC_SCRATCH(max_rpcq_sz) + 63) &
+                    ~size_t(63);
+  }
+  pool.max_slabs = max_mem / pool.slab_sz;
+  if (pool.max_slabs < MIN_SLABS) {
+    pool.max_slabs = MIN_SLABS;
+  }
+  pool.chunks = new std::vector<void*>;
+  pool.free = NULL;
+  pool.nslabs = pool.inuse = pool.peak = 0;
+  pool.evictions = 0;
+  pool.lru_head = pool.lru_tail = -1;
+
+  nbufs = 0; /* number sender buffers set up for lazy allocation */
+
+  rv = posix_memalign(reinterpret_cast<void**>(&rpcqs), sizeof(rpcq_t),
+                      nrpcqs * sizeof(rpcq_t));
+  if (rv) ABORT("posix_memalign");
   for (i = 0; i < nrpcqs; i++) {
-    if (shuffle_is_rank_receiver(ctx, i)) {
-      rpcqs[i].buf = static_cast<char*>(malloc(max_rpcq_sz));
+    rv = pthread_mutex_init(&rpcqs[i].mtx, NULL);
+    if (rv) ABORT("pthread_mutex_init");
+    rv = pthread_cond_init(&rpcqs[i].cv, NULL);
+    if (rv) ABORT("pthread_cond_init");
+    rpcqs[i].cur = 0;
+    rpcqs[i].busy = 0;
+    rpcqs[i].nrpcs = 0;
+    rpcqs[i].credits = peer_credits;
+    rpcqs[i].blocked_micros = 0;
+    rpcqs[i].lru_prev = rpcqs[i].lru_next = -1;
+    if (!shuffle_is_rank_receiver(ctx, i)) {
+      rpcqs[i].bufs = NULL;
+      continue;
+    }
+    rpcqs[i].bufs =
+        static_cast<rpcbuf_t*>(malloc(rpcq_nbufs * sizeof(rpcbuf_t)));
+    if (rpcqs[i].bufs == NULL) ABORT("malloc");
+    for (j = 0; j < rpcq_nbufs; j++) {
+      rpcbuf_t* const b = &rpcqs[i].bufs[j];
+      b->buf = b->zbuf = NULL; /* allocated on first write */
+      b->flying = 0;
+      b->lepo = 0;
+      b->sz = 0;
       nbufs++;
-    } else {
-      rpcqs[i].buf = NULL;
     }
-    rpcqs[i].busy = 0;
-    rpcqs[i].lepo = 0;
-    rpcqs[i].sz = 0;
   }
   if (pctx.my_rank == 0) {
-    logf(LOG_INFO, "rpc buffer: %s x %s (%s total)", pretty_num(nbufs).c_str(),
-         pretty_size(max_rpcq_sz).c_str(),
-         pretty_size(nbufs * max_rpcq_sz).c_str());
+    logf(LOG_INFO,
+         "rpc buffer: %s x %s (%d per queue, allocated on demand "
+         "up to %s)",
+         pretty_num(nbufs).c_str(), pretty_size(max_rpcq_sz).c_str(),
+         rpcq_nbufs, pretty_size(pool.max_slabs * pool.slab_sz).c_str());
   }
 
-  for (i = 0; i < 5; i++) {
+  for (i = 0; i < 4; i++) {
     rv = pthread_mutex_init(&mtx[i], NULL);
     if (rv) ABORT("pthread_mutex_init");
     rv = pthread_cond_init(&cv[i], NULL);
@@ -1271,12 +2032,35 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
   if (rv) ABORT("pthread_create");
   pthread_detach(pid);
 
-  if (is_envset("SHUFFLE_Use_worker_thread")) {
-    wk_items.reserve(MAX_WORK_ITEM);
-    num_wk++;
-    rv = pthread_create(&pid, NULL, rpc_work, NULL);
-    if (rv) ABORT("pthread_create");
-    pthread_detach(pid);
+  env = maybe_getenv("SHUFFLE_Num_workers");
+  if (env != NULL) {
+    nnctx.num_workers = atoi(env);
+    if (nnctx.num_workers < 0) {
+      nnctx.num_workers = 0;
+    } else if (nnctx.num_workers > MAX_WORKERS) {
+      nnctx.num_workers = MAX_WORKERS;
+    }
+  } else if (is_envset("SHUFFLE_Use_worker_thread")) {
+    nnctx.num_workers = 1;
+  } else {
+    nnctx.num_workers = 0;
+  }
+
+  if (nnctx.num_workers != 0) {
+    wk_ring_init();
+    nnctx.min_wk_busy = ~0ULL;
+    nnctx.max_wk_busy = 0;
+    for (i = 0; i < nnctx.num_workers; i++) {
+      pthread_mtx_lock(&mtx[bg_cv]);
+      num_wk++;
+      pthread_mtx_unlock(&mtx[bg_cv]);
+      rv = pthread_create(&pid, NULL, rpc_work, NULL);
+      if (rv) ABORT("pthread_create");
+      pthread_detach(pid);
+    }
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "rpc workers: %d", nnctx.num_workers);
+    }
   } else if (pctx.my_rank == 0) {
     logf(LOG_WARN,
          "rpc worker disabled\n>>> some rpc stats collection not available");
@@ -1286,11 +2070,11 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
     logf(LOG_INFO,
          "HG_Progress() timeout: %d ms, warn interval: %d ms, "
          "fatal rpc timeout: %d s, max error: %d\n>>> "
-         "cache hg_handle_t: %s, hash signature: %s\n>>> "
-         "bg nice: %d",
+         "cache hg_handle_t: %s, crc32c signature: %s\n>>> "
+         "bg nice: %d, busy polling: %d us",
          nnctx.hg_timeout, nnctx.hg_max_interval, nnctx.timeout,
          nnctx.hg_errors, nnctx.cache_hlds ? "YES" : "NO",
-         nnctx.hash_sig ? "YES" : "NO", nnctx.hg_nice);
+         nnctx.hash_sig ? "YES" : "NO", nnctx.hg_nice, nnctx.hg_spin);
     if (nnctx.paranoid_checks) {
       logf(
           LOG_WARN,
@@ -1364,16 +2148,32 @@ void nn_shuffler_destroy() {
   if (rpcqs != NULL) {
     for (i = 0; i < nrpcqs; i++) {
       assert(rpcqs[i].busy == 0);
-      assert(rpcqs[i].sz == 0);
       /* not all buffers are allocated */
-      if (rpcqs[i].buf) {
-        free(rpcqs[i].buf);
+      if (rpcqs[i].bufs) {
+        for (int j = 0; j < rpcq_nbufs; j++) {
+          assert(rpcqs[i].bufs[j].sz == 0);
+          assert(rpcqs[i].bufs[j].buf == NULL);
+        }
+        free(rpcqs[i].bufs);
       }
+      pthread_mutex_destroy(&rpcqs[i].mtx);
+      pthread_cond_destroy(&rpcqs[i].cv);
     }
 
     free(rpcqs);
   }
 
+  if (pool.chunks != NULL) {
+    assert(pool.inuse == 0);
+    for (size_t i = 0; i < pool.chunks->size(); i++) {
+      free(pool.chunks->at(i));
+    }
+    delete pool.chunks;
+    pool.chunks = NULL;
+    pthread_mutex_destroy(&pool.mtx);
+    pthread_cond_destroy(&pool.cv);
+  }
+
   if (nnctx.mssg != NULL) {
     mssg_finalize(nnctx.mssg);
   }
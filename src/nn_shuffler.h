@@ -40,22 +40,34 @@
  *  SHUFFLE_Mercury_progress_warn_interval
  *    Time between two HG_Progress calls that starts
  *      to cause warning messages
+ *  SHUFFLE_Mercury_spin_micros
+ *    Busy poll HG_Progress for up to this long after the last rpc sent,
+ *      replied, or received, before falling back to blocking progress.
+ *      A send only restarts busy polling once the looper returns from a
+ *      blocking call, which may take up to the progress timeout unless
+ *      network events wake it up earlier. 0 disables busy polling
  *  SHUFFLE_Mercury_cache_handles
  *    Reuse mercury handles to avoid freq mallocs
  *  SHUFFLE_Mercury_max_errors
  *    Max errors before we abort
  *  SHUFFLE_Mercury_nice
  *    Nice value to be applied to the looper thread
- *  SHUFFLE_Hash_sig
- *    Generate a hash signature for each rpc message
+ *  SHUFFLE_Skip_checksums
+ *    Do not generate or verify a crc32c signature for each rpc message
  *  SHUFFLE_Paranoid_checks
  *    Enable paranoid checks on rpc messages
  *  SHUFFLE_Force_sync_rpc
  *    Disallow async rpcs
  *  SHUFFLE_Num_outstanding_rpc
  *    Max num of outstanding rpcs allowed
+ *  SHUFFLE_Peer_credits
+ *    Max num of outstanding rpcs to a single peer. Peers lower it while
+ *      they are behind on incoming rpcs (queued for their workers, or, with
+ *      no workers, keeping their progress thread busy)
  *  SHUFFLE_Use_worker_thread
- *    Allocate a dedicated worker thread
+ *    Allocate a dedicated worker thread (same as SHUFFLE_Num_workers=1)
+ *  SHUFFLE_Num_workers
+ *    Num of worker threads decoding and applying incoming rpcs
  *  SHUFFLE_Subnet
  *    IP prefix of the subnet we prefer to use
  *  SHUFFLE_Min_port
@@ -63,7 +75,20 @@
  *  SHUFFLE_Max_port
  *    The max port number we can use
  *  SHUFFLE_Buffer_per_queue
- *    Memory allocated for each rpc queue
+ *    Memory allocated for each rpc queue buffer
+ *  SHUFFLE_Num_buffers_per_queue
+ *    Buffers per rpc queue. Writers fill one while the others are being sent
+ *  SHUFFLE_Max_buffer_memory
+ *    Max bytes of all rpc queue buffers. Buffers are allocated on first
+ *      write from a shared pool of this size, and the oldest partially
+ *      filled buffers are sent early when the pool runs out
+ *  SHUFFLE_Autotune
+ *    Adjust the rpc batch size and the num of outstanding rpcs once per
+ *      epoch based on measured rpc latency and throughput. The values of
+ *      SHUFFLE_Buffer_per_queue and SHUFFLE_Num_outstanding_rpc become
+ *      the upper bounds. All decisions are logged by rank 0
+ *  SHUFFLE_Autotune_min_buffer
+ *    The min rpc batch size when auto-tuning
  *  SHUFFLE_Random_flush
  *    Flush RPC queues out-of-order
  *  SHUFFLE_Timeout
@@ -73,6 +98,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include "preload_shuffle.h"
 
 /* nn_shuffler_init: initialize the shuffle service or die. */
@@ -85,15 +111,37 @@ extern int nn_shuffler_world_size();
 extern int nn_shuffler_my_rank();
 
 /* nn_shuffler_enqueue: put an incoming write into an rpc queue. */
-extern void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
+extern void nn_shuffler_enqueue(char* req, size_t req_sz, int epoch,
                                 int peer_rank, int rank);
 
+/* nn_shuffler_reserve: make room for a write of req_sz bytes in an rpc
+ * queue and return where the caller should lay it out. the queue stays
+ * locked until nn_shuffler_commit(), so the caller must not block. */
+extern char* nn_shuffler_reserve(size_t req_sz, int epoch, int peer_rank,
+                                 int rank);
+
+/* nn_shuffler_commit: release a queue after nn_shuffler_reserve(). */
+extern void nn_shuffler_commit(int peer_rank);
+
+/* nn_shuffler_backlog: number of rpcs in flight to a peer (a hint). */
+extern int nn_shuffler_backlog(int peer_rank);
+
 /* nn_shuffler_waitcb: wait for all outstanding rpcs to finish. */
 extern void nn_shuffler_waitcb();
 
 /* nn_shuffler_flushq: force flushing local rpc queues. */
 extern void nn_shuffler_flushq();
 
+/* nn_shuffler_tune: re-tune rpc batching at the end of an epoch. */
+extern void nn_shuffler_tune();
+
+/* nn_shuffler_qmem: collect and reset peak rpc queue buffer memory. */
+extern void nn_shuffler_qmem(uint64_t* peak, uint64_t* evictions);
+
+/* nn_shuffler_blocked: collect and reset per-queue writer blocked time. */
+extern void nn_shuffler_blocked(uint64_t* total, uint64_t* max,
+                                int* max_peer);
+
 /* nn_shuffler_bgwait: wait for all background rpc work to finish. */
 extern void nn_shuffler_bgwait();
 
@@ -124,6 +172,22 @@ extern void nn_shuffler_wakeup();
  */
 #define DEFAULT_BUFFER_PER_QUEUE 4096
 
+/*
+ * Default num of buffers per rpc queue, and its hard limit.
+ */
+#define DEFAULT_BUFFERS_PER_QUEUE 2
+#define MAX_BUFFERS_PER_QUEUE 16
+
+/*
+ * Hard limit on the num of rpc worker threads.
+ */
+#define MAX_WORKERS 64
+
+/*
+ * Default memory budget for all rpc queue buffers.
+ */
+#define DEFAULT_MAX_BUFFER_MEMORY (256ULL << 20)
+
 /*
  * Default num of outstanding rpc.
  *
@@ -134,6 +198,16 @@ extern void nn_shuffler_wakeup();
  */
 #define DEFAULT_OUTSTANDING_RPC 16
 
+/*
+ * Default num of outstanding rpc to a single peer.
+ */
+#define DEFAULT_PEER_CREDITS 4
+
+/*
+ * Default lower bound for the rpc batch size when auto-tuning.
+ */
+#define DEFAULT_AUTOTUNE_MIN_BUFFER 512
+
 /*
  * Default rpc timeout (in secs).
  *
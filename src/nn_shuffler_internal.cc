@@ -29,6 +29,7 @@
  */
 
 #include "nn_shuffler_internal.h"
+#include "crc32c.h"
 
 #include <assert.h>
 #include <mercury_proc.h>
@@ -36,7 +37,6 @@
 
 #include <pdlfs-common/xxhash.h>
 #define ORD(x, seed) pdlfs::xxhash32(&x, sizeof(x), seed)
-#define HASH(msg, sz) pdlfs::xxhash32(msg, sz, 0)
 
 #include <algorithm>
 #include <vector>
@@ -57,10 +57,10 @@ void nn_vector_random_shuffle(int seed, std::vector<int>* input) {
 }
 
 namespace {
-/* nn_shuffler_hashsig: generates a 32-bits hash signature for a given input */
+/* nn_shuffler_hashsig: generates a 32-bits crc32c signature covering both
+ * the rpc header and the payload */
 hg_uint32_t nn_shuffler_hashsig(const write_in_t* in) {
-  char buf[20];
-  uint32_t tmp;
+  char buf[16];
   assert(in != NULL);
 
   memcpy(buf, &in->sz, 4);
@@ -70,10 +70,8 @@ hg_uint32_t nn_shuffler_hashsig(const write_in_t* in) {
   memcpy(buf + 3 * 4, &in->epo, 4);
 
   assert(in->msg != NULL);
-  tmp = HASH(in->msg, in->sz);
-  memcpy(buf + 16, &tmp, 4);
-
-  return HASH(buf, 20);
+  return crc32c_extend(crc32c_value(buf, 16),
+                       static_cast<const char*>(in->msg), in->sz);
 }
 }  // namespace
 
@@ -137,8 +135,12 @@ hg_return_t nn_shuffler_write_out_proc(hg_proc_t proc, void* data) {
 
   if (op == HG_ENCODE) {
     hret = hg_proc_hg_int32_t(proc, &out->rv);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_int32_t(proc, &out->credits);
   } else if (op == HG_DECODE) {
     hret = hg_proc_hg_int32_t(proc, &out->rv);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_int32_t(proc, &out->credits);
   } else {
     hret = HG_SUCCESS; /* noop */
   }
@@ -71,6 +71,8 @@ void rpc_failed(hg_return_t hret, const char* msg, const char* func,
 typedef struct nn_rusage {
   unsigned long long sys_micros; /* sys-level cpu time */
   unsigned long long usr_micros; /* usr-level cpu time */
+  /* wall time spent executing rpcs (rpc workers only) */
+  unsigned long long busy_micros;
 
   char tag[16];
 } nn_rusage_t;
@@ -93,16 +95,19 @@ typedef struct nn_ctx {
 
   /* hg_progress intervals */
   hstg_t hg_intvl;
+  /* rpc latency (in us) */
+  hstg_t rpc_lat;
 
   /* hg_timeouts (in ms) */
   int hg_max_interval;
   int hg_timeout;
+  int hg_spin; /* busy polling budget (in us, 0 if disabled) */
   int timeout; /* rpc timeout (in secs) */
 
   int random_flush; /* flush rpc queues in out-of-order */
   int force_sync;   /* avoid async rpc */
   int cache_hlds;   /* cache mercury rpc handles */
-  int hash_sig;     /* generate a hash signature for each rpc */
+  int hash_sig;     /* generate a crc32c signature for each rpc */
 
   int paranoid_checks;
 
@@ -111,10 +116,21 @@ typedef struct nn_ctx {
 
   /* rpc usage */
   nn_rusage_t r[5];
+#define RPCU_ALLTHREADS 0
+#define RPCU_MAIN 1
+#define RPCU_LOOPER 2
+#define RPCU_HGPRO 3
+#define RPCU_WORKER 4
+
+  /* rpc workers */
+  int num_workers; /* num of threads decoding incoming rpcs */
+  unsigned long long max_wk_busy;
+  unsigned long long min_wk_busy;
 
   /* rpc stats */
   unsigned long long total_writes; /* total number of writes shuffled */
   unsigned long long total_msgsz;  /* total rpc msg size */
+  unsigned long long total_rpcs;   /* total number of rpcs received */
 
   /* rpc incoming queue depth */
   hstg_t iq_dep;
@@ -124,7 +140,7 @@ typedef struct nn_ctx {
 extern nn_ctx_t nnctx;
 
 typedef struct write_in {
-  hg_uint32_t hash_sig; /* hash signature of the entire payload */
+  hg_uint32_t hash_sig; /* crc32c signature of the entire payload */
   hg_uint32_t sz;       /* msg size */
 
   hg_int32_t dst;
@@ -134,7 +150,8 @@ typedef struct write_in {
 } write_in_t;
 
 typedef struct write_out {
-  hg_int32_t rv; /* ret value of the write operation */
+  hg_int32_t rv;      /* ret value of the write operation */
+  hg_int32_t credits; /* rpcs the receiver lets the sender keep in flight */
 } write_out_t;
 
 typedef struct write_cb {
@@ -146,6 +163,10 @@ typedef struct write_async_cb {
   void* arg1;
   void* arg2;
   int slot; /* cb slot used */
+  int peer; /* rank the rpc was sent to */
+  /* for the auto-tuner */
+  unsigned long long start; /* when the rpc was sent */
+  hg_uint32_t sz;           /* msg size */
 } write_async_cb_t;
 
 typedef struct write_info {
@@ -155,7 +176,11 @@ typedef struct write_info {
 } write_info_t;
 
 void nn_vector_random_shuffle(int rank, std::vector<int>* vec);
-hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t*);
+/* per-thread buffers for handling incoming rpcs */
+typedef struct rpc_bufs rpc_bufs_t;
+
+hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t*,
+                                          rpc_bufs_t*);
 hg_return_t nn_shuffler_write_rpc_handler_wrapper(hg_handle_t handle);
 hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info);
 hg_return_t nn_shuffler_write_handler(const struct hg_cb_info* info);
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "placement_table.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <pdlfs-common/xxhash.h>
+
+#include "common.h"
+
+namespace {
+bool vnode_less(const placement_vnode_t& a, const placement_vnode_t& b) {
+  return a.pos < b.pos || (a.pos == b.pos && a.rank < b.rank);
+}
+
+/* index of the first vnode at or after hash, wrapping around to 0 */
+size_t successor(const placement_table_t* pt, uint64_t hash) {
+  size_t lo = 0;
+  size_t hi = pt->num_vnodes;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (pt->vnodes[mid].pos < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo == pt->num_vnodes) ? 0 : lo;
+}
+
+uint64_t vnode_pos(int rank, int v) {
+  const uint64_t key = (uint64_t(rank) << 32) | uint32_t(v);
+  return pdlfs::xxhash64(&key, sizeof(key), 0);
+}
+
+inline bool is_active(const uint64_t* bits, int v) {
+  return (bits[v / 64] >> (v % 64)) & 1;
+}
+
+/* place the active vnodes of all ranks on the ring */
+void make_vnodes(placement_table_t* pt) {
+  size_t n = 0;
+
+  for (int r = 0; r < pt->world_sz; r++) {
+    const uint64_t* const bits = pt->active + r * pt->words;
+    pt->counts[r] = 0;
+    for (int v = 0; v < pt->max_vf; v++) {
+      if (is_active(bits, v)) pt->counts[r]++;
+    }
+    n += pt->counts[r];
+  }
+  free(pt->vnodes);
+  pt->num_vnodes = n;
+  pt->vnodes =
+      static_cast<placement_vnode_t*>(malloc(n * sizeof(placement_vnode_t)));
+  if (pt->vnodes == NULL) ABORT("malloc");
+  n = 0;
+  for (int r = 0; r < pt->world_sz; r++) {
+    const uint64_t* const bits = pt->active + r * pt->words;
+    for (int v = 0; v < pt->max_vf; v++) {
+      if (!is_active(bits, v)) continue;
+      placement_vnode_t* const vn = &pt->vnodes[n++];
+      vn->pos = vnode_pos(r, v);
+      vn->rank = r;
+    }
+  }
+  std::sort(pt->vnodes, pt->vnodes + pt->num_vnodes, vnode_less);
+}
+}  // namespace
+
+void placement_table_init(placement_table_t* pt, int world_sz, int vf,
+                          int bits) {
+  assert(world_sz > 0);
+  if (vf < 1) vf = 1;
+  pt->world_sz = world_sz;
+  pt->vf = vf;
+  pt->max_vf = PLACEMENT_TABLE_MAX_WEIGHT * vf;
+  pt->words = (pt->max_vf + 63) / 64;
+  pt->active =
+      static_cast<uint64_t*>(calloc(world_sz * pt->words, sizeof(uint64_t)));
+  pt->counts = static_cast<int*>(malloc(world_sz * sizeof(int)));
+  if (pt->active == NULL || pt->counts == NULL) ABORT("malloc");
+  for (int r = 0; r < world_sz; r++) {
+    for (int v = 0; v < vf; v++) {
+      pt->active[r * pt->words + v / 64] |= uint64_t(1) << (v % 64);
+    }
+  }
+  pt->vnodes = NULL;
+  make_vnodes(pt);
+
+  if (bits <= 0) {
+    bits = 8;
+    while (bits < PLACEMENT_TABLE_MAX_BITS &&
+           (size_t(1) << bits) < 2 * pt->num_vnodes) {
+      bits++;
+    }
+  }
+  if (bits > PLACEMENT_TABLE_MAX_BITS) bits = PLACEMENT_TABLE_MAX_BITS;
+  pt->bits = bits;
+  pt->entries = static_cast<int*>(malloc(sizeof(int) << bits));
+  if (pt->entries == NULL) ABORT("malloc");
+
+  placement_table_build(pt);
+}
+
+void placement_table_build(placement_table_t* pt) {
+  const size_t num_entries = size_t(1) << pt->bits;
+  const int shift = 64 - pt->bits;
+  const size_t n = pt->num_vnodes;
+  size_t j = 0; /* first vnode at or after the current slice (n if none) */
+
+  /*
+   * slice i covers hashes [i << shift, last].  they map to the successors
+   * of all these hashes: every vnode positioned inside [i << shift, last),
+   * plus the successor of last.  the slice has an owner if all of these
+   * belong to the same rank.  otherwise j < n and lookups scan from j.
+   */
+  if (n > size_t(INT_MAX)) ABORT("too many vnodes for the placement table");
+  pt->num_ambiguous = 0;
+  pt->max_scan = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    const uint64_t last = ((uint64_t(i) + 1) << shift) - 1;
+    const int owner = pt->vnodes[j < n ? j : 0].rank;
+    size_t k = j;
+    int ok = 1;
+    while (k < n && pt->vnodes[k].pos < last) {
+      if (pt->vnodes[k].rank != owner) ok = 0;
+      k++;
+    }
+    if (pt->vnodes[k < n ? k : 0].rank != owner) ok = 0;
+    pt->entries[i] = ok ? owner : -int(j) - 1;
+    if (!ok) {
+      pt->num_ambiguous++;
+      pt->max_scan = std::max(pt->max_scan, int(k - j));
+    }
+    while (k < n && pt->vnodes[k].pos <= last) k++;
+    j = k;
+  }
+}
+
+void placement_table_reweight(placement_table_t* pt,
+                              const placement_table_t* from,
+                              const uint64_t* active) {
+  pt->world_sz = from->world_sz;
+  pt->vf = from->vf;
+  pt->max_vf = from->max_vf;
+  pt->words = from->words;
+  pt->active = static_cast<uint64_t*>(
+      malloc(pt->world_sz * pt->words * sizeof(uint64_t)));
+  pt->counts = static_cast<int*>(malloc(pt->world_sz * sizeof(int)));
+  if (pt->active == NULL || pt->counts == NULL) ABORT("malloc");
+  memcpy(pt->active, active, pt->world_sz * pt->words * sizeof(uint64_t));
+  pt->vnodes = NULL;
+  make_vnodes(pt);
+
+  pt->bits = from->bits;
+  pt->entries = static_cast<int*>(malloc(sizeof(int) << pt->bits));
+  if (pt->entries == NULL) ABORT("malloc");
+
+  placement_table_build(pt);
+}
+
+namespace {
+const double kSpace = 18446744073709551616.0; /* 2^64 */
+
+typedef std::map<uint64_t, int> ring_t;
+
+/* vnode before it, wrapping around */
+ring_t::iterator ring_prev(ring_t* ring, ring_t::iterator it) {
+  if (it == ring->begin()) it = ring->end();
+  return --it;
+}
+
+/* vnode after it, wrapping around */
+ring_t::iterator ring_next(ring_t* ring, ring_t::iterator it) {
+  ++it;
+  return it == ring->end() ? ring->begin() : it;
+}
+
+/* fraction of the hash space in (from, to] */
+double arc(uint64_t from, uint64_t to) {
+  const uint64_t len = to - from; /* wraps correctly */
+  return len == 0 ? 1.0 : double(len) / kSpace;
+}
+
+/* a vnode that is not active, as a candidate for switching on */
+struct spare {
+  uint64_t pos;
+  int rank;
+  int v;
+  bool operator<(const spare& other) const { return pos < other.pos; }
+};
+
+/* best single move found so far */
+struct move {
+  double max;  /* max of the two affected loads after the move */
+  double arc;  /* hash space moved */
+  int to;      /* rank receiving the space */
+  int v;       /* vnode id switched on (of rank to) or off (of the donor) */
+  bool on;
+};
+
+inline void consider(move* m, double max, double a, int to, int v, bool on) {
+  if (max < m->max) {
+    m->max = max;
+    m->arc = a;
+    m->to = to;
+    m->v = v;
+    m->on = on;
+  }
+}
+}  // namespace
+
+double placement_table_plan(const placement_table_t* pt, double* loads,
+                            double budget, uint64_t* active) {
+  const int n = pt->world_sz;
+  const int lo = std::max(pt->vf / 4, 1);
+  std::vector<int> counts(pt->counts, pt->counts + n);
+  std::vector<double> share(n, 0);
+  std::vector<double> density(n, 0);
+  std::vector<spare> spares;
+  ring_t ring;
+  double total = 0;
+  double moved = 0;
+
+  memcpy(active, pt->active, n * pt->words * sizeof(uint64_t));
+  for (size_t i = 0; i < pt->num_vnodes; i++) {
+    ring.insert(ring.end(),
+                std::make_pair(pt->vnodes[i].pos, pt->vnodes[i].rank));
+  }
+  for (int r = 0; r < n; r++) {
+    total += loads[r];
+  }
+  if (ring.size() != pt->num_vnodes || ring.size() < 2 || total == 0) {
+    return 0; /* vnode collisions or nothing to go by */
+  }
+  for (ring_t::iterator it = ring.begin(); it != ring.end(); ++it) {
+    share[it->second] += arc(ring_prev(&ring, it)->first, it->first);
+  }
+  /* names per unit of hash space in each rank's territory */
+  for (int r = 0; r < n; r++) {
+    density[r] = share[r] != 0 ? loads[r] / share[r] : total;
+  }
+  for (int r = 0; r < n; r++) {
+    for (int v = 0; v < pt->max_vf; v++) {
+      if (is_active(active + r * pt->words, v)) continue;
+      spare s;
+      s.pos = vnode_pos(r, v);
+      s.rank = r;
+      s.v = v;
+      if (ring.count(s.pos) == 0) spares.push_back(s);
+    }
+  }
+  std::sort(spares.begin(), spares.end());
+
+  while (moved < budget) {
+    const int r = int(std::max_element(loads, loads + n) - loads);
+    if (loads[r] <= (1 + PLACEMENT_TABLE_REWEIGHT_SLACK) * total / n) {
+      break; /* good enough */
+    }
+    uint64_t* const bits = active + r * pt->words;
+    move m;
+    m.max = loads[r];
+    m.to = -1;
+
+    for (int v = 0; v < pt->max_vf; v++) {
+      if (!is_active(bits, v)) continue;
+      ring_t::iterator it = ring.find(vnode_pos(r, v));
+      assert(it != ring.end());
+      const uint64_t from = ring_prev(&ring, it)->first;
+      /* switch v off, handing its arc to the next vnode's owner */
+      if (counts[r] > lo) {
+        const int to = ring_next(&ring, it)->second;
+        const double a = arc(from, it->first);
+        const double l = a * density[r];
+        if (to != r) {
+          consider(&m, std::max(loads[r] - l, loads[to] + l), a, to, v,
+                   false);
+        }
+      }
+      /* switch on another rank's spare vnode inside v's arc */
+      spare key;
+      key.pos = from;
+      std::vector<spare>::iterator s =
+          std::upper_bound(spares.begin(), spares.end(), key);
+      for (int wrapped = 0; wrapped < 2; wrapped++) {
+        for (; s != spares.end(); ++s) {
+          if (from < it->first ? s->pos >= it->first
+                               : (wrapped && s->pos >= it->first)) {
+            break;
+          }
+          if (s->rank == r || is_active(active + s->rank * pt->words, s->v)) {
+            continue;
+          }
+          const double a = arc(from, s->pos);
+          const double l = a * density[r];
+          consider(&m, std::max(loads[r] - l, loads[s->rank] + l), a,
+                   s->rank, s->v, true);
+        }
+        if (from < it->first) break;
+        s = spares.begin(); /* the arc wraps past 2^64 */
+      }
+    }
+    if (m.to == -1 || moved + m.arc > budget) {
+      break; /* no more progress within the budget */
+    }
+
+    const double l = m.arc * density[r];
+    if (m.on) {
+      active[m.to * pt->words + m.v / 64] |= uint64_t(1) << (m.v % 64);
+      ring[vnode_pos(m.to, m.v)] = m.to;
+      counts[m.to]++;
+    } else {
+      bits[m.v / 64] &= ~(uint64_t(1) << (m.v % 64));
+      ring.erase(vnode_pos(r, m.v));
+      counts[r]--;
+    }
+    loads[r] -= l;
+    loads[m.to] += l;
+    moved += m.arc;
+  }
+
+  return moved;
+}
+
+int placement_table_ring_lookup(const placement_table_t* pt, uint64_t hash) {
+  return pt->vnodes[successor(pt, hash)].rank;
+}
+
+void placement_table_destroy(placement_table_t* pt) {
+  free(pt->active);
+  free(pt->counts);
+  free(pt->vnodes);
+  free(pt->entries);
+  pt->active = NULL;
+  pt->counts = NULL;
+  pt->vnodes = NULL;
+  pt->entries = NULL;
+  pt->num_vnodes = 0;
+}
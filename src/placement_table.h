@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * placement_table.h  consistent hashing with O(1) lookups
+ *
+ * a consistent-hash ring with a fixed number of virtual nodes per rank,
+ * plus a 2^bits-entry table indexed by the top bits of a 64-bit hash.
+ * each table entry covers an equal slice of the hash space and holds the
+ * rank owning the whole slice, or, if ring positions inside the slice map
+ * to more than one rank, the index of the first vnode in the slice.  such
+ * lookups scan forward over the few vnodes inside the slice, so the
+ * mapping is always exactly that of the ring and a lookup never does a
+ * search.  the table is sized to about two slices per vnode, so a slice
+ * holds less than one vnode on average at any world size.
+ *
+ * vnode positions are xxhash64 of (rank, vnode id).  ch-placement keeps
+ * the positions of its "ring" protocol private, so this ring is our own
+ * and places names differently from ch-placement's (see placement-bench
+ * for how many), with the same balance.  memory is about 24 bytes per
+ * vnode (ring plus table).
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct placement_vnode {
+  uint64_t pos; /* position on the ring */
+  int rank;     /* owner */
+} placement_vnode_t;
+
+/*
+ * each rank may hold up to PLACEMENT_TABLE_MAX_WEIGHT * vf vnodes, with ids
+ * 0 .. max_vf - 1, of which vf (ids 0 .. vf - 1) are active at first.
+ * re-weighting switches individual ids on and off.
+ */
+#define PLACEMENT_TABLE_MAX_WEIGHT 4
+
+typedef struct placement_table {
+  int world_sz;              /* number of ranks */
+  int vf;                    /* initial virtual nodes per rank */
+  int max_vf;                /* vnode ids per rank */
+  size_t words;              /* bitmap words per rank */
+  uint64_t* active;          /* world_sz bitmaps of active vnode ids */
+  int* counts;               /* active vnodes of each rank */
+  placement_vnode_t* vnodes; /* sum(counts) vnodes sorted by pos */
+  size_t num_vnodes;
+  /* 2^bits entries: owner of each slice, or -(first vnode in it) - 1 */
+  int* entries;
+  int bits;
+  size_t num_ambiguous; /* entries that are < 0 */
+  int max_scan;         /* most vnodes inside an ambiguous slice */
+} placement_table_t;
+
+/* largest table placement_table_init sizes automatically (2^bits) */
+#define PLACEMENT_TABLE_MAX_BITS 30
+
+/*
+ * Default max fraction of the hash space (and so of the names) that may move
+ * to a new rank when re-weighting ranks between epochs.
+ */
+#define DEFAULT_REWEIGHT_BUDGET 0.05
+
+/*
+ * Re-weighting leaves a rank alone once its load is within this fraction
+ * above the mean, so that it does not chase sampling noise.
+ */
+#define PLACEMENT_TABLE_REWEIGHT_SLACK 0.02
+
+/*
+ * placement_table_init: build the ring and its lookup table.  use bits=0
+ * to size the table automatically (about 2 slices per vnode, up to
+ * PLACEMENT_TABLE_MAX_BITS).
+ */
+void placement_table_init(placement_table_t* pt, int world_sz, int vf,
+                          int bits);
+void placement_table_destroy(placement_table_t* pt);
+
+/* rebuild table entries from the current vnodes (after they change) */
+void placement_table_build(placement_table_t* pt);
+
+/*
+ * placement_table_reweight: build pt as a copy of the ring and table of
+ * from (same ranks, vnode ids, and table size) with new active vnode
+ * bitmaps (world_sz * words words, each rank keeping at least one vnode).
+ * from is left alone so that it may still be looked up meanwhile.  vnodes
+ * never change positions, so only names next to vnodes switched on or off
+ * move to a new rank.
+ */
+void placement_table_reweight(placement_table_t* pt,
+                              const placement_table_t* from,
+                              const uint64_t* active);
+
+/*
+ * placement_table_plan: given the load each rank saw under the current
+ * ring, repeatedly switch off one of the busiest rank's vnodes or switch on
+ * another rank's vnode inside its territory, whichever evens out loads the
+ * most, until the busiest rank is within PLACEMENT_TABLE_REWEIGHT_SLACK of
+ * the mean or budget of the hash space has moved.  each rank keeps
+ * between vf / 4 and max_vf vnodes.  store the new bitmaps in active[] and
+ * the predicted loads in loads[], and return the fraction of the hash
+ * space moved.
+ */
+double placement_table_plan(const placement_table_t* pt, double* loads,
+                            double budget, uint64_t* active);
+
+/* placement_table_ring_lookup: owner of hash via a binary search */
+int placement_table_ring_lookup(const placement_table_t* pt, uint64_t hash);
+
+/* placement_table_lookup: owner of hash */
+inline int placement_table_lookup(const placement_table_t* pt,
+                                  uint64_t hash) {
+  const int r = pt->entries[hash >> (64 - pt->bits)];
+  if (r >= 0) return r;
+  /* successor among the vnodes inside the slice, or right after it */
+  size_t j = size_t(-(r + 1));
+  while (j < pt->num_vnodes && pt->vnodes[j].pos < hash) j++;
+  return pt->vnodes[j < pt->num_vnodes ? j : 0].rank;
+}
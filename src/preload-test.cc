@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <mpi.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +29,142 @@ void ABORT(const char* msg) {
 }
 }  // namespace
 
+/*
+ * the second dump is done by many threads concurrently (as in an
+ * OpenMP-enabled VPIC build), each opening its own particle files.
+ *
+ * in the third dump every thread keeps OPEN_PER_THREAD files open at a
+ * time, so that together they hold more streams than the preallocated
+ * fake_files (PRELOAD_Max_open_files, set low by preload-test.sh).  this
+ * runs threads through full pools, pool rebinding, and the heap fallback,
+ * and the rounds after the first reuse what earlier rounds released.
+ */
+#define NUM_THREADS 8
+#define FILES_PER_THREAD 64
+#define OPEN_PER_THREAD 8
+#define OPEN_ROUNDS 4
+
+struct dump_arg {
+  const char* dname;
+  int rank;
+  int tid;
+};
+
+static void fill_particle(FILE* fp) {
+  fwrite("1234", 1, 4, fp);
+  fwrite("5678", 1, 4, fp);
+  fputc('9', fp);
+  fputc('0', fp);
+  fwrite("abcdefghijk", 1, 11, fp);
+  fwrite("lmnopqrstuv", 1, 11, fp);
+  fwrite("~!@#$%^", 1, 7, fp);
+  fwrite("&", 1, 1, fp);
+}
+
+static void write_particle(const char* fname) {
+  FILE* fp = fopen(fname, "a");
+  if (fp == NULL) {
+    ABORT("fopen");
+  }
+  fill_particle(fp);
+  int r = fclose(fp);
+  if (r != 0) {
+    ABORT("fclose");
+  }
+}
+
+static void check_particle(const char* rname) {
+  int fd = open(rname, O_RDONLY);
+  if (fd == -1) {
+    ABORT("open");
+  }
+  char buf[32];
+  ssize_t nr = read(fd, buf, 32);
+  if (nr != 32) {
+    ABORT("read");
+  }
+  int cmp = memcmp(buf, "1234567890abcdefghijklmnopqrstuv", 32);
+  if (cmp != 0) {
+    ABORT("data lost");
+  }
+  close(fd);
+}
+
+static void* thread_dump(void* arg) {
+  dump_arg* a = static_cast<dump_arg*>(arg);
+  char fname[PATH_MAX];
+  for (int i = 0; i < FILES_PER_THREAD; i++) {
+    snprintf(fname, sizeof(fname), "%s/%05x-%02x%03x", a->dname, a->rank,
+             a->tid, i);
+    write_particle(fname);
+  }
+  return NULL;
+}
+
+/* streams held open by all threads at once in the third dump */
+static FILE* open_files[NUM_THREADS][OPEN_PER_THREAD];
+static pthread_barrier_t open_barrier;
+static int max_open_files;
+
+static int cmp_ptr(const void* a, const void* b) {
+  const FILE* const x = *static_cast<FILE* const*>(a);
+  const FILE* const y = *static_cast<FILE* const*>(b);
+  return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * check_open_files: called by one thread while every thread holds its
+ * files open.  they must all be distinct streams, and more than the
+ * preallocated ones, so some came from the heap fallback.  a stream
+ * that is not ours must still pass through to libc meanwhile.
+ */
+static void check_open_files() {
+  FILE* all[NUM_THREADS * OPEN_PER_THREAD];
+  memcpy(all, open_files, sizeof(all));
+  qsort(all, NUM_THREADS * OPEN_PER_THREAD, sizeof(all[0]), cmp_ptr);
+  for (int i = 1; i < NUM_THREADS * OPEN_PER_THREAD; i++) {
+    if (all[i] == all[i - 1]) {
+      ABORT("same stream handed out twice");
+    }
+  }
+  if (NUM_THREADS * OPEN_PER_THREAD <= max_open_files) {
+    ABORT("not enough open files to use the heap fallback");
+  }
+  FILE* fp = fopen("/dev/null", "w");
+  if (fp == NULL || fputc('x', fp) != 'x' || fclose(fp) != 0) {
+    ABORT("libc stream broken while heap files are open");
+  }
+}
+
+static void* thread_dump_open(void* arg) {
+  dump_arg* a = static_cast<dump_arg*>(arg);
+  char fname[PATH_MAX];
+  for (int round = 0; round < OPEN_ROUNDS; round++) {
+    for (int i = 0; i < OPEN_PER_THREAD; i++) {
+      snprintf(fname, sizeof(fname), "%s/%05x-%02x%03x", a->dname, a->rank,
+               a->tid, FILES_PER_THREAD + round * OPEN_PER_THREAD + i);
+      open_files[a->tid][i] = fopen(fname, "a");
+      if (open_files[a->tid][i] == NULL) {
+        ABORT("fopen");
+      }
+    }
+    pthread_barrier_wait(&open_barrier);
+    if (a->tid == 0) {
+      check_open_files();
+    }
+    pthread_barrier_wait(&open_barrier);
+    for (int i = 0; i < OPEN_PER_THREAD; i++) {
+      fill_particle(open_files[a->tid][i]);
+    }
+    for (int i = 0; i < OPEN_PER_THREAD; i++) {
+      if (fclose(open_files[a->tid][i]) != 0) {
+        ABORT("fclose");
+      }
+    }
+  }
+  return NULL;
+}
+
 int main(int argc, char** argv) {
   int rank;
   int r = MPI_Init(&argc, &argv);
@@ -58,25 +195,46 @@ int main(int argc, char** argv) {
   char fname[PATH_MAX];
   for (int i = 0; i < 10; i++) {
     snprintf(fname, sizeof(fname), "%s/%05x-%05x", dname, rank, i);
-    FILE* fp = fopen(fname, "a");
-    if (fp == NULL) {
-      ABORT("fopen");
-    }
-    fwrite("1234", 1, 4, fp);
-    fwrite("5678", 1, 4, fp);
-    fputc('9', fp);
-    fputc('0', fp);
-    fwrite("abcdefghijk", 1, 11, fp);
-    fwrite("lmnopqrstuv", 1, 11, fp);
-    fwrite("~!@#$%^", 1, 7, fp);
-    fwrite("&", 1, 1, fp);
-    r = fclose(fp);
+    write_particle(fname);
+  }
+  closedir(d);
+
+  d = opendir(dname);
+  pthread_t tids[NUM_THREADS];
+  dump_arg args[NUM_THREADS];
+  for (int t = 0; t < NUM_THREADS; t++) {
+    args[t].dname = dname;
+    args[t].rank = rank;
+    args[t].tid = t;
+    r = pthread_create(&tids[t], NULL, thread_dump, &args[t]);
     if (r != 0) {
-      ABORT("fclose");
+      ABORT("pthread_create");
     }
   }
+  for (int t = 0; t < NUM_THREADS; t++) {
+    pthread_join(tids[t], NULL);
+  }
   closedir(d);
 
+  const char* env = getenv("PRELOAD_Max_open_files");
+  if (env == NULL) {
+    ABORT("no max open files");
+  }
+  max_open_files = atoi(env);
+  pthread_barrier_init(&open_barrier, NULL, NUM_THREADS);
+  d = opendir(dname);
+  for (int t = 0; t < NUM_THREADS; t++) {
+    r = pthread_create(&tids[t], NULL, thread_dump_open, &args[t]);
+    if (r != 0) {
+      ABORT("pthread_create");
+    }
+  }
+  for (int t = 0; t < NUM_THREADS; t++) {
+    pthread_join(tids[t], NULL);
+  }
+  closedir(d); /* aborts if any file was not released (paranoid checks) */
+  pthread_barrier_destroy(&open_barrier);
+
   MPI_Finalize();
 
   char rname[PATH_MAX];
@@ -89,20 +247,14 @@ int main(int argc, char** argv) {
   }
   for (int i = 0; i < 10; i++) {
     snprintf(rname, sizeof(rname), "%s/%05x-%05x", lo, rank, i);
-    int fd = open(rname, O_RDONLY);
-    if (fd == -1) {
-      ABORT("open");
-    }
-    char buf[32];
-    ssize_t nr = read(fd, buf, 32);
-    if (nr != 32) {
-      ABORT("read");
-    }
-    int cmp = memcmp(buf, "1234567890abcdefghijklmnopqrstuv", 32);
-    if (cmp != 0) {
-      ABORT("data lost");
+    check_particle(rname);
+  }
+  for (int t = 0; t < NUM_THREADS; t++) {
+    for (int i = 0; i < FILES_PER_THREAD + OPEN_ROUNDS * OPEN_PER_THREAD;
+         i++) {
+      snprintf(rname, sizeof(rname), "%s/%05x-%02x%03x", lo, rank, t, i);
+      check_particle(rname);
     }
-    close(fd);
   }
 
   exit(0);
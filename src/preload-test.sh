@@ -39,6 +39,7 @@ if [ x"$MPI" = xmpich ]; then
     mpirun.mpich -np $MPI_PROCS -prepend-rank -bind-to hwthread \
         -env LD_PRELOAD "$BUILD_PREFIX/src/libdeltafs-preload.so" \
         -env PRELOAD_Particle_id_size "11" \
+        -env PRELOAD_Max_open_files "16" \
         -env PRELOAD_Skip_papi "1" \
         -env PRELOAD_Bypass_deltafs "1" \
         -env PRELOAD_Bypass_shuffle "0" \
@@ -55,6 +56,7 @@ elif [ x"$MPI" = xopenmpi ]; then
     mpirun.openmpi -np $MPI_PROCS -tag-output -bind-to-core \
         -x "LD_PRELOAD=$BUILD_PREFIX/src/libdeltafs-preload.so" \
         -x "PRELOAD_Particle_id_size=11" \
+        -x "PRELOAD_Max_open_files=16" \
         -x "PRELOAD_Skip_papi=1" \
         -x "PRELOAD_Bypass_deltafs=1" \
         -x "PRELOAD_Bypass_shuffle=0" \
@@ -42,12 +42,17 @@
 #include <sys/stat.h>
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
+#include <pdlfs-common/xxhash.h>
+
 #include "preload_internal.h"
 #include "pthreadtap.h"
+#include "shuffle_codec.h"
 #include "shuffler_udf.h"
+#include "xxhash_batch.h"
 
 #ifdef PRELOAD_HAS_PAPI
 #include <papi.h>
@@ -59,6 +64,22 @@
 #define DEFAULT_PARTICLE_BYTES 40
 #define DEFAULT_PARTICLE_BUFSIZE (2 << 20)
 
+/* default max number of plfsdir files opened at once */
+#define DEFAULT_MAX_OPEN_FILES 256
+
+/* number of fake_files in each per-thread pool */
+#define FAKE_FILES_PER_POOL 4
+
+/* default bloom filter sizing for paranoid file name checks */
+#define DEFAULT_BLOOM_NAMES (4 << 20)
+#define DEFAULT_BLOOM_BITS 16
+
+/* default number of sample shards if not sharded by memtable partition */
+#define DEFAULT_SAMPLE_SHARDS 16
+
+/* default max number of names sampled per rank */
+#define DEFAULT_SAMPLE_CAPACITY (64 << 10)
+
 /* default number of millisecs to wait for MPI async ops */
 #define DEFAULT_MPI_WAIT 50
 
@@ -69,9 +90,6 @@ static int mon_dump_txt = 1;
 /* mutex to protect preload state */
 static pthread_mutex_t preload_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-/* mutex to synchronize writes */
-static pthread_mutex_t write_mtx = PTHREAD_MUTEX_INITIALIZER;
-
 /* number of pthread created */
 static int num_pthreads = 0;
 
@@ -124,6 +142,9 @@ static struct next_functions {
  */
 static pthread_once_t init_once = PTHREAD_ONCE_INIT;
 
+/* forward decl, see below */
+static void fake_files_init(size_t num);
+
 /* helper: must_getnextdlsym: get next symbol or fail */
 static void must_getnextdlsym(void** result, const char* symbol) {
   *result = dlsym(RTLD_NEXT, symbol);
@@ -170,16 +191,18 @@ static void preload_init() {
   pctx.papi_set = PAPI_NULL;
 #endif
 
-  pctx.isdeltafs = new std::set<FILE*>;
   pctx.fnames = new std::set<std::string>;
-  pctx.smap = new std::map<std::string, int>;
 
   pctx.mpi_wait = DEFAULT_MPI_WAIT;
   pctx.particle_id_size = DEFAULT_PARTICLE_ID_BYTES;
   pctx.particle_extra_size = DEFAULT_PARTICLE_EXTRA_BYTES;
   pctx.particle_size = DEFAULT_PARTICLE_BYTES;
   pctx.particle_buf_size = DEFAULT_PARTICLE_BUFSIZE;
+  pctx.max_open_files = DEFAULT_MAX_OPEN_FILES;
   pctx.sthres = 100; /* 100 samples per 1 million input */
+  pctx.scap = DEFAULT_SAMPLE_CAPACITY;
+  pctx.bloom_names = DEFAULT_BLOOM_NAMES;
+  pctx.bloom_bits = DEFAULT_BLOOM_BITS;
 
   pctx.sampling = 1;
   pctx.paranoid_checks = 1;
@@ -336,6 +359,14 @@ static void preload_init() {
     }
   }
 
+  tmp = maybe_getenv("PRELOAD_Max_open_files");
+  if (tmp != NULL) {
+    pctx.max_open_files = atoi(tmp);
+    if (pctx.max_open_files < 1) {
+      pctx.max_open_files = 1;
+    }
+  }
+
   tmp = maybe_getenv("PRELOAD_Mpi_wait");
   if (tmp != NULL) {
     pctx.mpi_wait = atoi(tmp);
@@ -344,6 +375,9 @@ static void preload_init() {
     }
   }
 
+  if (is_envset("PRELOAD_Mpi_yield")) pctx.mpi_yield = 1;
+  hstg_reset_min(pctx.bar_wait);
+
   if (is_envset("PRELOAD_Skip_sampling")) pctx.sampling = 0;
 
   tmp = maybe_getenv("PRELOAD_Sample_threshold");
@@ -354,6 +388,16 @@ static void preload_init() {
     }
   }
 
+  tmp = maybe_getenv("PRELOAD_Sample_capacity");
+  if (tmp != NULL) {
+    pctx.scap = atoi(tmp);
+    if (pctx.scap < 1) {
+      pctx.scap = 1;
+    }
+  }
+
+  if (is_envset("PRELOAD_Sample_reservoir")) pctx.sreservoir = 1;
+
 #ifdef PRELOAD_HAS_PAPI
   tmp = maybe_getenv("PRELOAD_Papi_events");
   if (tmp == NULL || tmp[0] == 0) {
@@ -399,9 +443,32 @@ static void preload_init() {
   if (is_envset("PRELOAD_Enable_wisc")) pctx.sideio = 1;
 
   if (is_envset("PRELOAD_No_paranoid_checks")) pctx.paranoid_checks = 0;
+
+  tmp = maybe_getenv("PRELOAD_Bloom_expected_names");
+  if (tmp != NULL) {
+    pctx.bloom_names = atoi(tmp);
+    if (pctx.bloom_names < 1) {
+      pctx.bloom_names = 1;
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Bloom_bits_per_name");
+  if (tmp != NULL) {
+    pctx.bloom_bits = atoi(tmp);
+    if (pctx.bloom_bits < 1) {
+      pctx.bloom_bits = 1;
+    }
+  }
+
+  if (pctx.paranoid_checks && is_envset("PRELOAD_Bloom_name_checks")) {
+    pctx.fbloom = static_cast<bloom_t*>(malloc(sizeof(bloom_t)));
+    if (pctx.fbloom == NULL) ABORT("malloc");
+    bloom_init(pctx.fbloom, pctx.bloom_names, pctx.bloom_bits);
+  }
   if (is_envset("PRELOAD_No_paranoid_pre_barrier"))
     pctx.paranoid_pre_barrier = 0;
   if (is_envset("PRELOAD_No_epoch_pre_flushing")) pctx.pre_flushing = 0;
+  if (is_envset("PRELOAD_Async_epoch_flush")) pctx.async_flush = 1;
   if (is_envset("PRELOAD_No_epoch_pre_flushing_wait"))
     pctx.pre_flushing_wait = 0;
   if (is_envset("PRELOAD_No_epoch_pre_flushing_sync"))
@@ -413,6 +480,8 @@ static void preload_init() {
   if (is_envset("PRELOAD_Inject_fake_data")) pctx.fake_data = 1;
   if (is_envset("PRELOAD_Testing")) pctx.testin = 1;
 
+  fake_files_init(pctx.max_open_files);
+
   /* additional init can go here or MPI_Init() */
 }
 
@@ -463,32 +532,111 @@ namespace {
  * VPIC particle data before sending it to the shuffle layer (on fclose).
  *
  * we assume only one thread is writing to the file at a time, so we
- * do not put a mutex on it.
+ * do not put a mutex on it.  the busy_ flag is only for handing out
+ * unused fake_files to concurrent fopen calls.
  *
- * we ignore out of memory errors.
+ * fake_files are preallocated in a single array (see below) so that
+ * fopen/fclose do not malloc unless more files are open than the array
+ * holds.
  */
+/*
+ * particle data is buffered in rec_, which points to a slot of a shared
+ * arena sized for the particle format at init time (see fake_files_init).
+ * when the destination of a file is known at fopen time, the filename is
+ * copied to the front of rec_ and data_ points right after its NUL so
+ * that rec_ ends up holding a complete shuffle write request (filename,
+ * NUL, data, and padding) that can be handed to the shuffle without
+ * being assembled again at fclose.  otherwise data_ is the start of rec_.
+ *
+ * with the nn shuffler, a particle written by a single fwrite is not
+ * buffered at all: that fwrite lays out the write request straight in the
+ * destination's rpc queue and the file is marked sent_ (see fwrite).
+ */
+#define FAKE_FILE_DATA 64 /* min data bytes per file (one VPIC particle) */
+#define FAKE_FILE_ALIGN 64 /* arena slots are cache line aligned */
+
 class fake_file {
  private:
-  std::string path_; /* path of particle file (malloc'd c++) */
-  char data_[64];    /* enough for one VPIC particle */
-  char* dptr_;       /* ptr to next free space in data_ */
-  size_t resid_;     /* residual */
+  std::string path_;                   /* path of particle file (c++) */
+  char* rec_;                          /* name, data, and extra padding */
+  size_t cap_;                         /* max data bytes */
+  size_t name_cap_;                    /* max name bytes (without NUL) */
+  size_t extra_cap_;                   /* max padding bytes */
+  char* data_;                         /* start of particle data */
+  char* dptr_;                         /* ptr to next free space in data_ */
+  size_t resid_;                       /* residual */
+  size_t sent_; /* data bytes sent by fwrite, or 0 */
+  int target_;  /* shuffle destination, or -1 if not known */
+  int busy_;    /* non-zero if opened */
+  int heap_pool_; /* pool tracking a heap fake_file, or -1 */
 
  public:
-  fake_file() : dptr_(data_), resid_(sizeof(data_)) { path_.reserve(256); }
+  fake_file()
+      : rec_(NULL),
+        cap_(0),
+        name_cap_(0),
+        extra_cap_(0),
+        data_(NULL),
+        dptr_(NULL),
+        resid_(0),
+        sent_(0),
+        target_(-1),
+        busy_(0),
+        heap_pool_(-1) {
+    path_.reserve(256);
+  }
+
+  /*
+   * attach the arena slot at rec.  the slot must have room for a name of
+   * name_cap bytes plus its NUL, data_cap bytes of data, and extra_cap
+   * bytes of padding.
+   */
+  void bind(char* rec, size_t name_cap, size_t data_cap, size_t extra_cap) {
+    rec_ = rec;
+    cap_ = data_cap;
+    name_cap_ = name_cap;
+    extra_cap_ = extra_cap;
+  }
+
+  /* try to take an unused fake_file. returns non-zero on success. */
+  int try_acquire() { return __sync_bool_compare_and_swap(&busy_, 0, 1); }
+
+  /* mark the fake_file unused so it can be reopened. */
+  void release() { __sync_lock_release(&busy_); }
+
+  /* get the buffer attached by bind() */
+  char* slot() { return rec_; }
+
+  /* get or set the pool tracking a heap fake_file */
+  int heap_pool() { return heap_pool_; }
+  void set_heap_pool(int pool) { heap_pool_ = pool; }
 
   void reset(const char* path) {
+    assert(rec_ != NULL);
     path_.assign(path);
-    resid_ = sizeof(data_);
+    data_ = rec_;
+    target_ = -1;
+    sent_ = 0;
+    resid_ = cap_;
     dptr_ = data_;
   }
 
-  explicit fake_file(const char* path)
-      : path_(path), dptr_(data_), resid_(sizeof(data_)){};
+  /* same as reset(), but also stage name at the front of rec_ */
+  void reset(const char* path, const char* name, size_t name_len, int target) {
+    assert(rec_ != NULL && name_len <= name_cap_);
+    path_.assign(path);
+    memcpy(rec_, name, name_len);
+    rec_[name_len] = 0;
+    data_ = rec_ + name_len + 1;
+    target_ = target;
+    sent_ = 0;
+    resid_ = cap_;
+    dptr_ = data_;
+  }
 
   /* returns the actual number of bytes added. */
   size_t add_data(const void* toadd, size_t len) {
-    int n = (len > resid_) ? resid_ : len;
+    size_t n = (len > resid_) ? resid_ : len;
     if (n) {
       memcpy(dptr_, toadd, n);
       dptr_ += n;
@@ -498,44 +646,408 @@ class fake_file {
   }
 
   /* get data length */
-  size_t size() { return sizeof(data_) - resid_; }
+  size_t size() { return sent_ ? sent_ : cap_ - resid_; }
+
+  /* non-zero if the data has been sent by fwrite */
+  int sent() { return sent_ != 0; }
+
+  /*
+   * mark len bytes of data as sent.  the file takes no more data after
+   * this, same as when it is full: later writes fail (see fwrite).
+   */
+  void mark_sent(size_t len) {
+    sent_ = len;
+    resid_ = 0;
+  }
+
+  /* get the name staged by reset() (with its NUL) and its length */
+  const char* staged_name(size_t* len) {
+    *len = data_ - rec_;
+    return rec_;
+  }
 
   /* recover filename. */
   const char* file_name() { return path_.c_str(); }
 
   /* get data */
   char* data() { return data_; }
+
+  /* get shuffle destination (-1 if unknown) */
+  int target() { return target_; }
+
+  /*
+   * get the staged shuffle write request, with extra_len bytes of zero
+   * padding appended to the data.  only valid if target() != -1.
+   */
+  char* req(size_t extra_len, size_t* req_sz) {
+    assert(target_ != -1 && extra_len <= extra_cap_);
+    *req_sz = (dptr_ - rec_) + extra_len;
+    memset(dptr_, 0, extra_len);
+    return rec_;
+  }
+};
+
+/*
+ * all fake_files live in one contiguous array allocated at init time.
+ * a FILE* is ours iff its address falls into this array, so checking a
+ * stream never takes a lock or dereferences a FILE* that we do not own.
+ *
+ * the array is cut into pools of FAKE_FILES_PER_POOL fake_files.  each
+ * thread that opens plfsdir files binds itself to a pool on its first
+ * fopen and takes fake_files from it with a CAS on their busy_ flags, so
+ * threads dumping concurrently never touch a shared lock or cache line.
+ * a thread that finds its pool full moves on to another pool, and when
+ * there are more threads than pools the pools are shared (the CAS keeps
+ * that safe).  fclose may come from any thread: it simply clears busy_.
+ */
+fake_file* fake_files = NULL;
+char* fake_file_arena = NULL; /* rec_ buffers of all fake_files */
+uintptr_t fake_files_begin = 0;
+uintptr_t fake_files_end = 0;
+
+int num_pools = 0;
+unsigned next_pool = 0; /* next pool to give out (atomic, wraps) */
+
+/*
+ * fake_files opened after all pools are used up are allocated from the
+ * heap.  each is tracked by the pool of the thread opening it, under that
+ * pool's own lock.  claim_FILE only looks at these sets when the address-
+ * range test misses while a heap file is open, starting with the pool of
+ * the calling thread and skipping pools that hold no heap file.
+ */
+struct heap_pool {
+  pthread_mutex_t mtx;
+  std::set<fake_file*> files;
+  int num; /* atomic */
 };
+heap_pool* heap_pools = NULL; /* one per pool */
+int num_heap_files = 0;       /* atomic */
+
+size_t slot_name_cap = 0; /* arena slot layout (see fake_files_init) */
+size_t slot_data_cap = 0;
+size_t slot_extra_cap = 0;
+size_t slot_sz = 0;
 
-/* avoids repeated malloc if vpic only opens one file a time */
-fake_file the_stock_file;
-fake_file* stock_file = &the_stock_file;
+__thread int my_pool = -1; /* pool bound to the calling thread */
 
 }  // namespace
 
 /*
- * claim_FILE: look at FILE* and see if we claim it
+ * fake_files_init: preallocate fake_files (called once by preload_init)
  */
-static int claim_FILE(FILE* stream) {
-  std::set<FILE*>::iterator it;
+static void fake_files_init(size_t num) {
+  size_t name_cap;
+  size_t data_cap;
+  size_t extra_cap;
   int rv;
 
-  pthread_mtx_lock(&preload_mtx);
+  num_pools = (num + FAKE_FILES_PER_POOL - 1) / FAKE_FILES_PER_POOL;
+  assert(num_pools != 0);
+  num = size_t(num_pools) * FAKE_FILES_PER_POOL;
+  fake_files = new fake_file[num];
 
-  if (stream != reinterpret_cast<FILE*>(&the_stock_file)) {
-    assert(pctx.isdeltafs != NULL);
-    it = pctx.isdeltafs->find(stream);
-    rv = (it != pctx.isdeltafs->end());
+  /*
+   * one arena slot per fake_file, sized for the particle format so that
+   * particles larger than FAKE_FILE_DATA are neither truncated nor need
+   * a malloc on the fopen path.
+   */
+  name_cap = static_cast<size_t>(pctx.particle_id_size);
+  data_cap = static_cast<size_t>(pctx.particle_size);
+  if (data_cap < FAKE_FILE_DATA) data_cap = FAKE_FILE_DATA;
+  extra_cap = static_cast<size_t>(pctx.particle_extra_size);
+  slot_sz = name_cap + 1 + data_cap + extra_cap;
+  slot_sz = (slot_sz + FAKE_FILE_ALIGN - 1) & ~size_t(FAKE_FILE_ALIGN - 1);
+  rv = posix_memalign(reinterpret_cast<void**>(&fake_file_arena),
+                      FAKE_FILE_ALIGN, num * slot_sz);
+  if (rv != 0) {
+    ABORT("cannot allocate fake_file arena");
+  }
+  for (size_t i = 0; i < num; i++) {
+    fake_files[i].bind(fake_file_arena + i * slot_sz, name_cap, data_cap,
+                       extra_cap);
+  }
+
+  slot_name_cap = name_cap;
+  slot_data_cap = data_cap;
+  slot_extra_cap = extra_cap;
+  heap_pools = new heap_pool[num_pools];
+  for (int p = 0; p < num_pools; p++) {
+    pthread_mutex_init(&heap_pools[p].mtx, NULL);
+    heap_pools[p].num = 0;
+  }
+
+  fake_files_begin = reinterpret_cast<uintptr_t>(&fake_files[0]);
+  fake_files_end = reinterpret_cast<uintptr_t>(&fake_files[num]);
+}
 
-  } else {
-    rv = 1;
+/*
+ * take_from_pool: try to grab an unused fake_file from a given pool.
+ * return NULL if all fake_files in that pool are opened.
+ */
+static fake_file* take_from_pool(int pool) {
+  fake_file* const ff = &fake_files[pool * FAKE_FILES_PER_POOL];
+  for (int i = 0; i < FAKE_FILES_PER_POOL; i++) {
+    if (ff[i].try_acquire()) return &ff[i];
   }
+  return NULL;
+}
 
-  pthread_mtx_unlock(&preload_mtx);
+/*
+ * alloc_heap_file: allocate a fake_file from the heap once all pools are
+ * used up and track it in a given pool.  return NULL if out of memory.
+ */
+static fake_file* alloc_heap_file(int pool) {
+  heap_pool* const hp = &heap_pools[pool];
+  fake_file* ff;
+  char* rec;
+
+  rec = static_cast<char*>(malloc(slot_sz));
+  if (rec == NULL) {
+    return NULL;
+  }
+  ff = new fake_file;
+  ff->bind(rec, slot_name_cap, slot_data_cap, slot_extra_cap);
+  ff->try_acquire();
+  ff->set_heap_pool(pool);
+
+  pthread_mtx_lock(&hp->mtx);
+  hp->files.insert(ff);
+  __sync_fetch_and_add(&hp->num, 1);
+  pthread_mtx_unlock(&hp->mtx);
+  __sync_fetch_and_add(&num_heap_files, 1);
+
+  return ff;
+}
 
+/*
+ * heap_pool_has: return non-zero if a given pool tracks ff
+ */
+static int heap_pool_has(int pool, fake_file* ff) {
+  heap_pool* const hp = &heap_pools[pool];
+  int rv;
+  if (__atomic_load_n(&hp->num, __ATOMIC_ACQUIRE) == 0) return 0;
+  pthread_mtx_lock(&hp->mtx);
+  rv = hp->files.count(ff) != 0;
+  pthread_mtx_unlock(&hp->mtx);
   return rv;
 }
 
+/*
+ * is_heap_file: return non-zero if ff is one of our heap fake_files
+ */
+static int is_heap_file(fake_file* ff) {
+  const int me = my_pool;
+  if (__atomic_load_n(&num_heap_files, __ATOMIC_ACQUIRE) == 0) return 0;
+  if (me != -1 && heap_pool_has(me, ff)) return 1;
+  for (int p = 0; p < num_pools; p++) {
+    if (p != me && heap_pool_has(p, ff)) return 1;
+  }
+  return 0;
+}
+
+/*
+ * free_fake_file: return a fake_file to its pool, or to the heap if it
+ * was allocated by alloc_heap_file.
+ */
+static void free_fake_file(fake_file* ff) {
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(ff);
+  if (addr >= fake_files_begin && addr < fake_files_end) {
+    ff->release(); /* to be reused */
+    return;
+  }
+
+  heap_pool* const hp = &heap_pools[ff->heap_pool()];
+  __sync_fetch_and_sub(&num_heap_files, 1);
+  pthread_mtx_lock(&hp->mtx);
+  hp->files.erase(ff);
+  __sync_fetch_and_sub(&hp->num, 1);
+  pthread_mtx_unlock(&hp->mtx);
+
+  free(ff->slot());
+  delete ff;
+}
+
+/*
+ * alloc_fake_file: grab an unused fake_file, preferably from the pool
+ * of the calling thread.  fall back to the heap if all fake_files are
+ * in use.  return NULL if that fails too.
+ */
+static fake_file* alloc_fake_file() {
+  fake_file* ff;
+  int p;
+
+  if (my_pool != -1) {
+    ff = take_from_pool(my_pool);
+    if (ff != NULL) {
+      return ff;
+    }
+  }
+
+  /* first fopen of this thread or its pool is full: bind to a new pool */
+  my_pool = static_cast<int>(__sync_fetch_and_add(&next_pool, 1u) %
+                             static_cast<unsigned>(num_pools));
+  ff = take_from_pool(my_pool);
+  if (ff != NULL) {
+    return ff;
+  }
+
+  for (p = 0; p < num_pools; p++) {
+    ff = take_from_pool(p);
+    if (ff != NULL) {
+      my_pool = p;
+      return ff;
+    }
+  }
+
+  return alloc_heap_file(my_pool);
+}
+
+/*
+ * claim_FILE: look at FILE* and see if we claim it
+ */
+static inline int claim_FILE(FILE* stream) {
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(stream);
+  if (addr >= fake_files_begin && addr < fake_files_end) return 1;
+  return is_heap_file(reinterpret_cast<fake_file*>(stream));
+}
+
+/*
+ * pre_flush_plfsdir: soft flush the plfsdir at the end of an epoch, and
+ * optionally wait for the resulting compaction and fsync the output.
+ */
+static void pre_flush_plfsdir(int epoch) {
+  assert(pctx.plfshdl != NULL);
+  if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
+    ABORT("fail to flush plfsdir side io");
+  if (deltafs_plfsdir_flush(pctx.plfshdl, epoch) != 0)
+    ABORT("fail to flush plfsdir");
+
+  if (pctx.pre_flushing_wait) {
+    if (pctx.my_rank == 0 && pctx.verbose)
+      fputs("waiting for compaction ... (rank 0)\n", stderr);
+    if (pctx.sideio && deltafs_plfsdir_io_wait(pctx.plfshdl) != 0)
+      ABORT("fail to wait for plfsdir side io");
+    if (deltafs_plfsdir_wait(pctx.plfshdl) != 0)
+      ABORT("fail to wait for plfsdir");
+  }
+
+  if (pctx.pre_flushing_sync) {
+    if (pctx.my_rank == 0 && pctx.verbose)
+      fputs("fsync'ing io ... (rank 0)\n", stderr);
+    if (pctx.sideio && deltafs_plfsdir_io_sync(pctx.plfshdl) != 0)
+      ABORT("fail to sync plfsdir side io");
+    if (deltafs_plfsdir_sync(pctx.plfshdl) != 0)
+      ABORT("fail to sync plfsdir");
+  }
+}
+
+/*
+ * the async flusher.  with PRELOAD_Async_epoch_flush, closedir() hands
+ * the end-of-epoch pre-flush (flush, compaction wait, and fsync) to a
+ * background thread and returns to the application at once.  completion
+ * is only enforced when it is actually needed: by the next opendir(),
+ * which must flush the epoch, or by MPI_Finalize().  in between, deltafs
+ * itself will block writers if its buffers run out.
+ */
+namespace {
+struct flusher {
+  pthread_t thread;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  int started;  /* non-zero if the thread is running */
+  int shutdown; /* non-zero to stop the thread */
+  int busy;     /* non-zero if a flush is pending or in progress */
+  int epoch;    /* epoch to flush */
+  uint64_t start; /* start of the last flush */
+  uint64_t end;   /* end of the last flush */
+} flusher;
+
+void* flusher_main(void* arg) {
+  int epoch;
+
+  pthread_mtx_lock(&flusher.mtx);
+  while (true) {
+    while (!flusher.busy && !flusher.shutdown) {
+      pthread_cv_wait(&flusher.cv, &flusher.mtx);
+    }
+    if (!flusher.busy) break; /* shutdown */
+    epoch = flusher.epoch;
+    flusher.start = now_micros();
+    pthread_mtx_unlock(&flusher.mtx);
+
+    pre_flush_plfsdir(epoch);
+
+    pthread_mtx_lock(&flusher.mtx);
+    flusher.end = now_micros();
+    flusher.busy = 0;
+    pthread_cv_notifyall(&flusher.cv);
+  }
+  pthread_mtx_unlock(&flusher.mtx);
+
+  return NULL;
+}
+}  // namespace
+
+static void flusher_start() {
+  pthread_mutex_init(&flusher.mtx, NULL);
+  pthread_cond_init(&flusher.cv, NULL);
+  flusher.busy = flusher.shutdown = 0;
+  if (pthread_create(&flusher.thread, NULL, flusher_main, NULL) != 0)
+    ABORT("pthread_create");
+  flusher.started = 1;
+}
+
+/* schedule a pre-flush of the given epoch in the background */
+static void flusher_post(int epoch) {
+  assert(flusher.started);
+  pthread_mtx_lock(&flusher.mtx);
+  assert(!flusher.busy);
+  flusher.epoch = epoch;
+  flusher.busy = 1;
+  pthread_cv_notifyall(&flusher.cv);
+  pthread_mtx_unlock(&flusher.mtx);
+}
+
+/*
+ * flusher_wait: wait for any background pre-flush to finish and charge
+ * its cost to the current epoch's mon stats.  return the time spent
+ * waiting in micros.
+ */
+static uint64_t flusher_wait() {
+  uint64_t start;
+  uint64_t waited;
+  int posted;
+
+  if (!flusher.started) return 0;
+  start = now_micros();
+  pthread_mtx_lock(&flusher.mtx);
+  posted = flusher.busy;
+  while (flusher.busy) {
+    pthread_cv_wait(&flusher.cv, &flusher.mtx);
+  }
+  pthread_mtx_unlock(&flusher.mtx);
+  waited = now_micros() - start;
+
+  if (posted || flusher.end > flusher.start) {
+    pctx.mctx.flush_micros = flusher.end - flusher.start;
+    pctx.mctx.flush_wait_micros = waited;
+    flusher.start = flusher.end = 0; /* charge once */
+  }
+
+  return waited;
+}
+
+static void flusher_stop() {
+  if (!flusher.started) return;
+  flusher_wait();
+  pthread_mtx_lock(&flusher.mtx);
+  flusher.shutdown = 1;
+  pthread_cv_notifyall(&flusher.cv);
+  pthread_mtx_unlock(&flusher.mtx);
+  if (pthread_join(flusher.thread, NULL) != 0) ABORT("pthread_join");
+  flusher.started = 0;
+}
+
 /*
  * dump in-memory mon stats to files.
  */
@@ -1054,6 +1566,16 @@ int MPI_Init(int* argc, char*** argv) {
             }
           }
 
+          if (pctx.async_flush && pctx.pre_flushing) {
+            if (pctx.bgpause) {
+              if (pctx.my_rank == 0) {
+                logf(LOG_WARN, "async epoch flush disabled by bg pause");
+              }
+            } else {
+              flusher_start();
+            }
+          }
+
           if (pctx.sideio) {
             rv = deltafs_plfsdir_io_open(pctx.plfshdl, path);
             if (rv != 0) {
@@ -1084,6 +1606,22 @@ int MPI_Init(int* argc, char*** argv) {
       }
     }
 
+    /* shard sampled names the same way as the memtable if possible */
+    if (pctx.sampling && pctx.recv_comm != MPI_COMM_NULL) {
+      pctx.num_smaps = pctx.plfsparts;
+      if (pctx.num_smaps <= 0) pctx.num_smaps = DEFAULT_SAMPLE_SHARDS;
+      pctx.smaps = new sample_shard_t[pctx.num_smaps];
+      size_t shard_cap = (pctx.scap + pctx.num_smaps - 1) / pctx.num_smaps;
+      /* headroom for shards that see more than their share of names, so
+       * that sample_shards_trim() can take from them by weight */
+      if (pctx.sreservoir) shard_cap *= 2;
+      for (int i = 0; i < pctx.num_smaps; i++) {
+        sample_shard_init(
+            &pctx.smaps[i], pctx.particle_id_size, shard_cap,
+            static_cast<uint64_t>(pctx.my_rank) * pctx.num_smaps + i + 1);
+      }
+    }
+
     if (!pctx.nomon) {
       snprintf(dirpath, sizeof(dirpath), "/tmp/vpic-deltafs-run-%u",
                static_cast<unsigned>(uid));
@@ -1263,6 +1801,10 @@ int MPI_Finalize(void) {
   rv = pthread_once(&init_once, preload_init);
   if (rv) ABORT("pthread_once");
 
+  if (num_eps != 0) {
+    PRELOAD_Barrier_report("last epoch");
+  }
+
   if (pctx.my_rank == 0) {
     logf(LOG_INFO, "LIB finalizing ... (%d epochs)", num_eps);
     if (pctx.print_meminfo) {
@@ -1319,6 +1861,18 @@ int MPI_Finalize(void) {
           fprintf(f0, "unordered_storage=%d\n", dirc.unordered_storage);
           fprintf(f0, "io_engine=%d\n", dirc.io_engine);
           fprintf(f0, "comm_sz=%d\n", pctx.recv_sz);
+          if (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.sctx.rp != NULL) {
+            fprintf(f0, "placement=range\n");
+            range_placement_dump(pctx.sctx.rp, f0);
+          }
+          if (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.sctx.choices == 2) {
+            /* readers must rebuild the ring to find both candidates */
+            fprintf(f0, "placement=two_choices\n");
+            fprintf(f0, "placement_protocol=%s\n", pctx.sctx.proto);
+            fprintf(f0, "virtual_factor=%d\n", pctx.sctx.vf);
+            fprintf(f0, "ring_sz=%d\n", shuffle_world_sz(&pctx.sctx));
+            fprintf(f0, "receiver_rate=%u\n", pctx.sctx.receiver_rate);
+          }
 
           fflush(f0);
           fclose(f0);
@@ -1339,6 +1893,7 @@ int MPI_Finalize(void) {
      * retrieve final mon stats, and free the directory. note that the mon stats
      * must be retrieved before the directory is destroyed. */
     if (pctx.plfshdl != NULL) {
+      flusher_stop();
       finish_start = now_micros();
       if (pctx.my_rank == 0) {
         logf(LOG_INFO, "finalizing plfsdir ... (rank 0)");
@@ -1406,11 +1961,13 @@ int MPI_Finalize(void) {
     /* conclude sampling */
     if (pctx.sampling && pctx.recv_comm != MPI_COMM_NULL) {
       num_samples[0] = num_samples[1] = 0;
-      for (std::map<std::string, int>::const_iterator it = pctx.smap->begin();
-           it != pctx.smap->end(); ++it) {
-        num_samples[0]++; /* number samples */
-        if (it->second == num_eps) {
-          num_samples[1]++; /* number valid samples */
+      for (int i = 0; i < pctx.num_smaps; i++) {
+        sample_shard_t* const shard = &pctx.smaps[i];
+        for (size_t j = 0; j < shard->len; j++) {
+          num_samples[0]++; /* number samples */
+          if (shard->cnts[j] == num_eps) {
+            num_samples[1]++; /* number valid samples */
+          }
         }
       }
       MPI_Reduce(num_samples, sum_samples, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
@@ -1433,18 +1990,21 @@ int MPI_Finalize(void) {
         if (f0 != NULL) {
           if (pctx.my_rank == 0 && pctx.verbose)
             fputs("dumped names = (\n    ...\n", stderr);
-          for (std::map<std::string, int>::const_iterator it =
-                   pctx.smap->begin();
-               it != pctx.smap->end(); ++it) {
-            if (it->second == num_eps) {
-              fprintf(f0, "%s\n", it->first.c_str());
-
-              num_names++;
-              if (pctx.my_rank && pctx.verbose) {
-                if (num_names <= 7) {
-                  fputs(" !! ", stderr);
-                  fputs(it->first.c_str(), stderr);
-                  fputc('\n', stderr);
+          for (int i = 0; i < pctx.num_smaps; i++) {
+            sample_shard_t* const shard = &pctx.smaps[i];
+            for (size_t j = 0; j < shard->len; j++) {
+              if (shard->cnts[j] == num_eps) {
+                fprintf(f0, "%.*s\n", static_cast<int>(shard->key_len),
+                        sample_shard_key(shard, j));
+
+                num_names++;
+                if (pctx.my_rank && pctx.verbose) {
+                  if (num_names <= 7) {
+                    fputs(" !! ", stderr);
+                    fwrite(sample_shard_key(shard, j), 1, shard->key_len,
+                           stderr);
+                    fputc('\n', stderr);
+                  }
                 }
               }
             }
@@ -1466,6 +2026,13 @@ int MPI_Finalize(void) {
                pretty_num(sum_names).c_str());
         }
       }
+
+      for (int i = 0; i < pctx.num_smaps; i++) {
+        sample_shard_destroy(&pctx.smaps[i]);
+      }
+      delete[] pctx.smaps;
+      pctx.smaps = NULL;
+      pctx.num_smaps = 0;
     }
 
     /* close, merge, and dist mon files */
@@ -1592,6 +2159,12 @@ int MPI_Finalize(void) {
                      pretty_num(double(glob.nw) / pctx.comm_sz).c_str(),
                      pretty_num(glob.min_nw).c_str(),
                      pretty_num(glob.max_nw).c_str());
+                if (pctx.fbloom != NULL) {
+                  logf(LOG_INFO,
+                       "         > %s collisions estimated to be bloom "
+                       "filter false positives",
+                       pretty_num(glob.ncw_fp).c_str());
+                }
                 logf(LOG_INFO,
                      "         > %s foreign + %s local = %s total writes",
                      pretty_num(glob.nfw).c_str(), pretty_num(glob.nlw).c_str(),
@@ -1859,6 +2432,7 @@ DIR* opendir(const char* dir) {
   dir_stat_t tmp_dir_stat;
   uint64_t flush_start;
   uint64_t flush_end;
+  uint64_t flush_wait;
   uint64_t start;
   DIR* rv;
 
@@ -1903,7 +2477,7 @@ DIR* opendir(const char* dir) {
     }
   }
 
-  if (pctx.paranoid_barrier) {
+  if (pctx.paranoid_barrier && !pctx.sctx.epoch_counting) {
     if (num_eps != 0) {
       /*
        * this ensures we have received all peer writes and no more
@@ -1911,6 +2485,13 @@ DIR* opendir(const char* dir) {
        */
       PRELOAD_Barrier(MPI_COMM_WORLD);
     }
+  } else if (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.sctx.epoch_counting) {
+    /*
+     * the count of writes sent to us in the previous epoch was posted by
+     * closedir and summed up while the app computed.  wait for it and for
+     * the writes themselves before the epoch flush below.
+     */
+    pctx.sh_udf->epoch_pre_start();
   }
 
   /* flush the shuffle layer so all messages are delivered */
@@ -1918,6 +2499,24 @@ DIR* opendir(const char* dir) {
     pctx.sh_udf->epoch_start(num_eps);
   }
 
+  /* the epoch flush below must follow any ongoing pre-flush */
+  if (num_eps != 0 && flusher.started) {
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "waiting for background pre-flushing ... (rank 0)");
+    }
+    flush_wait = flusher_wait();
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO,
+           "background pre-flushing done %s (%s blocked, %s hidden)",
+           pretty_dura(pctx.mctx.flush_micros).c_str(),
+           pretty_dura(flush_wait).c_str(),
+           pretty_dura(pctx.mctx.flush_micros > flush_wait
+                           ? pctx.mctx.flush_micros - flush_wait
+                           : 0)
+               .c_str());
+    }
+  }
+
   /* epoch flush */
   if (num_eps != 0 && pctx.recv_comm != MPI_COMM_NULL) {
     /*
@@ -1971,6 +2570,7 @@ DIR* opendir(const char* dir) {
   }
 
   if (num_eps != 0) {
+    PRELOAD_Barrier_report("previous epoch");
     /*
      * delay dumping mon stats collected from the previous epoch
      * until the beginning of the next epoch, which allows us
@@ -1980,6 +2580,17 @@ DIR* opendir(const char* dir) {
     dump_mon(&pctx.mctx, &tmp_dir_stat, &pctx.last_dir_stat);
   }
 
+  /* turn the shard reservoirs into one per-rank sample */
+  if (num_eps == 1 && pctx.smaps != NULL && pctx.sreservoir) {
+    for (int i = 0; i < pctx.num_smaps; i++) {
+      pthread_mtx_lock(&pctx.smaps[i].mtx);
+    }
+    sample_shards_trim(pctx.smaps, pctx.num_smaps, pctx.scap);
+    for (int i = 0; i < pctx.num_smaps; i++) {
+      pthread_mtx_unlock(&pctx.smaps[i].mtx);
+    }
+  }
+
   /* epoch count is increased before the beginning of each epoch */
   num_eps++; /* must go before the barrier below */
 
@@ -2029,6 +2640,9 @@ DIR* opendir(const char* dir) {
 
   /* restart paranoid checking status */
   pctx.fnames->clear();
+  if (pctx.fbloom != NULL) {
+    bloom_clear(pctx.fbloom);
+  }
 
   return rv;
 }
@@ -2054,11 +2668,18 @@ int closedir(DIR* dirp) {
   if (pctx.my_rank == 0) logf(LOG_INFO, "dumping done!!!");
 
   if (pctx.paranoid_checks) {
-    assert(pctx.isdeltafs != NULL);
-    if (!pctx.isdeltafs->empty()) {
+    if (pctx.num_open_files != 0) {
       ABORT("some plfsdir files still open!");
     }
     pctx.fnames->clear();
+    if (pctx.fbloom != NULL) {
+      pctx.mctx.ncw_fp = static_cast<unsigned long long>(
+          bloom_expected_fps(pctx.fbloom, pctx.mctx.nw - pctx.mctx.ncw) + 0.5);
+      if (pctx.mctx.ncw_fp > pctx.mctx.ncw) {
+        pctx.mctx.ncw_fp = pctx.mctx.ncw;
+      }
+      bloom_clear(pctx.fbloom);
+    }
   }
 
   /* flush the rpc buffer and drain all on-going rpcs */
@@ -2067,13 +2688,18 @@ int closedir(DIR* dirp) {
   }
 
   /* this ensures we have received all peer messages */
-  if (pctx.paranoid_pre_barrier ||
+  if ((pctx.paranoid_pre_barrier && !pctx.sctx.epoch_counting) ||
       (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.bgpause)) {
     PRELOAD_Barrier(MPI_COMM_WORLD);
     if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
       pctx.sh_udf->epoch_pre_start();
     }
   }
+  /*
+   * with epoch counting, epoch_end() has posted the count of writes we
+   * sent.  waiting for it here would put a collective on the critical
+   * path again, so the wait is deferred to the next opendir().
+   */
 
   /* epoch pre-flush */
   if (pctx.pre_flushing && pctx.recv_comm != MPI_COMM_NULL) {
@@ -2087,33 +2713,18 @@ int closedir(DIR* dirp) {
           logf(LOG_INFO, "pre-flushing plfsdir ... (rank 0)");
         }
 
-        if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
-          ABORT("fail to flush plfsdir side io");
-        if (deltafs_plfsdir_flush(pctx.plfshdl, num_eps - 1) != 0)
-          ABORT("fail to flush plfsdir");
-
-        if (pctx.pre_flushing_wait) {
-          if (pctx.my_rank == 0 && pctx.verbose)
-            fputs("waiting for compaction ... (rank 0)\n", stderr);
-          if (pctx.sideio && deltafs_plfsdir_io_wait(pctx.plfshdl) != 0)
-            ABORT("fail to wait for plfsdir side io");
-          if (deltafs_plfsdir_wait(pctx.plfshdl) != 0)
-            ABORT("fail to wait for plfsdir");
-        }
-
-        if (pctx.pre_flushing_sync) {
-          if (pctx.my_rank == 0 && pctx.verbose)
-            fputs("fsync'ing io ... (rank 0)\n", stderr);
-          if (pctx.sideio && deltafs_plfsdir_io_sync(pctx.plfshdl) != 0)
-            ABORT("fail to sync plfsdir side io");
-          if (deltafs_plfsdir_sync(pctx.plfshdl) != 0)
-            ABORT("fail to sync plfsdir");
-        }
-
-        if (pctx.my_rank == 0) {
-          flush_end = now_micros();
-          logf(LOG_INFO, "pre-flushing done %s",
-               pretty_dura(flush_end - flush_start).c_str());
+        if (flusher.started) {
+          flusher_post(num_eps - 1);
+          if (pctx.my_rank == 0) {
+            logf(LOG_INFO, "pre-flushing continues in the background");
+          }
+        } else {
+          pre_flush_plfsdir(num_eps - 1);
+          if (pctx.my_rank == 0) {
+            flush_end = now_micros();
+            logf(LOG_INFO, "pre-flushing done %s",
+                 pretty_dura(flush_end - flush_start).c_str());
+          }
         }
       } else {
         ABORT("plfsdir not opened");
@@ -2195,6 +2806,18 @@ int closedir(DIR* dirp) {
     }
   }
 
+  if (pctx.my_rank == 0 && !IS_BYPASS_SHUFFLE(pctx.mode) &&
+      pctx.sctx.codec != SHUFFLE_CODEC_NONE &&
+      pctx.mctx.codec_wire_bytes != 0) {
+    logf(LOG_INFO,
+         "shuffle codec: %s -> %s (%.2fx), %s encoding, %s decoding (rank 0)",
+         pretty_size(pctx.mctx.codec_raw_bytes).c_str(),
+         pretty_size(pctx.mctx.codec_wire_bytes).c_str(),
+         double(pctx.mctx.codec_raw_bytes) / pctx.mctx.codec_wire_bytes,
+         pretty_dura(pctx.mctx.codec_enc_micros).c_str(),
+         pretty_dura(pctx.mctx.codec_dec_micros).c_str());
+  }
+
   if (pctx.my_rank == 0) {
     logf(LOG_INFO, "epoch ends (rank 0)");
     if (pctx.print_meminfo) {
@@ -2212,6 +2835,9 @@ FILE* fopen(const char* fpath, const char* mode) {
   int exact;
   const char* stripped;
   const char* fname;
+  size_t fname_len;
+  int target;
+  fake_file* ff;
   FILE* rv;
 
   int ret = pthread_once(&init_once, preload_init);
@@ -2233,31 +2859,52 @@ FILE* fopen(const char* fpath, const char* mode) {
     stripped = (exact) ? "/" : (fpath + pctx.len_deltafs_mntp);
   }
 
-  pthread_mtx_lock(&preload_mtx);
-  if (pctx.paranoid_checks) {
+  ff = alloc_fake_file();
+  if (ff == NULL) {
+    errno = EMFILE;
+    return NULL;
+  }
+
+  if (pctx.paranoid_checks && pctx.fbloom != NULL) {
+    fname = stripped + pctx.len_plfsdir + 1;
+    if (bloom_add(pctx.fbloom, fname, strlen(fname))) {
+      __sync_fetch_and_add(&pctx.mctx.ncw, 1);
+    }
+  } else if (pctx.paranoid_checks) {
+    pthread_mtx_lock(&preload_mtx);
     fname = stripped + pctx.len_plfsdir + 1;
     if (pctx.fnames->count(fname) == 0) {
       pctx.fnames->insert(fname);
     } else {
       pctx.mctx.ncw++;
     }
+    pthread_mtx_unlock(&preload_mtx);
   }
-  pctx.mctx.min_nw++;
-  pctx.mctx.max_nw++;
-  pctx.mctx.nw++;
-  if (stock_file == NULL) {
-    rv = reinterpret_cast<FILE*>(new fake_file(stripped));
-    logf(LOG_WARN, "VPIS IS OPENING MULTIPLE PLFSDIR FILES SIMULTANEOUSLY!");
-    assert(pctx.isdeltafs != NULL);
-    pctx.isdeltafs->insert(rv);
-  } else {
-    assert(stock_file == &the_stock_file);
-    stock_file->reset(stripped);
-    rv = reinterpret_cast<FILE*>(stock_file);
-    stock_file = NULL;
+  __sync_fetch_and_add(&pctx.mctx.min_nw, 1);
+  __sync_fetch_and_add(&pctx.mctx.max_nw, 1);
+  __sync_fetch_and_add(&pctx.mctx.nw, 1);
+
+  __sync_fetch_and_add(&pctx.num_open_files, 1);
+
+  /*
+   * resolve the destination of the file now so that fclose can ship the
+   * particle without first copying it into a separate write request.
+   */
+  target = -1;
+  if (!pctx.sideio && !IS_BYPASS_SHUFFLE(pctx.mode)) {
+    fname = stripped + pctx.len_plfsdir + 1;
+    fname_len = strlen(fname);
+    if (fname_len == static_cast<size_t>(pctx.particle_id_size)) {
+      target = pctx.sh_udf->target(fname, fname_len);
+    }
   }
 
-  pthread_mtx_unlock(&preload_mtx);
+  if (target != -1) {
+    ff->reset(stripped, fname, fname_len, target);
+  } else {
+    ff->reset(stripped);
+  }
+  rv = reinterpret_cast<FILE*>(ff);
 
   return rv;
 }
@@ -2276,12 +2923,42 @@ size_t fwrite(const void* ptr, size_t size, size_t nitems, FILE* stream) {
   }
 
   fake_file* ff = reinterpret_cast<fake_file*>(stream);
+
+  /*
+   * a whole particle in one fwrite: lay out the write request directly
+   * in the destination's rpc queue instead of staging it here.
+   */
+  if (ff->target() != -1 && ff->size() == 0 && size != 0 &&
+      size * nitems == static_cast<size_t>(pctx.particle_size)) {
+    const size_t len = size * nitems;
+    size_t name_len;
+    const char* name = ff->staged_name(&name_len);
+    const size_t req_sz = name_len + len + pctx.particle_extra_size;
+    char* req = pctx.sh_udf->reserve_req(req_sz, ff->target(), num_eps - 1);
+    if (req != NULL) {
+      memcpy(req, name, name_len);
+      memcpy(req + name_len, ptr, len);
+      memset(req + name_len + len, 0, pctx.particle_extra_size);
+      pctx.sh_udf->commit_req(req, req_sz, ff->target(), num_eps - 1);
+      ff->mark_sent(len);
+      return nitems;
+    }
+  }
+
   size_t cnt = ff->add_data(ptr, size * nitems);
 
   /*
    * fwrite returns number of items written.  it can return a short
-   * object count on error.
+   * object count on error.  data past the end of the file's buffer, or
+   * after fwrite already sent the particle, is dropped.
    */
+  if (cnt < size * nitems) {
+    if (pctx.paranoid_checks) {
+      ABORT(ff->sent() ? "plfsdir file written after its particle was sent"
+                       : "plfsdir file overflow");
+    }
+    errno = EFBIG;
+  }
 
   return (cnt / size); /* truncates on error */
 }
@@ -2302,9 +2979,16 @@ int fputc(int character, FILE* stream) {
 
   a[0] = static_cast<char>(character);
   fake_file* ff = reinterpret_cast<fake_file*>(stream);
-  ff->add_data(a, 1);
+  if (ff->add_data(a, 1) != 1) {
+    if (pctx.paranoid_checks) {
+      ABORT(ff->sent() ? "plfsdir file written after its particle was sent"
+                       : "plfsdir file overflow");
+    }
+    errno = EFBIG;
+    return EOF;
+  }
 
-  return a[0];
+  return static_cast<unsigned char>(a[0]);
 }
 
 /*
@@ -2376,7 +3060,18 @@ int fclose(FILE* stream) {
     data = ff->data();
   }
 
-  if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
+  if (ff->sent()) {
+    rv = 0; /* already in an rpc queue (see fwrite) */
+  } else if (!IS_BYPASS_SHUFFLE(pctx.mode) && ff->target() != -1 &&
+             data_len == static_cast<size_t>(pctx.particle_size)) {
+    /* request already staged by fopen, just add the padding */
+    size_t req_sz;
+    char* req = ff->req(pctx.particle_extra_size, &req_sz);
+    rv = pctx.sh_udf->process_req(req, req_sz, ff->target(), num_eps - 1);
+    if (rv) {
+      ABORT("plfsdir shuffler write failed");
+    }
+  } else if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
     rv = pctx.sh_udf->process(fname, fname_len, data, data_len, num_eps - 1);
     if (rv) {
       ABORT("plfsdir shuffler write failed");
@@ -2388,17 +3083,8 @@ int fclose(FILE* stream) {
     }
   }
 
-  pthread_mtx_lock(&preload_mtx);
-
-  if (ff == &the_stock_file) {
-    stock_file = &the_stock_file; /* to be reused*/
-  } else {
-    assert(pctx.isdeltafs != NULL);
-    pctx.isdeltafs->erase(stream);
-    delete ff;
-  }
-
-  pthread_mtx_unlock(&preload_mtx);
+  __sync_fetch_and_sub(&pctx.num_open_files, 1);
+  free_fake_file(ff);
 
   return rv;
 }
@@ -2552,54 +3238,110 @@ long ftell(FILE* stream) {
 
 } /* extern "C" */
 
+namespace {
+/* per-thread prng state for threshold sampling (0 if not seeded) */
+__thread uint64_t sample_rng = 0;
+
 /*
- * preload_write
+ * sample_name: count a particle name towards the sampling results.
+ * during the initial epoch we randomly pick names to track, after that
+ * we count the epochs in which each tracked name shows up again.
  */
-int preload_write(const char* fname, unsigned char fname_len, char* data,
-                  unsigned char data_len, int epoch) {
-  int rv;
-  char path[PATH_MAX];
-  ssize_t n;
-  int fd;
-
-  if (epoch == -1) {
-    epoch = num_eps - 1;
+void sample_name(const char* fname, size_t fname_len) {
+  assert(pctx.smaps != NULL);
+  if (fname_len != pctx.smaps[0].key_len) return; /* not a particle */
+  const uint32_t hash = sample_hash(fname, fname_len);
+  sample_shard_t* const shard = &pctx.smaps[hash % pctx.num_smaps];
+  if (num_eps == 1) {
+    if (pctx.sreservoir) {
+      pthread_mtx_lock(&shard->mtx);
+      sample_shard_add(shard, fname, hash, 1);
+      pthread_mtx_unlock(&shard->mtx);
+    } else {
+      /* during the initial epoch, we accept as many names as possible */
+      if (sample_rng == 0) {
+        sample_rng = (static_cast<uint64_t>(pctx.my_rank) << 32) ^
+                     reinterpret_cast<uintptr_t>(&sample_rng);
+      }
+      if (sample_rand(&sample_rng) % 1000000 <
+          static_cast<uint32_t>(pctx.sthres)) {
+        pthread_mtx_lock(&shard->mtx);
+        sample_shard_add(shard, fname, hash, 0);
+        pthread_mtx_unlock(&shard->mtx);
+      }
+    }
+  } else {
+    pthread_mtx_lock(&shard->mtx);
+    int* const cnt = sample_shard_find(shard, fname, hash);
+    if (cnt != NULL) {
+      (*cnt)++;
+    }
+    pthread_mtx_unlock(&shard->mtx);
   }
+}
 
-  if (pctx.fake_data) {
-    memset(particle_buf, 0, sizeof(particle_buf));
-    // TODO
-  }
+/* number of records whose sample shards we resolve at a time */
+#define SAMPLE_BATCH 1024
 
-  pthread_mtx_lock(&write_mtx);
-  FILE *f = fopen("/users/ankushj/dfs-exp/scripts/log.txt", "a+");
+/*
+ * sample_batch: sample_name() for a batch of particle records, taking
+ * each shard lock at most once per SAMPLE_BATCH records.
+ */
+void sample_batch(const char* recs, size_t num_recs, size_t stride,
+                  size_t fname_len) {
+  uint32_t hashes[SAMPLE_BATCH];
+  int shards[SAMPLE_BATCH];
+  const char* fname;
+  size_t m;
 
-  if (pctx.paranoid_checks) {
-    if (fname_len != strlen(fname)) {
-      ABORT("bad particle filename length");
-    }
-    if (fname_len != pctx.particle_id_size || data_len != pctx.particle_size) {
-      ABORT("bad particle format");
-    }
-    if (epoch != num_eps - 1) {
-      ABORT("bad epoch num");
+  assert(pctx.smaps != NULL);
+  if (num_eps == 1 || fname_len != pctx.smaps[0].key_len) {
+    for (size_t i = 0; i < num_recs; i++) {
+      sample_name(recs + i * stride, fname_len);
     }
+    return;
   }
 
-  if (pctx.sampling) {
-    fprintf(f, "sampling\n");
-    assert(pctx.smap != NULL);
-    if (num_eps == 1) {
-      /* during the initial epoch, we accept as many names as possible */
-      if (getr(0, 1000000 - 1) < pctx.sthres) {
-        pctx.smap->insert(std::make_pair(fname, 1));
+  for (size_t base = 0; base < num_recs; base += m) {
+    m = num_recs - base;
+    if (m > SAMPLE_BATCH) m = SAMPLE_BATCH;
+    /* same as sample_hash() */
+    xxhash32_batch(recs + base * stride, stride, fname_len, m, 0, hashes);
+    for (size_t j = 0; j < m; j++) {
+      shards[j] = hashes[j] % pctx.num_smaps;
+    }
+    for (int s = 0; s < pctx.num_smaps; s++) {
+      sample_shard_t* const shard = &pctx.smaps[s];
+      int locked = 0;
+      for (size_t j = 0; j < m; j++) {
+        if (shards[j] != s) continue;
+        if (!locked) {
+          pthread_mtx_lock(&shard->mtx);
+          locked = 1;
+        }
+        fname = recs + (base + j) * stride;
+        int* const cnt = sample_shard_find(shard, fname, hashes[j]);
+        if (cnt != NULL) {
+          (*cnt)++;
+        }
       }
-    } else {
-      if (pctx.smap->count(fname) != 0) {
-        pctx.smap->at(fname)++;
+      if (locked) {
+        pthread_mtx_unlock(&shard->mtx);
       }
     }
   }
+}
+
+/*
+ * write_particle: ship one particle to the fs.
+ * return 0 on success, or EOF on errors.
+ */
+int write_particle(const char* fname, const char* data, size_t data_len,
+                   int epoch) {
+  char path[PATH_MAX];
+  ssize_t n;
+  int fd;
+  int rv;
 
   rv = EOF; /* Return 0 on success, or EOF on errors */
 
@@ -2607,10 +3349,9 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     rv = 0; /* noop */
 
   } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-    fprintf(f, "bypass dfs namespace\n");
     assert(pctx.plfshdl != NULL);
     n = deltafs_plfsdir_append(pctx.plfshdl, fname, epoch, data, data_len);
-    if (n == data_len) {
+    if (n == static_cast<ssize_t>(data_len)) {
       rv = 0;
     }
 
@@ -2620,7 +3361,7 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
 
     if (fd != -1) {
       n = write(fd, data, data_len);
-      if (n == data_len) {
+      if (n == static_cast<ssize_t>(data_len)) {
         rv = 0;
       }
       close(fd);
@@ -2630,9 +3371,81 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     ABORT("not implemented");
   }
 
-  fclose(f);
-  pthread_mtx_unlock(&write_mtx);
+  return rv;
+}
+}  // namespace
+
+/*
+ * preload_write
+ */
+int preload_write(const char* fname, size_t fname_len, char* data,
+                  size_t data_len, int epoch) {
+  if (epoch == -1) {
+    epoch = num_eps - 1;
+  }
+
+  if (pctx.fake_data) {
+    memset(particle_buf, 0, sizeof(particle_buf));
+    // TODO
+  }
+
+  if (pctx.paranoid_checks) {
+    if (fname_len != strlen(fname)) {
+      ABORT("bad particle filename length");
+    }
+    if (fname_len != static_cast<size_t>(pctx.particle_id_size) ||
+        data_len != static_cast<size_t>(pctx.particle_size)) {
+      ABORT("bad particle format");
+    }
+    if (epoch != num_eps - 1) {
+      ABORT("bad epoch num");
+    }
+  }
+
+  if (pctx.sampling) {
+    sample_name(fname, fname_len);
+  }
+
+  return write_particle(fname, data, data_len, epoch);
+}
+
+/*
+ * preload_write_batch
+ */
+int preload_write_batch(const char* recs, size_t num_recs, size_t stride,
+                        size_t fname_len, size_t data_len, int epoch) {
+  const char* rec;
+  int rv;
 
+  if (epoch == -1) {
+    epoch = num_eps - 1;
+  }
+
+  if (pctx.paranoid_checks) {
+    if (fname_len != static_cast<size_t>(pctx.particle_id_size) ||
+        data_len != static_cast<size_t>(pctx.particle_size)) {
+      ABORT("bad particle format");
+    }
+    if (epoch != num_eps - 1) {
+      ABORT("bad epoch num");
+    }
+    for (size_t i = 0; i < num_recs; i++) {
+      rec = recs + i * stride;
+      if (rec[fname_len] != 0 || memchr(rec, 0, fname_len) != NULL) {
+        ABORT("bad particle filename length");
+      }
+    }
+  }
+
+  if (pctx.sampling) {
+    sample_batch(recs, num_recs, stride, fname_len);
+  }
+
+  rv = 0;
+  for (size_t i = 0; i < num_recs && rv == 0; i++) {
+    rec = recs + i * stride;
+    rv = write_particle(rec, rec + fname_len + 1, data_len, epoch);
+  }
 
   return rv;
 }
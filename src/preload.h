@@ -45,6 +45,12 @@
  *    Bytes of each particle
  *  PRELOAD_Particle_extra_size
  *    Extra bytes for each particle
+ *      (id + 1 + size + extra size must not exceed 64KB when shuffled)
+ *  PRELOAD_Max_open_files
+ *    Max num of plfsdir files vpic may keep open at the same time
+ *      across all threads (preallocated as per-thread pools). Files
+ *      opened beyond this are allocated from the heap and are slower
+ *      to check
  *  PRELOAD_Pthread_tap
  *    Rank# less than this will get their rusage tapped
  *  PRELOAD_Ignore_dirs (semicolon separated paths)
@@ -80,6 +86,13 @@
  *    Do not scan operating system or device settings
  *  PRELOAD_No_paranoid_checks
  *    Disable misc checks on vpic writes
+ *  PRELOAD_Bloom_name_checks
+ *    Check for file name collisions with a bloom filter instead of an
+ *      exact set, trading a small false-positive rate for memory and speed
+ *  PRELOAD_Bloom_expected_names
+ *    Num of file names per rank per epoch the bloom filter is sized for
+ *  PRELOAD_Bloom_bits_per_name
+ *    Num of bloom filter bits allocated for each file name
  *  PRELOAD_No_paranoid_barrier
  *    Disable MPI barriers at the beginning of an epoch
  *      and right before an epoch flush
@@ -91,6 +104,14 @@
  *      and right before a soft epoch flush
  *  PRELOAD_No_epoch_pre_flushing
  *    No soft epoch flush at the end of an epoch
+ *  PRELOAD_Async_epoch_flush
+ *    Do the soft epoch flush (and its compaction wait and fsync) on a
+ *      background thread, overlapping it with the next compute phase
+ *  PRELOAD_Mpi_wait
+ *    Max millisecs to sleep between polls of an MPI barrier (polls back
+ *      off exponentially up to this), or -1 to use blocking MPI calls
+ *  PRELOAD_Mpi_yield
+ *    Yield the cpu instead of sleeping between polls of an MPI barrier
  *  PRELOAD_Local_root
  *    Local file system root that backs deltafs
  *  PRELOAD_Testing
@@ -99,6 +120,12 @@
  *    Replace particle data with artificial data
  *  PRELOAD_Sample_threshold
  *    Num samples per 1 million input particles
+ *  PRELOAD_Sample_capacity
+ *    Max num of particle names sampled per rank (bounds sampler memory)
+ *  PRELOAD_Sample_reservoir
+ *    Sample exactly PRELOAD_Sample_capacity names per rank by reservoir
+ *    sampling instead of using PRELOAD_Sample_threshold. Sampler memory
+ *    is twice the capacity during the initial epoch
  *  PRELOAD_Skip_sampling
  *    Disable particle sampling
  *  PLFSDIR_Key_size
@@ -164,8 +191,18 @@
 /*
  * preload_write: ship data to fs.
  */
-extern int preload_write(const char* id, unsigned char id_sz, char* data,
-                         unsigned char data_len, int epoch);
+extern int preload_write(const char* id, size_t id_sz, char* data,
+                         size_t data_len, int epoch);
+
+/*
+ * preload_write_batch: ship a batch of particles to fs.  particles are
+ * fixed-size records placed every stride bytes starting at recs, each
+ * holding a null-terminated id followed by data_len bytes of data.
+ * epoch and paranoid checks, as well as sampling, are done once per batch.
+ */
+extern int preload_write_batch(const char* recs, size_t num_recs,
+                               size_t stride, size_t id_sz, size_t data_len,
+                               int epoch);
 
 /*
  * Default hash key size for encoding file names.
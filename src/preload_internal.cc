@@ -31,26 +31,39 @@
 #include "preload_internal.h"
 
 #include <mpi.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
 
 /* The global preload context */
 preload_ctx_t pctx = {0};
 
-int exotic_write(const char* fname, unsigned char fname_len, char* data,
-                 unsigned char data_len, int epoch) {
+int exotic_write(const char* fname, size_t fname_len, char* data,
+                 size_t data_len, int epoch) {
   int rv;
 
   rv = preload_write(fname, fname_len, data, data_len, epoch);
-  pctx.mctx.nfw++;
+  __sync_fetch_and_add(&pctx.mctx.nfw, 1);
 
   return rv;
 }
 
-int native_write(const char* fname, unsigned char fname_len, char* data,
-                 unsigned char data_len, int epoch) {
+int exotic_write_batch(const char* recs, size_t num_recs, size_t stride,
+                       size_t fname_len, size_t data_len, int epoch) {
+  int rv;
+
+  rv = preload_write_batch(recs, num_recs, stride, fname_len, data_len, epoch);
+  __sync_fetch_and_add(&pctx.mctx.nfw, num_recs);
+
+  return rv;
+}
+
+int native_write(const char* fname, size_t fname_len, char* data,
+                 size_t data_len, int epoch) {
   int rv;
 
   rv = preload_write(fname, fname_len, data, data_len, epoch);
-  pctx.mctx.nlw++;
+  __sync_fetch_and_add(&pctx.mctx.nlw, 1);
 
   return rv;
 }
@@ -60,38 +73,109 @@ struct barrier_state {
   double time;
   int rank;
 };
+
+/* number of MPI_Test calls before we start to back off */
+#define BARRIER_SPINS 1000
+/* first back off sleep in micros, doubled until pctx.mpi_wait millisecs */
+#define BARRIER_MIN_SLEEP 16
 }  // namespace
 
+/*
+ * barrier_poll: wait for req to complete.  we first spin on MPI_Test to
+ * catch barriers that are about to complete (the common case when all
+ * ranks arrive close together), then back off exponentially so that
+ * long waits do not burn a core that background shuffle and compaction
+ * threads may need.  with pctx.mpi_yield set we yield the cpu instead
+ * of sleeping, which keeps latency low while still letting those
+ * threads make progress.
+ */
+static void barrier_poll(MPI_Request* req) {
+  const useconds_t max_sleep = useconds_t(pctx.mpi_wait) * 1000;
+  useconds_t sleep = BARRIER_MIN_SLEEP;
+  MPI_Status status;
+  int ok = 0;
+
+  for (int i = 0; i < BARRIER_SPINS; i++) {
+    MPI_Test(req, &ok, &status);
+    if (ok) return;
+  }
+
+  while (!ok) {
+    if (pctx.mpi_yield || max_sleep == 0) {
+      sched_yield();
+    } else {
+      usleep(sleep < max_sleep ? sleep : max_sleep);
+      if (sleep < max_sleep) sleep <<= 1;
+    }
+    MPI_Test(req, &ok, &status);
+  }
+}
+
 void PRELOAD_Barrier(MPI_Comm comm) {
-  struct barrier_state start;
-  struct barrier_state min;
+  /* 0: min arrival time (earliest rank), 1: min negated (latest rank) */
+  struct barrier_state start[2];
+  struct barrier_state min[2];
+  double now;
   double dura;
-  int ok;
 
   if (pctx.my_rank == 0) {
     logf(LOG_INFO, "barrier ...\n   MPI Barrier");
   }
-  start.time = MPI_Wtime();
-  start.rank = pctx.my_rank;
+  now = MPI_Wtime();
+  start[0].time = now;
+  start[0].rank = pctx.my_rank;
+  start[1].time = -now;
+  start[1].rank = pctx.my_rank;
   if (pctx.mpi_wait >= 0) {
-    MPI_Status status;
     MPI_Request req;
-    MPI_Iallreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm, &req);
-    for (ok = 0; !ok;) {
-      usleep(pctx.mpi_wait * 1000);
-      MPI_Test(&req, &ok, &status);
-    }
+    MPI_Iallreduce(start, min, 2, MPI_DOUBLE_INT, MPI_MINLOC, comm, &req);
+    barrier_poll(&req);
   } else {
-    MPI_Allreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm);
+    MPI_Allreduce(start, min, 2, MPI_DOUBLE_INT, MPI_MINLOC, comm);
+  }
+
+  hstg_add(pctx.bar_wait, (MPI_Wtime() - now) * 1000000);
+  if (min[1].rank == pctx.my_rank) {
+    pctx.bar_late++;
   }
 
   if (pctx.my_rank == 0) {
-    dura = MPI_Wtime() - min.time;
+    dura = MPI_Wtime() - min[0].time;
 #ifdef PRELOAD_BARRIER_VERBOSE
-    logf(LOG_INFO, "barrier ok (\n /* rank %d waited longest */\n %s+\n)",
-         min.rank, pretty_dura(dura * 1000000).c_str());
+    logf(LOG_INFO,
+         "barrier ok (\n /* rank %d waited longest */\n"
+         " /* rank %d arrived last */\n %s+\n)",
+         min[0].rank, min[1].rank, pretty_dura(dura * 1000000).c_str());
 #else
     logf(LOG_INFO, "barrier %s+", pretty_dura(dura * 1000000).c_str());
 #endif
   }
 }
+
+void PRELOAD_Barrier_report(const char* what) {
+  struct barrier_state late;
+  struct barrier_state max;
+  hstg_t wait;
+
+  memset(&wait, 0, sizeof(hstg_t));
+  hstg_reset_min(wait);
+  hstg_reduce(pctx.bar_wait, wait, MPI_COMM_WORLD);
+  late.time = double(pctx.bar_late);
+  late.rank = pctx.my_rank;
+  MPI_Reduce(&late, &max, 1, MPI_DOUBLE_INT, MPI_MAXLOC, 0, MPI_COMM_WORLD);
+
+  if (pctx.my_rank == 0 && hstg_num(wait) >= 1.0) {
+    logf(LOG_INFO,
+         "barrier waits (%s): %.0f barriers, avg %s, p50 %s, p99 %s, max %s\n"
+         ">>> most frequent straggler: rank %d (last at %.0f barriers)",
+         what, hstg_num(wait) / pctx.comm_sz,
+         pretty_dura(hstg_avg(wait)).c_str(),
+         pretty_dura(hstg_ptile(wait, 50)).c_str(),
+         pretty_dura(hstg_ptile(wait, 99)).c_str(),
+         pretty_dura(hstg_max(wait)).c_str(), max.rank, max.time);
+  }
+
+  memset(&pctx.bar_wait, 0, sizeof(hstg_t));
+  hstg_reset_min(pctx.bar_wait);
+  pctx.bar_late = 0;
+}
@@ -37,8 +37,11 @@
 
 #include <deltafs/deltafs_api.h>
 
+#include "bloom.h"
 #include "common.h"
+#include "hstg.h"
 #include "preload_mon.h"
+#include "preload_sampler.h"
 #include "preload_shuffle.h"
 
 #include "preload.h"
@@ -68,6 +71,7 @@ typedef struct preload_ctx {
   size_t len_log_home;  /* strlen */
 
   int mpi_wait; /* number of millisecs to wait for MPI async operations */
+  int mpi_yield; /* yield the cpu instead of sleeping in barriers */
   int mode;     /* operating mode */
 
   int paranoid_checks; /* various checks on vpic writes */
@@ -82,6 +86,7 @@ typedef struct preload_ctx {
   int pre_flushing; /* force a soft flush at the end of an epoch */
   int pre_flushing_wait;
   int pre_flushing_sync;
+  int async_flush; /* do the soft flush in the background */
 
   int my_rank; /* my MPI world rank */
   int comm_sz; /* my MPI world size */
@@ -116,13 +121,21 @@ typedef struct preload_ctx {
   int papi_set; /* opaque event set descriptor */
 #endif
 
-  std::set<FILE*>* isdeltafs;    /* open files owned by deltafs */
+  int max_open_files; /* max num of plfsdir files opened at once */
+  int num_open_files; /* num of plfsdir files currently opened */
+
   std::set<std::string>* fnames; /* used for checking unique file names */
+  bloom_t* fbloom; /* used instead of fnames if not NULL */
+  int bloom_names; /* expected num of file names per rank per epoch */
+  int bloom_bits;  /* bloom filter bits per file name */
 
-  std::map<std::string, int>* smap; /* sampled particle names */
+  sample_shard_t* smaps; /* sampled particle names */
+  int num_smaps;
 
   int sthres;   /* sample threshold (num samples per 1 million input names) */
+  int scap;     /* max num of names sampled per rank */
   int sampling; /* enable particle name sampling */
+  int sreservoir; /* sample exactly scap names by reservoir sampling */
   int sideio;   /* using the wisc-key format */
 
   shuffle_ctx_t sctx; /* shuffle context */
@@ -150,6 +163,10 @@ typedef struct preload_ctx {
   int nodist; /* skip releasing mon and sampling results */
   int monfd;  /* descriptor for the mon dump file */
 
+  /* barrier stats since the last PRELOAD_Barrier_report */
+  hstg_t bar_wait;             /* micros waited per barrier */
+  unsigned long long bar_late; /* barriers this rank arrived last at */
+
   int bgsngcomp; /* use a single background thread for memtable compaction */
   int bgpause;   /* no background activities during compuation */
   int print_meminfo; /* if mem info should be collected and printed */
@@ -165,18 +182,33 @@ extern preload_ctx_t pctx;
  * exotic_write: perform a write on behalf of a remote rank.
  * return 0 on success, or EOF on errors.
  */
-extern int exotic_write(const char* fname, unsigned char fname_len, char* data,
-                        unsigned char data_len, int epoch);
+extern int exotic_write(const char* fname, size_t fname_len, char* data,
+                        size_t data_len, int epoch);
+
+/*
+ * exotic_write_batch: perform a batch of writes on behalf of remote ranks.
+ * see preload_write_batch() for the record layout.
+ * return 0 on success, or EOF on errors.
+ */
+extern int exotic_write_batch(const char* recs, size_t num_recs, size_t stride,
+                              size_t fname_len, size_t data_len, int epoch);
 
 /*
  * native_write: perform a direct local write.
  * return 0 on success, or EOF on errors.
  */
-extern int native_write(const char* fname, unsigned char fname_len, char* data,
-                        unsigned char data_len, int epoch);
+extern int native_write(const char* fname, size_t fname_len, char* data,
+                        size_t data_len, int epoch);
 
 /*
  * PRELOAD_Barrier: perform a collective barrier operation
  * on the give communicator.
  */
 extern void PRELOAD_Barrier(MPI_Comm comm);
+
+/*
+ * PRELOAD_Barrier_report: summarize barrier wait times and stragglers
+ * since the last report at rank 0, and reset barrier stats.  this is a
+ * collective call on MPI_COMM_WORLD.
+ */
+extern void PRELOAD_Barrier_report(const char* what);
@@ -159,6 +159,8 @@ void mon_reduce(const mon_ctx_t* src, mon_ctx_t* sum) {
 
   MPI_Reduce(const_cast<unsigned long long*>(&src->ncw), &sum->ncw, 1,
              MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->ncw_fp), &sum->ncw_fp, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
   MPI_Reduce(const_cast<unsigned long long*>(&src->nw), &sum->nw, 1,
              MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
   MPI_Reduce(const_cast<unsigned long long*>(&src->min_nw), &sum->min_nw, 1,
@@ -166,6 +168,39 @@ void mon_reduce(const mon_ctx_t* src, mon_ctx_t* sum) {
   MPI_Reduce(const_cast<unsigned long long*>(&src->max_nw), &sum->max_nw, 1,
              MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
 
+  MPI_Reduce(const_cast<unsigned long long*>(&src->flush_micros),
+             &sum->flush_micros, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->flush_wait_micros),
+             &sum->flush_wait_micros, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->codec_raw_bytes),
+             &sum->codec_raw_bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->codec_wire_bytes),
+             &sum->codec_wire_bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->codec_enc_micros),
+             &sum->codec_enc_micros, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->codec_dec_micros),
+             &sum->codec_dec_micros, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->rpcq_blocked_micros),
+             &sum->rpcq_blocked_micros, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_rpcq_blocked_micros),
+             &sum->max_rpcq_blocked_micros, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX,
+             0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_rpcq_mem),
+             &sum->max_rpcq_mem, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->rpcq_evictions),
+             &sum->rpcq_evictions, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+
   dir_stat_reduce(&src->dir_stat, &sum->dir_stat);
   cpu_stat_reduce(&src->cpu_stat, &sum->cpu_stat);
   mem_stat_reduce(&src->mem_stat, &sum->mem_stat);
@@ -205,6 +240,27 @@ void mon_dumpstate(int fd, const mon_ctx_t* ctx) {
   DUMP(fd, buf, "[M] min num writes per rank: %llu", ctx->min_nw);
   DUMP(fd, buf, "[M] max num writes per rank: %llu", ctx->max_nw);
   DUMP(fd, buf, "[M] total writes: %llu", ctx->nw);
+  DUMP(fd, buf, "[M] total name collisions: %llu", ctx->ncw);
+  DUMP(fd, buf, "[M] est. false name collisions: %llu", ctx->ncw_fp);
+  DUMP(fd, buf, "[M] total bg pre-flush time: %llu us", ctx->flush_micros);
+  DUMP(fd, buf, "[M] total bg pre-flush wait: %llu us",
+       ctx->flush_wait_micros);
+  DUMP(fd, buf, "[M] total rpc bytes before codec: %llu bytes",
+       ctx->codec_raw_bytes);
+  DUMP(fd, buf, "[M] total rpc bytes after codec: %llu bytes",
+       ctx->codec_wire_bytes);
+  DUMP(fd, buf, "[M] total codec encoding time: %llu us",
+       ctx->codec_enc_micros);
+  DUMP(fd, buf, "[M] total codec decoding time: %llu us",
+       ctx->codec_dec_micros);
+  DUMP(fd, buf, "[M] total rpc queue blocked time: %llu us",
+       ctx->rpcq_blocked_micros);
+  DUMP(fd, buf, "[M] max rpc queue blocked time per peer: %llu us",
+       ctx->max_rpcq_blocked_micros);
+  DUMP(fd, buf, "[M] max rpc queue memory per epoch: %llu bytes",
+       ctx->max_rpcq_mem);
+  DUMP(fd, buf, "[M] total rpc queue early flushes: %llu",
+       ctx->rpcq_evictions);
   if (!ctx->global) DUMP(fd, buf, "!!! NON GLOBAL !!!");
   DUMP(fd, buf, "--- end ---\n");
 }
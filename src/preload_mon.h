@@ -127,12 +127,35 @@ typedef struct mon_ctx {
 
   /* total num of particles with name collisions (conflicts) */
   unsigned long long ncw;
+  /* est. num of collisions above that are bloom filter false positives */
+  unsigned long long ncw_fp;
   /* num of particle writes handled per rank */
   unsigned long long min_nw;
   unsigned long long max_nw;
   /* total num of particle writes */
   unsigned long long nw;
 
+  /* total time spent in background pre-flushing */
+  unsigned long long flush_micros;
+  /* total time writers were blocked waiting for it */
+  unsigned long long flush_wait_micros;
+
+  /* total rpc payload bytes before and after the shuffle codec */
+  unsigned long long codec_raw_bytes;
+  unsigned long long codec_wire_bytes;
+  /* total time spent encoding and decoding rpc payloads */
+  unsigned long long codec_enc_micros;
+  unsigned long long codec_dec_micros;
+
+  /* total time writers were blocked on full nn rpc queues */
+  unsigned long long rpcq_blocked_micros;
+  /* max such time for any single destination of any rank */
+  unsigned long long max_rpcq_blocked_micros;
+  /* max memory held by nn rpc queue buffers in any epoch */
+  unsigned long long max_rpcq_mem;
+  /* total nn rpc queue buffers sent early to free memory */
+  unsigned long long rpcq_evictions;
+
   /* !!! collected by deltafs !!! */
   dir_stat_t dir_stat;
 
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "preload_sampler.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <pdlfs-common/xxhash.h>
+
+#include "common.h"
+
+/* spread hash bits before picking a slot: the low bits pick the shard */
+static inline uint32_t mix(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35U;
+  h ^= h >> 16;
+  return h;
+}
+
+uint32_t sample_hash(const char* key, size_t key_len) {
+  return pdlfs::xxhash32(key, key_len, 0);
+}
+
+void sample_shard_init(sample_shard_t* s, size_t key_len, size_t cap,
+                       uint64_t seed) {
+  size_t nslots;
+
+  assert(key_len != 0 && cap != 0);
+  pthread_mutex_init(&s->mtx, NULL);
+  s->key_len = key_len;
+  s->cap = cap;
+  s->len = 0;
+
+  /* keep the index at most half full */
+  nslots = 1;
+  while (nslots < 2 * cap) nslots <<= 1;
+  s->mask = nslots - 1;
+
+  s->keys = static_cast<char*>(malloc(cap * key_len));
+  s->cnts = static_cast<int*>(malloc(cap * sizeof(int)));
+  s->slots = static_cast<uint32_t*>(calloc(nslots, sizeof(uint32_t)));
+  if (!s->keys || !s->cnts || !s->slots) {
+    ABORT("malloc");
+  }
+
+  s->seen = 0;
+  s->rng = seed;
+}
+
+void sample_shard_destroy(sample_shard_t* s) {
+  free(s->keys);
+  free(s->cnts);
+  free(s->slots);
+  s->keys = NULL;
+  s->cnts = NULL;
+  s->slots = NULL;
+  s->len = s->cap = 0;
+  pthread_mutex_destroy(&s->mtx);
+}
+
+/* slot_of: return the slot of name e, which must be in the index */
+static size_t slot_of(const sample_shard_t* s, size_t e) {
+  size_t j = mix(sample_hash(sample_shard_key(s, e), s->key_len)) & s->mask;
+  while (s->slots[j] != e + 1) {
+    assert(s->slots[j] != 0);
+    j = (j + 1) & s->mask;
+  }
+  return j;
+}
+
+/*
+ * unindex: remove name e from the index, moving later names of the same
+ * probe run back so that lookups never hit a hole before their name.
+ */
+static void unindex(sample_shard_t* s, size_t e) {
+  size_t j = slot_of(s, e);
+  size_t k = j;
+  s->slots[j] = 0;
+  for (;;) {
+    k = (k + 1) & s->mask;
+    if (s->slots[k] == 0) break;
+    const char* key = sample_shard_key(s, s->slots[k] - 1);
+    const size_t home = mix(sample_hash(key, s->key_len)) & s->mask;
+    /* move it unless its home lies cyclically within (j, k] */
+    if (j <= k ? (home <= j || home > k) : (home <= j && home > k)) {
+      s->slots[j] = s->slots[k];
+      s->slots[k] = 0;
+      j = k;
+    }
+  }
+}
+
+int sample_shard_add(sample_shard_t* s, const char* key, uint32_t hash,
+                     int reservoir) {
+  size_t i;
+  size_t j;
+
+  /* reject duplicates, and remember where the name would go */
+  j = mix(hash) & s->mask;
+  while (s->slots[j] != 0) {
+    if (memcmp(sample_shard_key(s, s->slots[j] - 1), key, s->key_len) ==
+        0) {
+      return 0;
+    }
+    j = (j + 1) & s->mask;
+  }
+
+  s->seen++;
+  if (s->len < s->cap) {
+    i = s->len++;
+  } else if (reservoir) {
+    /* replace a random name with probability cap / seen */
+    uint64_t r = sample_rand(&s->rng);
+    r = (r << 32) | sample_rand(&s->rng);
+    i = static_cast<size_t>(r % s->seen);
+    if (i >= s->cap) {
+      return 0;
+    }
+    unindex(s, i);
+    /* the removal may have moved names around, probe again */
+    j = mix(hash) & s->mask;
+    while (s->slots[j] != 0) j = (j + 1) & s->mask;
+  } else {
+    return 0;
+  }
+
+  memcpy(s->keys + i * s->key_len, key, s->key_len);
+  s->cnts[i] = 1;
+  s->slots[j] = static_cast<uint32_t>(i + 1);
+  return 1;
+}
+
+/* build_index: rebuild the slot index over all names */
+static void build_index(sample_shard_t* s) {
+  memset(s->slots, 0, (s->mask + 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < s->len; i++) {
+    const char* key = sample_shard_key(s, i);
+    size_t j = mix(sample_hash(key, s->key_len)) & s->mask;
+    while (s->slots[j] != 0) j = (j + 1) & s->mask;
+    s->slots[j] = static_cast<uint32_t>(i + 1);
+  }
+}
+
+/* larger fractional share first */
+struct share_cmp {
+  const std::vector<double>* frac;
+  bool operator()(int a, int b) const { return (*frac)[a] > (*frac)[b]; }
+};
+
+void sample_shards_trim(sample_shard_t* shards, int n, size_t target) {
+  std::vector<size_t> keep(n);
+  std::vector<double> frac(n);
+  std::vector<int> order(n);
+  unsigned long long total = 0;
+  size_t held = 0;
+  size_t left;
+
+  for (int i = 0; i < n; i++) {
+    total += shards[i].seen;
+    held += shards[i].len;
+  }
+  if (target > held) target = held;
+  if (total == 0 || target == 0) return;
+
+  /* largest remainder apportionment of target by names offered */
+  left = target;
+  for (int i = 0; i < n; i++) {
+    const double share = double(target) * shards[i].seen / total;
+    keep[i] = std::min(static_cast<size_t>(share), shards[i].len);
+    frac[i] = share - keep[i];
+    left -= keep[i];
+    order[i] = i;
+  }
+  share_cmp cmp;
+  cmp.frac = &frac;
+  std::sort(order.begin(), order.end(), cmp);
+  /* first by remainder, then to whichever shard still has names */
+  while (left != 0) {
+    for (int o = 0; o < n && left != 0; o++) {
+      const int i = order[o];
+      if (keep[i] < shards[i].len) {
+        keep[i]++;
+        left--;
+      }
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    sample_shard_t* const s = &shards[i];
+    if (keep[i] == s->len) continue;
+    /* keep a random subset of keep[i] names */
+    for (size_t k = 0; k < keep[i]; k++) {
+      uint64_t r = sample_rand(&s->rng);
+      r = (r << 32) | sample_rand(&s->rng);
+      const size_t x = k + static_cast<size_t>(r % (s->len - k));
+      if (x != k) {
+        std::swap_ranges(s->keys + k * s->key_len,
+                         s->keys + (k + 1) * s->key_len,
+                         s->keys + x * s->key_len);
+        std::swap(s->cnts[k], s->cnts[x]);
+      }
+    }
+    s->len = keep[i];
+    build_index(s);
+  }
+}
+
+int* sample_shard_find(sample_shard_t* s, const char* key, uint32_t hash) {
+  size_t j;
+
+  j = mix(hash) & s->mask;
+  while (s->slots[j] != 0) {
+    const size_t e = s->slots[j] - 1;
+    if (memcmp(sample_shard_key(s, e), key, s->key_len) == 0) {
+      return &s->cnts[e];
+    }
+    j = (j + 1) & s->mask;
+  }
+
+  return NULL;
+}
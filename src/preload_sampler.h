@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * preload_sampler.h  bounded tables of sampled particle names
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * sample_shard: a shard of sampled particle names and the number of
+ * epochs each name has been seen.  names are spread over shards by hash
+ * so that concurrent writers rarely contend on the same shard lock.
+ *
+ * names are fixed-size binary keys (the particle id, without a trailing
+ * NUL) stored back to back in keys[] with their counters in cnts[], and
+ * indexed by an open-addressing (linear probing) table kept up to date
+ * as names are added, so duplicates are rejected on insert and lookups
+ * take one hash and usually one probe.  memory is fixed at init time by
+ * the shard capacity.
+ */
+typedef struct sample_shard {
+  pthread_mutex_t mtx;
+  size_t key_len;          /* bytes per name */
+  size_t cap;              /* max names held */
+  size_t len;              /* names held */
+  char* keys;              /* len names, key_len bytes each */
+  int* cnts;               /* epochs each name has been seen */
+  uint32_t* slots;         /* index: entry + 1, or 0 if unused */
+  size_t mask;             /* number of slots - 1 */
+  unsigned long long seen; /* names offered, minus those already held */
+  uint64_t rng;            /* prng state (reservoir sampling) */
+} sample_shard_t;
+
+/* sampler api (the caller must hold s->mtx for all but init/destroy) */
+void sample_shard_init(sample_shard_t* s, size_t key_len, size_t cap,
+                       uint64_t seed);
+void sample_shard_destroy(sample_shard_t* s);
+
+/*
+ * sample_shard_add: add a name during the initial epoch.  with reservoir
+ * set, keep a uniform random sample of cap names out of all names offered
+ * to the shard; otherwise keep names until the shard is full.  return 0 if
+ * the name was dropped or is already in the shard.  hash must be
+ * sample_hash(key).
+ */
+int sample_shard_add(sample_shard_t* s, const char* key, uint32_t hash,
+                     int reservoir);
+
+/*
+ * sample_shards_trim: cut n reservoir shards down to a per-rank sample
+ * of exactly target names (or all names if fewer were offered), taking
+ * from each shard in proportion to the names it was offered.  each shard
+ * must be given enough headroom over target / n for that to be possible.
+ * the caller must hold the locks of all shards.
+ */
+void sample_shards_trim(sample_shard_t* shards, int n, size_t target);
+
+/*
+ * sample_shard_find: return the counter of a sampled name, or NULL if
+ * the name is not in the shard.  hash must be sample_hash(key).
+ */
+int* sample_shard_find(sample_shard_t* s, const char* key, uint32_t hash);
+
+/* name at position i (0 <= i < s->len), not NUL-terminated */
+inline const char* sample_shard_key(const sample_shard_t* s, size_t i) {
+  return s->keys + i * s->key_len;
+}
+
+/* hash a name for shard and slot selection */
+uint32_t sample_hash(const char* key, size_t key_len);
+
+/*
+ * sample_rand: return the next 32-bit random number from the given
+ * xorshift64* state.  cheap and lock-free as long as the state is private.
+ */
+inline uint32_t sample_rand(uint64_t* state) {
+  uint64_t x = *state;
+  if (x == 0) x = 0x9E3779B97F4A7C15ULL; /* state must be non-zero */
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return static_cast<uint32_t>((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
@@ -32,13 +32,17 @@
 #include <assert.h>
 #include <ifaddrs.h>
 
+#include <algorithm>
+
 #include "preload_internal.h"
 #include "preload_mon.h"
 #include "preload_shuffle.h"
 
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
+#include "shuffle_codec.h"
 #include "xn_shuffler.h"
+#include "xxhash_batch.h"
 
 #include <ch-placement.h>
 #include <mercury_config.h>
@@ -275,6 +279,9 @@ void shuffle_epoch_pre_start(shuffle_ctx_t* ctx) {
     xn_shuffler_epoch_start(rep);
   } else {
     nn_shuffler_bgwait();
+    if (ctx->epoch_counting) {
+      shuffle_epoch_count_wait(ctx);
+    }
   }
 }
 
@@ -304,7 +311,183 @@ void shuffle_epoch_start(shuffle_ctx_t* ctx) {
   }
 }
 
+void shuffle_epoch_repartition(shuffle_ctx_t* ctx, int epoch) {
+  range_placement_t* const rp = ctx->rp;
+  uint64_t* next;
+  uint64_t* all = NULL;
+  int* counts = NULL;
+  int* displs = NULL;
+  double skew[2];
+  int rebalanced = 0;
+  int total = 0;
+  int n;
+
+  assert(rp != NULL);
+  n = static_cast<int>(std::min<unsigned long long>(rp->seen, rp->cap));
+  if (pctx.my_rank == 0) {
+    counts = static_cast<int*>(malloc(pctx.comm_sz * sizeof(int)));
+    displs = static_cast<int*>(malloc(pctx.comm_sz * sizeof(int)));
+    if (counts == NULL || displs == NULL) {
+      ABORT("malloc");
+    }
+  }
+  if (MPI_Gather(&n, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD) !=
+      MPI_SUCCESS) {
+    ABORT("MPI_Gather");
+  }
+  if (pctx.my_rank == 0) {
+    for (int i = 0; i < pctx.comm_sz; i++) {
+      displs[i] = total;
+      total += counts[i];
+    }
+    all = static_cast<uint64_t*>(malloc((total + 1) * sizeof(uint64_t)));
+    if (all == NULL) {
+      ABORT("malloc");
+    }
+  }
+  if (MPI_Gatherv(rp->samples, n, MPI_UINT64_T, all, counts, displs,
+                  MPI_UINT64_T, 0, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    ABORT("MPI_Gatherv");
+  }
+  rp->seen = 0;
+
+  /* new pivots go to a scratch array since rpc threads may still be
+   * looking up the current ones */
+  next = static_cast<uint64_t*>(malloc((rp->parts + 1) * sizeof(uint64_t)));
+  if (next == NULL) {
+    ABORT("malloc");
+  }
+  if (pctx.my_rank == 0) {
+    memcpy(next, rp->pivots, (rp->parts - 1) * sizeof(uint64_t));
+    std::sort(all, all + total);
+    skew[0] = skew[1] = range_placement_skew(rp, next, all, total);
+    if (rp->threshold > 0 && skew[0] > rp->threshold) {
+      range_placement_pivots(rp, next, all, total);
+      rebalanced = 1;
+      skew[1] = range_placement_skew(rp, next, all, total);
+    }
+    logf(LOG_INFO,
+         "range placement: %s samples, max/mean load %.2f -> %.2f%s",
+         pretty_num(total).c_str(), skew[0], skew[1],
+         rebalanced ? " (re-balanced)" : "");
+    free(all);
+    free(displs);
+    free(counts);
+  }
+
+  if (MPI_Bcast(next, rp->parts - 1, MPI_UINT64_T, 0, MPI_COMM_WORLD) !=
+      MPI_SUCCESS) {
+    ABORT("MPI_Bcast");
+  }
+  /* writes of the epoch before the last one are long done, so no rpc
+   * thread can still be looking up the pivots retired back then */
+  free(rp->pivots_prev);
+  rp->pivots_prev = NULL;
+  if (memcmp(next, rp->pivots, (rp->parts - 1) * sizeof(uint64_t)) != 0) {
+    rp->pivots_prev = rp->pivots;
+    __atomic_store_n(&rp->pivots, next, __ATOMIC_RELEASE);
+  } else {
+    free(next);
+  }
+  if (pctx.my_rank == 0) {
+    range_placement_record(rp, epoch);
+  }
+}
+
+namespace {
+/* max/mean of n loads */
+double imbalance(const double* loads, int n) {
+  double max = 0;
+  double sum = 0;
+  for (int i = 0; i < n; i++) {
+    if (loads[i] > max) max = loads[i];
+    sum += loads[i];
+  }
+  return sum != 0 ? max * n / sum : 1.0;
+}
+}  // namespace
+
+void shuffle_epoch_reweight(shuffle_ctx_t* ctx, int epoch) {
+  placement_table_t* const pt = ctx->pt;
+  const int world_sz = pt->world_sz;
+  placement_table_t* next;
+  unsigned long long* keys = NULL;
+  unsigned long long mine;
+  double* loads = NULL;
+  uint64_t* active;
+  double imb[2];
+  double sum;
+  double moved;
+
+  assert(pt != NULL && ctx->reweight);
+  active = static_cast<uint64_t*>(
+      malloc(world_sz * pt->words * sizeof(uint64_t)));
+  if (active == NULL) {
+    ABORT("malloc");
+  }
+  if (pctx.my_rank == 0) {
+    keys = static_cast<unsigned long long*>(
+        malloc(world_sz * sizeof(unsigned long long)));
+    loads = static_cast<double*>(malloc(world_sz * sizeof(double)));
+    if (keys == NULL || loads == NULL) {
+      ABORT("malloc");
+    }
+  }
+  mine = __sync_lock_test_and_set(&ctx->epoch_keys, 0);
+  if (MPI_Gather(&mine, 1, MPI_UNSIGNED_LONG_LONG, keys, 1,
+                 MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    ABORT("MPI_Gather");
+  }
+
+  if (pctx.my_rank == 0) {
+    sum = 0;
+    for (int r = 0; r < world_sz; r++) {
+      loads[r] = double(keys[r]);
+      sum += loads[r];
+    }
+    imb[0] = imbalance(loads, world_sz);
+    moved = placement_table_plan(pt, loads, ctx->reweight_budget, active);
+    imb[1] = imbalance(loads, world_sz);
+    logf(LOG_INFO,
+         "epoch %d ingest: %s writes (%s per rank), max/mean %.3f\n>>> "
+         "re-weighting moves %.2f%% names, predicted max/mean %.3f",
+         epoch, pretty_num(sum).c_str(), pretty_num(sum / world_sz).c_str(),
+         imb[0], 100 * moved, imb[1]);
+    free(loads);
+    free(keys);
+  }
+
+  if (MPI_Bcast(active, int(world_sz * pt->words), MPI_UINT64_T, 0,
+                MPI_COMM_WORLD) != MPI_SUCCESS) {
+    ABORT("MPI_Bcast");
+  }
+  /* writes of the epoch before the last one are long done, so no rpc
+   * thread can still be looking up the table retired back then */
+  if (ctx->pt_prev != NULL) {
+    placement_table_destroy(ctx->pt_prev);
+    free(ctx->pt_prev);
+    ctx->pt_prev = NULL;
+  }
+  if (memcmp(active, pt->active, world_sz * pt->words * sizeof(uint64_t)) !=
+      0) {
+    next = static_cast<placement_table_t*>(malloc(sizeof(*next)));
+    if (next == NULL) {
+      ABORT("malloc");
+    }
+    placement_table_reweight(next, pt, active);
+    ctx->pt_prev = pt;
+    __atomic_store_n(&ctx->pt, next, __ATOMIC_RELEASE);
+  }
+  free(active);
+}
+
 void shuffle_epoch_end(shuffle_ctx_t* ctx) {
+  uint64_t blocked;
+  uint64_t max_blocked;
+  uint64_t qmem;
+  uint64_t evictions;
+  int max_peer;
+
   assert(ctx != NULL);
   if (ctx->type == SHUFFLE_XN) {
     xn_shuffler_epoch_end(static_cast<xn_ctx_t*>(ctx->rep));
@@ -314,12 +497,117 @@ void shuffle_epoch_end(shuffle_ctx_t* ctx) {
       /* wait for rpc replies */
       nn_shuffler_waitcb();
     }
+    nn_shuffler_tune();
+    nn_shuffler_blocked(&blocked, &max_blocked, &max_peer);
+    pctx.mctx.rpcq_blocked_micros += blocked;
+    if (max_blocked > pctx.mctx.max_rpcq_blocked_micros) {
+      pctx.mctx.max_rpcq_blocked_micros = max_blocked;
+    }
+    if (pctx.my_rank == 0 && blocked != 0) {
+      logf(LOG_INFO, "writers blocked on rpc queues for %s, %s on r%d (rank 0)",
+           pretty_dura(blocked).c_str(), pretty_dura(max_blocked).c_str(),
+           max_peer);
+    }
+    nn_shuffler_qmem(&qmem, &evictions);
+    if (qmem > pctx.mctx.max_rpcq_mem) {
+      pctx.mctx.max_rpcq_mem = qmem;
+    }
+    pctx.mctx.rpcq_evictions += evictions;
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO,
+           "rpc queue memory peaked at %s, %llu early flushes (rank 0)",
+           pretty_size(qmem).c_str(),
+           static_cast<unsigned long long>(evictions));
+    }
+    if (ctx->epoch_counting) {
+      shuffle_epoch_count_post(ctx);
+    }
   }
 }
 
+void shuffle_epoch_count_post(shuffle_ctx_t* ctx) {
+  const int world_sz = shuffle_world_sz(ctx);
+  int rv;
+
+  assert(ctx->epoch_counting);
+  if (ctx->count_req != MPI_REQUEST_NULL) {
+    ABORT("previous epoch count still pending");
+  }
+  /* all local writes of the epoch are out, so counts are stable */
+  for (int i = 0; i < world_sz; i++) {
+    ctx->sent_counts[i] = ctx->sent_writes[i];
+    ctx->sent_writes[i] = 0;
+  }
+  rv = MPI_Ireduce_scatter_block(ctx->sent_counts, &ctx->expected_writes, 1,
+                                 MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+                                 MPI_COMM_WORLD, &ctx->count_req);
+  if (rv != MPI_SUCCESS) {
+    ABORT("MPI_Ireduce_scatter_block");
+  }
+}
+
+void shuffle_epoch_count_wait(shuffle_ctx_t* ctx) {
+  unsigned long long* const recvd =
+      &ctx->recv_writes[ctx->num_epochs_counted & 1];
+  /* a lost write or a dead peer would otherwise hang us forever */
+  const uint64_t deadline = uint64_t(nnctx.timeout) * 1000000;
+  const uint64_t start = now_micros();
+  useconds_t delay = 16;
+  int ok = 0;
+
+  assert(ctx->epoch_counting);
+  if (ctx->count_req == MPI_REQUEST_NULL) {
+    return; /* nothing posted */
+  }
+  while (!ok) {
+    MPI_Test(&ctx->count_req, &ok, MPI_STATUS_IGNORE);
+    if (!ok) {
+      if (now_micros() - start > deadline) {
+        ABORT("timeout waiting for epoch write counts");
+      }
+      usleep(delay);
+      if (delay < 1000) delay <<= 1;
+    }
+  }
+  delay = 16;
+  while (__sync_fetch_and_add(recvd, 0) < ctx->expected_writes) {
+    if (now_micros() - start > deadline) {
+      logf(LOG_ERRO, "epoch %d: %llu writes expected, %llu received",
+           ctx->num_epochs_counted, ctx->expected_writes,
+           __sync_fetch_and_add(recvd, 0));
+      ABORT("timeout waiting for epoch writes");
+    }
+    usleep(delay);
+    if (delay < 1000) delay <<= 1;
+  }
+  if (*recvd != ctx->expected_writes) {
+    ABORT("more epoch writes received than sent");
+  }
+  if (pctx.testin && pctx.trace != NULL) {
+    fprintf(pctx.trace, "[EPOCH-COUNT] epoch %d: %llu writes\n",
+            ctx->num_epochs_counted, ctx->expected_writes);
+  }
+  /* writes of the epoch after next will count towards the same slot */
+  *recvd = 0;
+  ctx->num_epochs_counted++;
+}
+
+namespace {
+/* shuffle_choose: pick the less backlogged of two candidate receivers. ties
+ * go to the first one so that names are placed exactly as with a single
+ * choice unless a receiver is falling behind. */
+int shuffle_choose(shuffle_ctx_t* ctx, const unsigned long* cands) {
+  const int a = static_cast<int>(cands[0]) & ctx->receiver_mask;
+  const int b = static_cast<int>(cands[1]) & ctx->receiver_mask;
+
+  if (a == b) return a;
+  return nn_shuffler_backlog(b) < nn_shuffler_backlog(a) ? b : a;
+}
+}  // namespace
+
 int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   int world_sz;
-  unsigned long target;
+  unsigned long target[2];
   int rv;
 
   assert(ctx != NULL);
@@ -330,11 +618,24 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   if (world_sz != 1) {
     if (IS_BYPASS_PLACEMENT(pctx.mode)) {
       rv = pdlfs::xxhash32(buf, ctx->fname_len, 0) % world_sz;
+    } else if (ctx->rp != NULL) {
+      const uint64_t key = range_key(buf, ctx->fname_len);
+      rv = range_lookup(__atomic_load_n(&ctx->rp->pivots, __ATOMIC_ACQUIRE),
+                        ctx->rp->parts, key) *
+           ctx->receiver_rate;
+    } else if (ctx->pt != NULL) {
+      rv = placement_table_lookup(__atomic_load_n(&ctx->pt, __ATOMIC_ACQUIRE),
+                                  pdlfs::xxhash64(buf, ctx->fname_len, 0));
     } else {
       assert(ctx->chp != NULL);
-      ch_placement_find_closest(
-          ctx->chp, pdlfs::xxhash64(buf, ctx->fname_len, 0), 1, &target);
-      rv = static_cast<int>(target);
+      ch_placement_find_closest(ctx->chp,
+                                pdlfs::xxhash64(buf, ctx->fname_len, 0),
+                                ctx->choices, target);
+      if (ctx->choices == 2) {
+        rv = shuffle_choose(ctx, target);
+      } else {
+        rv = static_cast<int>(target[0]);
+      }
     }
   } else {
     rv = shuffle_rank(ctx);
@@ -343,66 +644,245 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   return (rv & ctx->receiver_mask);
 }
 
+int shuffle_candidates(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
+                       int* cands) {
+  unsigned long target[2];
+
+  assert(ctx != NULL);
+  assert(buf_sz >= ctx->fname_len);
+
+  if (ctx->choices != 2 || shuffle_world_sz(ctx) == 1) {
+    cands[0] = shuffle_target(ctx, buf, buf_sz);
+    return 1;
+  }
+
+  ch_placement_find_closest(ctx->chp, pdlfs::xxhash64(buf, ctx->fname_len, 0),
+                            2, target);
+  cands[0] = static_cast<int>(target[0]) & ctx->receiver_mask;
+  cands[1] = static_cast<int>(target[1]) & ctx->receiver_mask;
+  return 2;
+}
+
+/* number of names hashed per round by shuffle_target_batch() */
+#define SHUFFLE_TARGET_BATCH 256
+
+void shuffle_target_batch(shuffle_ctx_t* ctx, const char* reqs,
+                          size_t num_reqs, size_t stride, int* targets) {
+  uint64_t h64[SHUFFLE_TARGET_BATCH];
+  uint32_t h32[SHUFFLE_TARGET_BATCH];
+  unsigned long target[2];
+  int world_sz;
+  size_t m;
+
+  assert(ctx != NULL);
+  assert(stride >= ctx->fname_len);
+
+  world_sz = shuffle_world_sz(ctx);
+
+  if (world_sz == 1) {
+    for (size_t i = 0; i < num_reqs; i++) {
+      targets[i] = shuffle_rank(ctx) & ctx->receiver_mask;
+    }
+    return;
+  }
+
+  for (size_t base = 0; base < num_reqs; base += m) {
+    const char* const r = reqs + base * stride;
+    int* const t = targets + base;
+    m = num_reqs - base;
+    if (m > SHUFFLE_TARGET_BATCH) m = SHUFFLE_TARGET_BATCH;
+    if (IS_BYPASS_PLACEMENT(pctx.mode)) {
+      xxhash32_batch(r, stride, ctx->fname_len, m, 0, h32);
+      for (size_t j = 0; j < m; j++) {
+        t[j] = (h32[j] % world_sz) & ctx->receiver_mask;
+      }
+    } else if (ctx->rp != NULL) {
+      const uint64_t* const pivots =
+          __atomic_load_n(&ctx->rp->pivots, __ATOMIC_ACQUIRE);
+      for (size_t j = 0; j < m; j++) {
+        const uint64_t key = range_key(r + j * stride, ctx->fname_len);
+        t[j] = (range_lookup(pivots, ctx->rp->parts, key) *
+                ctx->receiver_rate) &
+               ctx->receiver_mask;
+      }
+    } else {
+      xxhash64_batch(r, stride, ctx->fname_len, m, 0, h64);
+      if (ctx->pt != NULL) {
+        const placement_table_t* const pt =
+            __atomic_load_n(&ctx->pt, __ATOMIC_ACQUIRE);
+        for (size_t j = 0; j < m; j++) {
+          t[j] = placement_table_lookup(pt, h64[j]) & ctx->receiver_mask;
+        }
+      } else {
+        assert(ctx->chp != NULL);
+        for (size_t j = 0; j < m; j++) {
+          ch_placement_find_closest(ctx->chp, h64[j], ctx->choices, target);
+          if (ctx->choices == 2) {
+            t[j] = shuffle_choose(ctx, target);
+          } else {
+            t[j] = static_cast<int>(target[0]) & ctx->receiver_mask;
+          }
+        }
+      }
+    }
+  }
+}
+
 namespace {
-void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned char buf_sz,
+/*
+ * shuffle_sample: offer the name of a req we are sending to the range
+ * sampler.  called once per write on the sending side only, never from
+ * shuffle_target(), which receivers also use to check incoming writes.
+ */
+void shuffle_sample(shuffle_ctx_t* ctx, const char* req) {
+  if (ctx->rp != NULL && shuffle_world_sz(ctx) != 1) {
+    range_placement_sample(ctx->rp, range_key(req, ctx->fname_len));
+  }
+}
+
+void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, size_t buf_sz,
                          int epoch, int src, int dst) {
   const int h = pdlfs::xxhash32(buf, buf_sz, 0);
 
   if (src != dst || ctx->force_rpc) {
-    fprintf(pctx.trace, "[SH] %u bytes (ep=%d) r%d >> r%d (xx=%08x)\n", buf_sz,
-            epoch, src, dst, h);
+    fprintf(pctx.trace, "[SH] %u bytes (ep=%d) r%d >> r%d (xx=%08x)\n",
+            static_cast<unsigned>(buf_sz), epoch, src, dst, h);
   } else {
     fprintf(pctx.trace,
             "[LO] %u bytes (ep=%d) "
             "(xx=%08x)\n",
-            buf_sz, epoch, h);
+            static_cast<unsigned>(buf_sz), epoch, h);
   }
 }
 }  // namespace
 
-int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
-                  unsigned char fname_len, char* data, unsigned char data_len,
-                  int epoch) {
-  char buf[255];
-  int peer_rank;
-  int rank;
+/* reqs up to this size are assembled on the stack by shuffle_write() */
+#define SHUFFLE_STACK_REQ 256
+
+int shuffle_write(shuffle_ctx_t* ctx, const char* fname, size_t fname_len,
+                  char* data, size_t data_len, int epoch) {
+  char stackbuf[SHUFFLE_STACK_REQ];
+  char* buf;
   int rv;
 
   assert(ctx == &pctx.sctx);
-  assert(ctx->extra_data_len + ctx->data_len < 255 - ctx->fname_len - 1);
   if (ctx->fname_len != fname_len) ABORT("bad filename len");
   if (ctx->data_len != data_len) ABORT("bad data len");
 
-  unsigned char base_sz = 1 + fname_len + data_len;
-  unsigned char buf_sz = base_sz + ctx->extra_data_len;
+  const size_t base_sz = 1 + fname_len + data_len;
+  const size_t buf_sz = base_sz + ctx->extra_data_len;
+  buf = stackbuf;
+  if (buf_sz > sizeof(stackbuf)) {
+    buf = static_cast<char*>(malloc(buf_sz));
+    if (buf == NULL) {
+      ABORT("malloc");
+    }
+  }
   memcpy(buf, fname, fname_len);
   buf[fname_len] = 0;
   memcpy(buf + fname_len + 1, data, data_len);
   if (buf_sz != base_sz) memset(buf + base_sz, 0, buf_sz - base_sz);
 
-  peer_rank = shuffle_target(ctx, buf, buf_sz);
+  rv = shuffle_write_req(ctx, buf, buf_sz, shuffle_target(ctx, buf, buf_sz),
+                         epoch);
+  if (buf != stackbuf) {
+    free(buf);
+  }
+
+  return rv;
+}
+
+int shuffle_write_batch(shuffle_ctx_t* ctx, char* reqs, size_t num_reqs,
+                        size_t stride, size_t req_sz, int epoch) {
+  int targets[SHUFFLE_TARGET_BATCH];
+  size_t m;
+  int rv;
+
+  assert(stride >= req_sz);
+
+  rv = 0;
+  for (size_t base = 0; base < num_reqs && rv == 0; base += m) {
+    char* const r = reqs + base * stride;
+    m = num_reqs - base;
+    if (m > SHUFFLE_TARGET_BATCH) m = SHUFFLE_TARGET_BATCH;
+    shuffle_target_batch(ctx, r, m, stride, targets);
+    for (size_t j = 0; j < m && rv == 0; j++) {
+      rv = shuffle_write_req(ctx, r + j * stride, req_sz, targets[j], epoch);
+    }
+  }
+
+  return rv;
+}
+
+int shuffle_write_req(shuffle_ctx_t* ctx, char* req, size_t req_sz,
+                      int peer_rank, int epoch) {
+  int rank;
+  int rv;
+
+  assert(ctx == &pctx.sctx);
+  if (req_sz != ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1)
+    ABORT("bad data len");
   rank = shuffle_rank(ctx);
+  shuffle_sample(ctx, req);
 
   /* write trace if we are in testing mode */
   if (pctx.testin && pctx.trace != NULL)
-    shuffle_write_debug(ctx, buf, buf_sz, epoch, rank, peer_rank);
+    shuffle_write_debug(ctx, req, req_sz, epoch, rank, peer_rank);
 
   /* bypass rpc if target is local */
   if (peer_rank == rank && !ctx->force_rpc) {
-    rv = native_write(fname, fname_len, data, data_len, epoch);
+    rv = native_write(req, ctx->fname_len, req + ctx->fname_len + 1,
+                      ctx->data_len, epoch);
+    if (ctx->reweight) {
+      __sync_fetch_and_add(&ctx->epoch_keys, 1);
+    }
     return rv;
   }
 
   if (ctx->type == SHUFFLE_XN) {
-    xn_shuffler_enqueue(static_cast<xn_ctx_t*>(ctx->rep), buf, buf_sz, epoch,
+    xn_shuffler_enqueue(static_cast<xn_ctx_t*>(ctx->rep), req, req_sz, epoch,
                         peer_rank, rank);
   } else {
-    nn_shuffler_enqueue(buf, buf_sz, epoch, peer_rank, rank);
+    if (ctx->epoch_counting) {
+      __sync_fetch_and_add(&ctx->sent_writes[peer_rank], 1);
+    }
+    nn_shuffler_enqueue(req, req_sz, epoch, peer_rank, rank);
   }
 
   return 0;
 }
 
+char* shuffle_reserve_req(shuffle_ctx_t* ctx, size_t req_sz, int peer_rank,
+                          int epoch) {
+  int rank;
+
+  assert(ctx == &pctx.sctx);
+  if (req_sz != ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1)
+    ABORT("bad data len");
+  rank = shuffle_rank(ctx);
+
+  if (ctx->type != SHUFFLE_NN) return NULL;
+  if (peer_rank == rank && !ctx->force_rpc) return NULL;
+
+  if (ctx->epoch_counting) {
+    __sync_fetch_and_add(&ctx->sent_writes[peer_rank], 1);
+  }
+  return nn_shuffler_reserve(req_sz, epoch, peer_rank, rank);
+}
+
+void shuffle_commit_req(shuffle_ctx_t* ctx, char* req, size_t req_sz,
+                        int peer_rank, int epoch) {
+  assert(ctx == &pctx.sctx);
+  shuffle_sample(ctx, req);
+
+  /* write trace if we are in testing mode */
+  if (pctx.testin && pctx.trace != NULL)
+    shuffle_write_debug(ctx, req, req_sz, epoch, shuffle_rank(ctx),
+                        peer_rank);
+
+  nn_shuffler_commit(peer_rank);
+}
+
 namespace {
 void shuffle_handle_debug(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
                           int epoch, int src, int dst) {
@@ -422,8 +902,11 @@ int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
   ctx = &pctx.sctx;
   if (buf_sz != ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1)
     ABORT("unexpected incoming shuffle request size");
-  rv = exotic_write(buf, ctx->fname_len, buf + ctx->fname_len + 1,
-                    ctx->data_len, epoch);
+  rv = exotic_write_batch(buf, 1, buf_sz, ctx->fname_len, ctx->data_len,
+                          epoch);
+  if (ctx->reweight) {
+    __sync_fetch_and_add(&ctx->epoch_keys, 1);
+  }
 
   if (pctx.testin && pctx.trace != NULL)
     shuffle_handle_debug(ctx, buf, buf_sz, epoch, src, dst);
@@ -431,8 +914,62 @@ int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
   return rv;
 }
 
+int shuffle_handle_batch(shuffle_ctx_t* ctx, char* msg, unsigned int msg_sz,
+                         int epoch, int src, int dst,
+                         unsigned int* num_reqs) {
+  char hdr[8];
+  size_t hdr_sz;
+  size_t req_sz;
+  size_t stride;
+  unsigned int n;
+  int rv;
+
+  ctx = &pctx.sctx;
+  /* all reqs have the same size, so each carries the same varint in front
+   * and reqs can be written out in place every stride bytes */
+  req_sz = ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1;
+  hdr_sz = shuffle_putlen(hdr, req_sz);
+  stride = hdr_sz + req_sz;
+  if (msg_sz % stride != 0) ABORT("unexpected incoming shuffle msg size");
+  n = msg_sz / stride;
+  for (unsigned int i = 0; i < n; i++) {
+    if (memcmp(msg + i * stride, hdr, hdr_sz) != 0) {
+      ABORT("unexpected incoming shuffle request size");
+    }
+  }
+
+  rv = exotic_write_batch(msg + hdr_sz, n, stride, ctx->fname_len,
+                          ctx->data_len, epoch);
+  if (ctx->epoch_counting) {
+    __sync_fetch_and_add(&ctx->recv_writes[epoch & 1], n);
+  }
+  if (ctx->reweight) {
+    __sync_fetch_and_add(&ctx->epoch_keys, n);
+  }
+
+  if (pctx.testin && pctx.trace != NULL) {
+    for (unsigned int i = 0; i < n; i++) {
+      shuffle_handle_debug(ctx, msg + i * stride + hdr_sz, req_sz, epoch, src,
+                           dst);
+    }
+  }
+
+  if (num_reqs != NULL) {
+    *num_reqs = n;
+  }
+
+  return rv;
+}
+
 void shuffle_finalize(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
+  if (ctx->epoch_counting) {
+    shuffle_epoch_count_wait(ctx);
+    free(ctx->sent_writes);
+    free(ctx->sent_counts);
+    ctx->sent_writes = ctx->sent_counts = NULL;
+    ctx->epoch_counting = 0;
+  }
   if (ctx->type == SHUFFLE_XN && ctx->rep != NULL) {
     xn_ctx_t* rep = static_cast<xn_ctx_t*>(ctx->rep);
     xn_shuffler_destroy(rep);
@@ -471,6 +1008,7 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
     free(rep);
   } else {
     hstg_t hg_intvl;
+    hstg_t rpc_lat;
     int p[] = {10, 30, 50, 70, 90, 95, 96, 97, 98, 99};
     double d[] = {99.5,  99.7,   99.9,   99.95,  99.97,
                   99.99, 99.995, 99.997, 99.999, 99.9999};
@@ -479,6 +1017,8 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
     nn_rusage_t total_rusage[NUM_RUSAGE];
     unsigned long long total_writes;
     unsigned long long total_msgsz;
+    unsigned long long total_rpcs;
+    unsigned long long wk_busy[3];
     hstg_t iq_dep;
     nn_shuffler_destroy();
     if (ctx->finalize_pause > 0) {
@@ -551,6 +1091,20 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
         }
       }
     }
+    memset(&rpc_lat, 0, sizeof(hstg_t));
+    hstg_reset_min(rpc_lat);
+    hstg_reduce(nnctx.rpc_lat, rpc_lat, MPI_COMM_WORLD);
+    if (pctx.my_rank == 0 && hstg_num(rpc_lat) >= 1.0) {
+      logf(LOG_INFO, "[nn] rpc latency ... (us)%s",
+           nnctx.hg_spin != 0 ? " (busy polling)" : "");
+      logf(LOG_INFO, "  %s samples, avg: %.3f (min: %.0f, max: %.0f)",
+           pretty_num(hstg_num(rpc_lat)).c_str(), hstg_avg(rpc_lat),
+           hstg_min(rpc_lat), hstg_max(rpc_lat));
+      for (size_t i = 0; i < sizeof(p) / sizeof(int); i++) {
+        logf(LOG_INFO, "    - %d%% %-12.2f %.4f%% %.2f", p[i],
+             hstg_ptile(rpc_lat, p[i]), d[i], hstg_ptile(rpc_lat, d[i]));
+      }
+    }
     if (pctx.recv_comm != MPI_COMM_NULL) {
       memset(&hg_intvl, 0, sizeof(hstg_t));
       hstg_reset_min(hg_intvl);
@@ -572,12 +1126,33 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
                  MPI_SUM, 0, pctx.recv_comm);
       MPI_Reduce(&nnctx.total_msgsz, &total_msgsz, 1, MPI_UNSIGNED_LONG_LONG,
                  MPI_SUM, 0, pctx.recv_comm);
-      if (pctx.my_rank == 0 && hstg_num(iq_dep) >= 1.0) {
+      MPI_Reduce(&nnctx.total_rpcs, &total_rpcs, 1, MPI_UNSIGNED_LONG_LONG,
+                 MPI_SUM, 0, pctx.recv_comm);
+      if (nnctx.num_workers != 0) {
+        MPI_Reduce(&nnctx.r[RPCU_WORKER].busy_micros, &wk_busy[0], 1,
+                   MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, pctx.recv_comm);
+        MPI_Reduce(&nnctx.min_wk_busy, &wk_busy[1], 1, MPI_UNSIGNED_LONG_LONG,
+                   MPI_MIN, 0, pctx.recv_comm);
+        MPI_Reduce(&nnctx.max_wk_busy, &wk_busy[2], 1, MPI_UNSIGNED_LONG_LONG,
+                   MPI_MAX, 0, pctx.recv_comm);
+        if (pctx.my_rank == 0) {
+          logf(LOG_INFO,
+               "[nn] rpc worker busy time: %.3f s per worker "
+               "(min: %.3f s, max: %.3f s, %d workers per recv)",
+               double(wk_busy[0]) / 1000000 / pctx.recv_sz /
+                   nnctx.num_workers,
+               double(wk_busy[1]) / 1000000, double(wk_busy[2]) / 1000000,
+               nnctx.num_workers);
+        }
+      }
+      if (pctx.my_rank == 0 && total_rpcs != 0) {
         logf(LOG_INFO,
              "[nn] avg rpc size: %s (%s writes per rpc, %s per write)",
-             pretty_size(double(total_msgsz) / hstg_sum(iq_dep)).c_str(),
-             pretty_num(double(total_writes) / hstg_sum(iq_dep)).c_str(),
+             pretty_size(double(total_msgsz) / total_rpcs).c_str(),
+             pretty_num(double(total_writes) / total_rpcs).c_str(),
              pretty_size(double(total_msgsz) / double(total_writes)).c_str());
+      }
+      if (pctx.my_rank == 0 && hstg_num(iq_dep) >= 1.0) {
         logf(LOG_INFO, "[nn] rpc incoming queue depth ...");
         logf(LOG_INFO, "  %s samples, avg: %.3f (min: %.0f, max: %.0f)",
              pretty_num(hstg_num(iq_dep)).c_str(), hstg_avg(iq_dep),
@@ -594,17 +1169,23 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
     ch_placement_finalize(ctx->chp);
     ctx->chp = NULL;
   }
+  if (ctx->pt != NULL) {
+    placement_table_destroy(ctx->pt);
+    free(ctx->pt);
+    ctx->pt = NULL;
+  }
+  if (ctx->pt_prev != NULL) {
+    placement_table_destroy(ctx->pt_prev);
+    free(ctx->pt_prev);
+    ctx->pt_prev = NULL;
+  }
+  if (ctx->rp != NULL) {
+    range_placement_destroy(ctx->rp);
+    free(ctx->rp);
+    ctx->rp = NULL;
+  }
 }
 
-namespace {
-/* convert an integer number to an unsigned char */
-unsigned char TOUCHAR(int input) {
-  assert(input >= 0 && input <= 255);
-  unsigned char rv = static_cast<unsigned char>(input);
-  return rv;
-}
-}  // namespace
-
 void shuffle_init(shuffle_ctx_t* ctx) {
   const char* proto;
   const char* env;
@@ -614,11 +1195,15 @@ void shuffle_init(shuffle_ctx_t* ctx) {
 
   assert(ctx != NULL);
 
-  ctx->fname_len = TOUCHAR(pctx.particle_id_size);
-  ctx->extra_data_len = TOUCHAR(pctx.particle_extra_size);
-  ctx->data_len = pctx.sideio ? 8 : TOUCHAR(pctx.particle_size);
-  if (ctx->extra_data_len + ctx->data_len > 255 - ctx->fname_len - 1)
-    ABORT("bad shuffle conf: id + data exceeds 255 bytes");
+  assert(pctx.particle_id_size >= 0 && pctx.particle_extra_size >= 0);
+  assert(pctx.particle_size >= 0);
+  ctx->fname_len = static_cast<unsigned int>(pctx.particle_id_size);
+  ctx->extra_data_len = static_cast<unsigned int>(pctx.particle_extra_size);
+  ctx->data_len =
+      pctx.sideio ? 8 : static_cast<unsigned int>(pctx.particle_size);
+  if (size_t(ctx->fname_len) + 1 + ctx->data_len + ctx->extra_data_len >
+      SHUFFLE_MAX_REQ)
+    ABORT("bad shuffle conf: id + data exceeds max req size");
   if (ctx->fname_len == 0) {
     ABORT("bad shuffle conf: id size is zero");
   }
@@ -685,6 +1270,27 @@ void shuffle_init(shuffle_ctx_t* ctx) {
            "switch to the multi-hop shuffler for better scalability");
     }
   }
+  ctx->codec = SHUFFLE_CODEC_NONE;
+  env = maybe_getenv("SHUFFLE_Codec");
+  if (env != NULL) {
+    ctx->codec = shuffle_codec_method(env);
+    if (ctx->codec == -1) {
+      logf(LOG_WARN, "unknown shuffle codec %s (rank %d)", env, pctx.my_rank);
+      ctx->codec = SHUFFLE_CODEC_NONE;
+    }
+  }
+  /* senders and receivers must agree on whether rpcs carry codec frames.
+   * frames describe themselves, so any lower method works for everyone */
+  n = ctx->codec;
+  MPI_Allreduce(&n, &ctx->codec, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+  if (pctx.my_rank == 0) {
+    if (ctx->codec != n) {
+      logf(LOG_WARN, "shuffle codec downgraded to %s by peers",
+           shuffle_codec_name(ctx->codec));
+    } else if (ctx->codec != SHUFFLE_CODEC_NONE) {
+      logf(LOG_INFO, "shuffle codec: %s", shuffle_codec_name(ctx->codec));
+    }
+  }
   if (ctx->type == SHUFFLE_XN) {
     xn_ctx_t* rep = static_cast<xn_ctx_t*>(malloc(sizeof(xn_ctx_t)));
     memset(rep, 0, sizeof(xn_ctx_t));
@@ -696,6 +1302,29 @@ void shuffle_init(shuffle_ctx_t* ctx) {
     world_sz = nn_shuffler_world_size();
   }
 
+  ctx->count_req = MPI_REQUEST_NULL;
+  if (is_envset("SHUFFLE_Epoch_counting")) {
+    if (ctx->type == SHUFFLE_XN) {
+      /* writes wait in relay queues until the next collective flush, and
+       * are delivered without an epoch, so they cannot be counted here */
+      if (pctx.my_rank == 0) {
+        logf(LOG_WARN, "epoch counting is not supported by the xn shuffler");
+      }
+    } else {
+      ctx->epoch_counting = 1;
+      ctx->sent_writes = static_cast<unsigned long long*>(
+          calloc(world_sz, sizeof(unsigned long long)));
+      ctx->sent_counts = static_cast<unsigned long long*>(
+          calloc(world_sz, sizeof(unsigned long long)));
+      if (!ctx->sent_writes || !ctx->sent_counts) {
+        ABORT("calloc");
+      }
+      if (pctx.my_rank == 0) {
+        logf(LOG_INFO, "shuffle epoch counting is ON");
+      }
+    }
+  }
+
   if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
     env = maybe_getenv("SHUFFLE_Virtual_factor");
     if (env == NULL) {
@@ -709,10 +1338,86 @@ void shuffle_init(shuffle_ctx_t* ctx) {
       proto = DEFAULT_PLACEMENT_PROTO;
     }
 
-    ctx->chp = ch_placement_initialize(proto, world_sz, vf /* vir factor */,
-                                       0 /* hash seed */);
-    if (ctx->chp == NULL) {
-      ABORT("ch_init");
+    if (strcmp(proto, "range") == 0) {
+      size_t samples = DEFAULT_RANGE_SAMPLES;
+      double threshold = DEFAULT_RANGE_REBALANCE;
+      env = maybe_getenv("SHUFFLE_Range_samples");
+      if (env != NULL && atoi(env) >= 0) {
+        samples = atoi(env);
+      }
+      env = maybe_getenv("SHUFFLE_Range_rebalance");
+      if (env != NULL) {
+        threshold = atof(env);
+      }
+      /* the barrier keeps ranks from sending writes of the next epoch
+       * to a rank that has not installed the new pivots yet */
+      if (threshold > 0 && !pctx.paranoid_post_barrier) {
+        ABORT("range re-balancing needs the post barrier");
+      }
+      ctx->rp = static_cast<range_placement_t*>(malloc(sizeof(*ctx->rp)));
+      if (ctx->rp == NULL) {
+        ABORT("malloc");
+      }
+      n = (world_sz + ctx->receiver_rate - 1) / ctx->receiver_rate;
+      range_placement_init(ctx->rp, n, samples, threshold);
+      if (pctx.my_rank == 0) {
+        range_placement_record(ctx->rp, 0);
+      }
+    } else if (strcmp(proto, "table") == 0) {
+      env = maybe_getenv("SHUFFLE_Placement_table_bits");
+      ctx->pt = static_cast<placement_table_t*>(malloc(sizeof(*ctx->pt)));
+      if (ctx->pt == NULL) {
+        ABORT("malloc");
+      }
+      placement_table_init(ctx->pt, world_sz, vf, env ? atoi(env) : 0);
+      if (is_envset("SHUFFLE_Placement_reweight")) {
+        if (ctx->receiver_rate != 1) {
+          /* loads are measured at receivers, not at ring ranks */
+          if (pctx.my_rank == 0) {
+            logf(LOG_WARN,
+                 "placement re-weighting needs all ranks to be receivers");
+          }
+        } else {
+          /* the barrier keeps ranks from sending writes of the next epoch
+           * to a rank that has not installed the new ring yet */
+          if (!pctx.paranoid_post_barrier) {
+            ABORT("placement re-weighting needs the post barrier");
+          }
+          ctx->reweight = 1;
+          ctx->reweight_budget = DEFAULT_REWEIGHT_BUDGET;
+          env = maybe_getenv("SHUFFLE_Reweight_budget");
+          if (env != NULL && atof(env) >= 0) {
+            ctx->reweight_budget = atof(env);
+          }
+        }
+      }
+    } else {
+      ctx->chp = ch_placement_initialize(proto, world_sz, vf /* vir factor */,
+                                         0 /* hash seed */);
+      if (ctx->chp == NULL) {
+        ABORT("ch_init");
+      }
+      ctx->proto = proto;
+      ctx->vf = vf;
+    }
+
+    ctx->choices = 1;
+    env = maybe_getenv("SHUFFLE_Placement_choices");
+    if (env != NULL && atoi(env) == 2) {
+      if (ctx->chp == NULL || ctx->type != SHUFFLE_NN) {
+        /* backlogs are only tracked per peer by the nn shuffler */
+        if (pctx.my_rank == 0) {
+          logf(LOG_WARN,
+               "two-choice placement needs the nn shuffler and a "
+               "ch-placement protocol");
+        }
+      } else if (world_sz / ctx->receiver_rate < 2) {
+        if (pctx.my_rank == 0) {
+          logf(LOG_WARN, "two-choice placement needs at least 2 receivers");
+        }
+      } else {
+        ctx->choices = 2;
+      }
     }
   }
 
@@ -721,8 +1426,34 @@ void shuffle_init(shuffle_ctx_t* ctx) {
       logf(LOG_INFO,
            "ch-placement group size: %s (vir-factor: %s, proto: %s)\n>>> "
            "possible protocols are: "
-           "static_modulo, hash_lookup3, xor, and ring",
+           "static_modulo, hash_lookup3, xor, ring, table, and range",
            pretty_num(world_sz).c_str(), pretty_num(vf).c_str(), proto);
+      if (ctx->rp != NULL) {
+        logf(LOG_INFO,
+             "range placement: %d parts, %s samples per rank per epoch "
+             "(re-balance at %.2fx mean load)",
+             ctx->rp->parts, pretty_num(ctx->rp->cap).c_str(),
+             ctx->rp->threshold);
+      }
+      if (ctx->choices == 2) {
+        logf(LOG_INFO, "two-choice placement is ON");
+      }
+      if (ctx->reweight) {
+        logf(LOG_INFO,
+             "placement re-weighting is ON (budget: %.1f%% names per epoch)",
+             100 * ctx->reweight_budget);
+      }
+      if (ctx->pt != NULL) {
+        logf(LOG_INFO,
+             "placement table: %s entries (%s ambiguous, max scan %d), "
+             "%s + %s ring",
+             pretty_num(double(size_t(1) << ctx->pt->bits)).c_str(),
+             pretty_num(ctx->pt->num_ambiguous).c_str(), ctx->pt->max_scan,
+             pretty_size(double(sizeof(int) << ctx->pt->bits)).c_str(),
+             pretty_size(double(ctx->pt->num_vnodes *
+                                sizeof(placement_vnode_t)))
+                 .c_str());
+      }
     } else {
       logf(LOG_INFO, "ch-placement bypassed");
     }
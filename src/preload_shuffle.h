@@ -39,7 +39,33 @@
  *    Send rpcs even if target is local
  *  SHUFFLE_Placement_protocol
  *    Protocol name for initializing placement groups
- *      such as static_modulo, hash_spooky, hash_lookup3, xor, as well as ring
+ *      such as static_modulo, hash_spooky, hash_lookup3, xor, as well as ring,
+ *      or "table" for our own ring (not ch-placement's) with a precomputed
+ *      lookup table; it places names differently from ring,
+ *      or "range" for receivers owning contiguous ranges of names
+ *  SHUFFLE_Placement_choices
+ *    Number of candidate receivers taken from the ring for each name (1 or 2).
+ *      With 2, a name goes to the candidate with fewer rpcs in flight from us
+ *      (nn only, ch-placement protocols only)
+ *  SHUFFLE_Placement_table_bits
+ *    Log2 of the number of lookup table entries for the "table" protocol
+ *      (0 for about 2 entries per vnode)
+ *  SHUFFLE_Placement_reweight
+ *    Re-weight ranks in the "table" ring between epochs by their ingest.
+ *      Needs the preload paranoid post barrier
+ *  SHUFFLE_Reweight_budget
+ *    Max fraction of names moved to new ranks per re-weighting (0.05)
+ *  SHUFFLE_Range_samples
+ *    Number of names each rank samples per epoch for the "range" protocol
+ *  SHUFFLE_Range_rebalance
+ *    Re-balance range pivots between epochs when the sampled load of the
+ *      busiest receiver exceeds this many times the mean (0 to disable).
+ *      Needs the preload paranoid post barrier unless disabled
+ *  SHUFFLE_Codec
+ *    Compress rpc messages: "lz", or "xlz" to also prefix code names and
+ *      delta code data bytes column by column before lz (default "none").
+ *      Only used if all ranks ask for it. Applies to network hops only
+ *      with the three-hop shuffler
  *  SHUFFLE_Virtual_factor
  *    Virtual factor used by nodes in a placement group
  *  SHUFFLE_Recv_radix
@@ -47,16 +73,51 @@
  *  SHUFFLE_Finalize_pause
  *    Number of secs to sleep after releasing the shuffle instance
  *      for shuffle bg threads to complete shutdown
+ *  SHUFFLE_Epoch_counting
+ *    Detect the end of an epoch at each receiver by counting the
+ *      writes sent to it instead of relying on global barriers (nn only).
+ *      Replaces the preload paranoid barrier and pre-barrier
  */
 #pragma once
 
+#include <mpi.h>
 #include <stddef.h>
 
+#include "placement_table.h"
+#include "range_placement.h"
+
+/* max size of a single write request (name, NUL, data, and padding) */
+#define SHUFFLE_MAX_REQ (64 << 10)
+
 typedef struct shuffle_ctx {
   /* internal shuffle impl */
   void* rep;
   /* consistent hash context */
   struct ch_placement_instance* chp;
+  /* our own ring and its lookup table (instead of chp). re-weighting
+   * builds a new table and swaps it in atomically since rpc threads may
+   * be looking up pt meanwhile. the table it replaces is kept in pt_prev
+   * until the next epoch boundary. */
+  placement_table_t* pt;
+  placement_table_t* pt_prev;
+  /* range partitioning over receivers (instead of chp) */
+  range_placement_t* rp;
+  /* candidate receivers per name (chp only). with 2 choices, each write goes
+   * to whichever of the two ring successors of its name has fewer of our
+   * rpcs in flight so that bursts to a slow receiver spill over to its
+   * neighbor instead of piling up until the rpc timeout. readers must then
+   * look up a name at both candidates. */
+  int choices;
+  const char* proto; /* ch-placement protocol (NULL if not used) */
+  int vf;            /* virtual factor of the ring */
+  /* load-aware ring weights (table protocol only). each rank counts the
+   * writes it executes during an epoch. at the next epoch start, rank 0
+   * adds or removes vnodes to even out these loads within a budget of names
+   * moved, and broadcasts the new vnode counts so that all ranks install
+   * the same ring. */
+  int reweight;
+  double reweight_budget; /* max fraction of names moved per epoch */
+  unsigned long long epoch_keys; /* writes executed here this epoch */
   /* whether shuffle should never be bypassed
    * even when destination is local. it is often necessary to
    * avoid bypassing the shuffle. this is because the main thread
@@ -71,13 +132,30 @@ typedef struct shuffle_ctx {
   /* (rank & receiver_mask) -> receiver_rank */
   unsigned int receiver_mask;
   int is_receiver;
-  unsigned char fname_len;
-  unsigned char extra_data_len;
-  unsigned char data_len;
+  /* write request format: fname_len bytes of name, a NUL, data_len bytes
+   * of data, and extra_data_len bytes of padding. each request is sent
+   * with its size as a varint in front (see shuffle_putlen()) so none of
+   * these is limited to a single byte. */
+  unsigned int fname_len;
+  unsigned int extra_data_len;
+  unsigned int data_len;
+  /* codec for rpc messages (see shuffle_codec.h), agreed on by all ranks */
+  int codec;
   /* shuffle type */
   int type;
 #define SHUFFLE_NN 0 /* default */
 #define SHUFFLE_XN 1
+  /* epoch termination detection by write counts. each sender counts the
+   * writes it sends to each rank. at the end of an epoch, these counts
+   * are summed up per destination with a reduce-scatter so each receiver
+   * learns how many writes to expect, and waits for them to arrive. */
+  int epoch_counting;
+  int num_epochs_counted; /* epoch whose writes we are now counting */
+  unsigned long long* sent_writes;  /* writes sent to each rank */
+  unsigned long long* sent_counts;  /* snapshot of above for the reduction */
+  unsigned long long recv_writes[2]; /* writes received, by epoch parity */
+  unsigned long long expected_writes;
+  MPI_Request count_req; /* MPI_REQUEST_NULL if no reduction pending */
 } shuffle_ctx_t;
 
 /*
@@ -109,9 +187,49 @@ int shuffle_world_sz(shuffle_ctx_t* ctx);
  *
  * return 0 on success, or EOF or errors.
  */
-int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
-                  unsigned char fname_len, char* data, unsigned char data_len,
-                  int epoch);
+int shuffle_write(shuffle_ctx_t* ctx, const char* fname, size_t fname_len,
+                  char* data, size_t data_len, int epoch);
+
+/*
+ * shuffle_write_req: same as shuffle_write, but the caller has already
+ * laid out the write request in req (filename, NUL, data, and zero
+ * padding for extra data, req_sz bytes in total) and has obtained its
+ * destination through shuffle_target().  this allows callers to
+ * assemble requests in place and saves a copy.
+ *
+ * return 0 on success, or EOF or errors.
+ */
+int shuffle_write_req(shuffle_ctx_t* ctx, char* req, size_t req_sz,
+                      int peer_rank, int epoch);
+
+/*
+ * shuffle_reserve_req: reserve req_sz bytes for a write request to
+ * peer_rank directly in the outgoing rpc queue, so the caller can lay
+ * out the request there without staging it first.  the queue is locked
+ * until shuffle_commit_req() and the caller must not block in between.
+ *
+ * return NULL if the request cannot be reserved (the target is local or
+ * the shuffler is not NN), in which case use shuffle_write_req().
+ */
+char* shuffle_reserve_req(shuffle_ctx_t* ctx, size_t req_sz, int peer_rank,
+                          int epoch);
+
+/*
+ * shuffle_commit_req: finish a write request filled in at req after a
+ * successful shuffle_reserve_req().
+ */
+void shuffle_commit_req(shuffle_ctx_t* ctx, char* req, size_t req_sz,
+                        int peer_rank, int epoch);
+
+/*
+ * shuffle_write_batch: shuffle_write_req() for num_reqs write requests
+ * laid out every stride bytes starting at reqs, with their destinations
+ * computed in one pass by shuffle_target_batch().
+ *
+ * return 0 on success, or EOF or errors.
+ */
+int shuffle_write_batch(shuffle_ctx_t* ctx, char* reqs, size_t num_reqs,
+                        size_t stride, size_t req_sz, int epoch);
 
 /*
  * shuffle_epoch_start: perform necessary flushes at the
@@ -137,6 +255,49 @@ void shuffle_epoch_pre_start(shuffle_ctx_t* ctx);
  */
 void shuffle_epoch_end(shuffle_ctx_t* ctx);
 
+/*
+ * shuffle_epoch_repartition: with range placement, gather the names sampled
+ * during the epoch that just ended and re-balance range pivots for the next
+ * epoch if needed.  must be called by all ranks before any writes of the
+ * next epoch are sent, and all ranks must return from it before any of
+ * them sends such writes (the preload post barrier ensures this).  frees
+ * the pivots replaced at the previous call.
+ *
+ * abort on errors.
+ */
+void shuffle_epoch_repartition(shuffle_ctx_t* ctx, int epoch);
+
+/*
+ * shuffle_epoch_reweight: with load-aware placement, gather the number of
+ * writes each rank executed during the epoch that just ended, and re-weight
+ * ranks in the placement ring for the next epoch.  must be called by all
+ * ranks before any writes of the next epoch are sent, and all ranks must
+ * return from it before any of them sends such writes (the preload post
+ * barrier ensures this).  frees the table replaced at the previous call.
+ *
+ * abort on errors.
+ */
+void shuffle_epoch_reweight(shuffle_ctx_t* ctx, int epoch);
+
+/*
+ * shuffle_epoch_count_post: with epoch counting, start summing up the
+ * number of writes each rank should receive for the epoch that just
+ * ended.  must be called by all ranks after all local writes of the
+ * epoch have been sent.
+ */
+void shuffle_epoch_count_post(shuffle_ctx_t* ctx);
+
+/*
+ * shuffle_epoch_count_wait: with epoch counting, wait until all writes
+ * other ranks sent to us in the previous epoch have been written.  the
+ * reduction completes only after every rank has posted its counts, so
+ * callers should wait as late as possible (i.e. at the start of the
+ * next epoch, before it is flushed) to overlap it with computation.
+ * aborts with the expected and received counts if the wait exceeds the
+ * rpc timeout (SHUFFLE_Timeout).
+ */
+void shuffle_epoch_count_wait(shuffle_ctx_t* ctx);
+
 /*
  * shuffle_finalize: shutdown the shuffle service and release resources.
  */
@@ -162,6 +323,23 @@ void shuffle_resume(shuffle_ctx_t* ctx);
  */
 int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz);
 
+/*
+ * shuffle_candidates: store every destination shuffle_target() may pick for
+ * a given req in cands[] and return their number: 2 under two-choice
+ * placement, or 1 otherwise.
+ */
+int shuffle_candidates(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
+                       int* cands);
+
+/*
+ * shuffle_target_batch: shuffle_target() for num_reqs reqs placed every
+ * stride bytes starting at reqs.  filenames are hashed several at a time
+ * (see xxhash_batch.h).  results are stored in targets[] and are the same
+ * as those of shuffle_target().
+ */
+void shuffle_target_batch(shuffle_ctx_t* ctx, const char* reqs,
+                          size_t num_reqs, size_t stride, int* targets);
+
 /*
  * shuffle_handle: process an incoming shuffled write. here "peer_rank" refers
  * to the original sender, and "rank" refers to us.
@@ -171,6 +349,63 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz);
 int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
                    int epoch, int peer_rank, int rank);
 
+/*
+ * shuffle_handle_batch: process all shuffled writes packed in an incoming
+ * msg as a sequence of [varint req size][req] pairs, writing them out
+ * as one batch.  the number of reqs found is stored in *num_reqs.
+ *
+ * return 0 on success, or EOF on errors.
+ */
+int shuffle_handle_batch(shuffle_ctx_t* ctx, char* msg, unsigned int msg_sz,
+                         int epoch, int peer_rank, int rank,
+                         unsigned int* num_reqs);
+
+/*
+ * shuffle_lensz: return the number of bytes shuffle_putlen() takes to
+ * store a req size.
+ */
+inline size_t shuffle_lensz(size_t sz) {
+  size_t n = 1;
+  while (sz >= 128) {
+    sz >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * shuffle_putlen: store a req size in front of a req as a little-endian
+ * base-128 varint (1 byte up to 127, 2 bytes up to 16383, ...).
+ * return the number of bytes written.
+ */
+inline size_t shuffle_putlen(char* dst, size_t sz) {
+  size_t n = 0;
+  while (sz >= 128) {
+    dst[n++] = static_cast<char>((sz & 127) | 128);
+    sz >>= 7;
+  }
+  dst[n++] = static_cast<char>(sz);
+  return n;
+}
+
+/*
+ * shuffle_getlen: parse a req size stored by shuffle_putlen() from the
+ * first avail bytes at src.  return the number of bytes consumed, or 0
+ * if the varint is truncated or too long.
+ */
+inline size_t shuffle_getlen(const char* src, size_t avail, size_t* sz) {
+  size_t v = 0;
+  for (size_t n = 0; n < avail && n < 5; n++) {
+    const unsigned char c = static_cast<unsigned char>(src[n]);
+    v |= static_cast<size_t>(c & 127) << (7 * n);
+    if ((c & 128) == 0) {
+      *sz = v;
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
 /*
  * shuffle_msg_sent: callback for a shuffle sender to
  * notify the main system of the sending of an rpc request.
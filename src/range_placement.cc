@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "range_placement.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+namespace {
+/* splitmix64 finalizer, used to pick reservoir slots */
+uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+}  // namespace
+
+void range_placement_init(range_placement_t* rp, int parts, size_t cap,
+                          double threshold) {
+  assert(parts > 0);
+  memset(rp, 0, sizeof(*rp));
+  rp->parts = parts;
+  rp->cap = cap;
+  rp->threshold = threshold;
+  rp->pivots = static_cast<uint64_t*>(malloc((parts + 1) * sizeof(uint64_t)));
+  if (rp->pivots == NULL) ABORT("malloc");
+  /* evenly spaced: part i owns [i * 2^64 / parts, (i + 1) * 2^64 / parts) */
+  for (int i = 1; i < parts; i++) {
+    rp->pivots[i - 1] = static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(i) << 64) / parts);
+  }
+  if (cap != 0) {
+    rp->samples = static_cast<uint64_t*>(malloc(cap * sizeof(uint64_t)));
+    if (rp->samples == NULL) ABORT("malloc");
+  }
+}
+
+void range_placement_destroy(range_placement_t* rp) {
+  free(rp->hist_pivots);
+  free(rp->hist_epochs);
+  free(rp->samples);
+  free(rp->pivots_prev);
+  free(rp->pivots);
+  memset(rp, 0, sizeof(*rp));
+}
+
+void range_placement_sample(range_placement_t* rp, uint64_t key) {
+  const unsigned long long i = __sync_fetch_and_add(&rp->seen, 1);
+  if (i < rp->cap) {
+    rp->samples[i] = key;
+  } else if (rp->cap != 0) {
+    const uint64_t j = mix(i) % (i + 1);
+    if (j < rp->cap) {
+      rp->samples[j] = key;
+    }
+  }
+}
+
+double range_placement_skew(const range_placement_t* rp,
+                            const uint64_t* pivots, const uint64_t* samples,
+                            size_t n) {
+  size_t max = 0;
+  size_t i = 0;
+
+  if (n == 0) return 1.0;
+  for (int p = 0; p < rp->parts; p++) {
+    size_t j = i;
+    if (p == rp->parts - 1) {
+      j = n;
+    } else {
+      while (j < n && samples[j] < pivots[p]) j++;
+    }
+    if (j - i > max) max = j - i;
+    i = j;
+  }
+
+  return double(max) * rp->parts / n;
+}
+
+void range_placement_pivots(const range_placement_t* rp, uint64_t* pivots,
+                            const uint64_t* samples, size_t n) {
+  assert(n != 0);
+  for (int p = 1; p < rp->parts; p++) {
+    pivots[p - 1] = samples[(n * p) / rp->parts];
+  }
+}
+
+void range_placement_record(range_placement_t* rp, int epoch) {
+  const size_t np = rp->parts - 1;
+  if (rp->hist_len != 0 &&
+      memcmp(rp->hist_pivots + (rp->hist_len - 1) * np, rp->pivots,
+             np * sizeof(uint64_t)) == 0) {
+    return; /* unchanged */
+  }
+  if (rp->hist_len == rp->hist_cap) {
+    rp->hist_cap = rp->hist_cap ? 2 * rp->hist_cap : 8;
+    rp->hist_epochs = static_cast<int*>(
+        realloc(rp->hist_epochs, rp->hist_cap * sizeof(int)));
+    rp->hist_pivots = static_cast<uint64_t*>(
+        realloc(rp->hist_pivots, rp->hist_cap * np * sizeof(uint64_t)));
+    if (rp->hist_epochs == NULL || (np != 0 && rp->hist_pivots == NULL)) {
+      ABORT("realloc");
+    }
+  }
+  rp->hist_epochs[rp->hist_len] = epoch;
+  memcpy(rp->hist_pivots + rp->hist_len * np, rp->pivots,
+         np * sizeof(uint64_t));
+  rp->hist_len++;
+}
+
+void range_placement_dump(const range_placement_t* rp, FILE* f) {
+  const size_t np = rp->parts - 1;
+  for (int h = 0; h < rp->hist_len; h++) {
+    fprintf(f, "range_pivots.%d=", rp->hist_epochs[h]);
+    for (size_t i = 0; i < np; i++) {
+      fprintf(f, "%s%016" PRIx64, i != 0 ? "," : "",
+              rp->hist_pivots[h * np + i]);
+    }
+    fprintf(f, "\n");
+  }
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * range_placement.h  range-partitioned placement of particle names
+ *
+ * names are ordered by a 64-bit key made of their first 8 bytes (big
+ * endian, zero padded), and each of the parts receivers owns a
+ * contiguous key range delimited by parts - 1 pivots.  pivots start out
+ * evenly spaced over the key space and may be recomputed between epochs
+ * from key samples taken by all senders.  the lookup functions below are
+ * header-only so that readers can route queries without the preload lib.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* range_key: order-preserving 64-bit key of a name */
+inline uint64_t range_key(const char* name, size_t len) {
+  uint64_t k = 0;
+  for (size_t i = 0; i < 8; i++) {
+    k <<= 8;
+    if (i < len) k |= static_cast<unsigned char>(name[i]);
+  }
+  return k;
+}
+
+/* range_lookup: index of the part owning key (the first pivot > key) */
+inline int range_lookup(const uint64_t* pivots, int parts, uint64_t key) {
+  int lo = 0;
+  int hi = parts - 1;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    if (pivots[mid] <= key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * Default number of names sampled per rank per epoch.
+ */
+#define DEFAULT_RANGE_SAMPLES 1024
+
+/*
+ * Default max/mean receiver load above which pivots are re-balanced.
+ */
+#define DEFAULT_RANGE_REBALANCE 1.2
+
+typedef struct range_placement {
+  int parts;        /* number of receivers */
+  /* parts - 1 pivots used by the current epoch. re-balancing stores a
+   * new array here atomically as rpc threads may be reading this one,
+   * which is then kept in pivots_prev until the next epoch boundary. */
+  uint64_t* pivots;
+  uint64_t* pivots_prev;
+  /* keys sampled from local writes of the current epoch. concurrent
+   * writers claim slots with an atomic counter; once full, later keys
+   * replace random slots (reservoir sampling). */
+  uint64_t* samples;
+  size_t cap;
+  unsigned long long seen;
+  double threshold; /* max/mean load that triggers a re-balance */
+  /* pivots of each epoch in which they changed (kept at rank 0 only) */
+  int* hist_epochs;
+  uint64_t* hist_pivots;
+  int hist_len;
+  int hist_cap;
+} range_placement_t;
+
+void range_placement_init(range_placement_t* rp, int parts, size_t cap,
+                          double threshold);
+void range_placement_destroy(range_placement_t* rp);
+
+/* range_placement_sample: offer the key of a write we send to the sampler */
+void range_placement_sample(range_placement_t* rp, uint64_t key);
+
+/*
+ * range_placement_skew: estimate max/mean load per part under the given
+ * pivots from n sorted samples.
+ */
+double range_placement_skew(const range_placement_t* rp,
+                            const uint64_t* pivots, const uint64_t* samples,
+                            size_t n);
+
+/*
+ * range_placement_pivots: set pivots to equi-depth boundaries of n sorted
+ * samples.
+ */
+void range_placement_pivots(const range_placement_t* rp, uint64_t* pivots,
+                            const uint64_t* samples, size_t n);
+
+/* range_placement_record: remember the current pivots for an epoch */
+void range_placement_record(range_placement_t* rp, int epoch);
+
+/*
+ * range_placement_dump: print recorded pivots as manifest lines
+ * ("range_pivots.<epoch>=<hex>,<hex>,...").  pivots of an epoch not
+ * listed are those of the closest earlier epoch listed.
+ */
+void range_placement_dump(const range_placement_t* rp, FILE* f);
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "shuffle_codec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * frame layout:
+ *
+ *   [method] [raw size]                                        (raw, lz)
+ *   [method] [raw size] [rec sz] [key off] [key len] [xform sz] (xlz)
+ *
+ * followed by the payload.  all sizes are varints.  the lz payload is a
+ * series of sequences, each being a token byte (high nibble: literal
+ * length, low nibble: match length - 4), an extended literal length if the
+ * high nibble is 15 (bytes of 255 ended by a byte < 255), the literals, a
+ * 2-byte little endian match offset, and an extended match length if the
+ * low nibble is 15.  the last sequence has no match and ends the payload.
+ */
+#define FRAME_RAW 0
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 /* keeps 4-byte loads within the input */
+#define LZ_MAX_OFFSET 65535
+
+namespace {
+
+size_t put_varint(unsigned char* dst, size_t v) {
+  size_t n = 0;
+  while (v >= 128) {
+    dst[n++] = static_cast<unsigned char>(v | 128);
+    v >>= 7;
+  }
+  dst[n++] = static_cast<unsigned char>(v);
+  return n;
+}
+
+int get_varint(const unsigned char** p, const unsigned char* end, size_t* v) {
+  size_t r = 0;
+  for (int shift = 0; shift < 35 && *p < end; shift += 7) {
+    const unsigned char b = *(*p)++;
+    r |= size_t(b & 127) << shift;
+    if (b < 128) {
+      *v = r;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+inline uint32_t load32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+unsigned char* lz_put_len(unsigned char* p, size_t len) {
+  while (len >= 255) {
+    *p++ = 255;
+    len -= 255;
+  }
+  *p++ = static_cast<unsigned char>(len);
+  return p;
+}
+
+/* lz_emit: append a sequence, or the last one if mlen is 0 */
+int lz_emit(unsigned char* out, size_t* op, size_t cap,
+            const unsigned char* lit, size_t nlit, size_t off, size_t mlen) {
+  const size_t need = 1 + nlit + nlit / 255 + 1 +
+                      (mlen != 0 ? 2 + (mlen - LZ_MIN_MATCH) / 255 + 1 : 0);
+  if (*op + need > cap) return -1;
+  unsigned char* p = out + *op;
+  unsigned char* const token = p++;
+  if (nlit >= 15) {
+    *token = 15 << 4;
+    p = lz_put_len(p, nlit - 15);
+  } else {
+    *token = static_cast<unsigned char>(nlit << 4);
+  }
+  memcpy(p, lit, nlit);
+  p += nlit;
+  if (mlen != 0) {
+    const size_t ml = mlen - LZ_MIN_MATCH;
+    p[0] = static_cast<unsigned char>(off);
+    p[1] = static_cast<unsigned char>(off >> 8);
+    p += 2;
+    if (ml >= 15) {
+      *token |= 15;
+      p = lz_put_len(p, ml - 15);
+    } else {
+      *token |= static_cast<unsigned char>(ml);
+    }
+  }
+  *op = p - out;
+  return 0;
+}
+
+/* lz_compress: return the compressed size, or 0 if it exceeds cap */
+size_t lz_compress(const unsigned char* in, size_t n, unsigned char* out,
+                   size_t cap) {
+  uint32_t table[1 << LZ_HASH_BITS];
+  size_t anchor = 0;
+  size_t ip = 0;
+  size_t op = 0;
+
+  memset(table, 0, sizeof(table));
+  if (n > LZ_LAST_LITERALS) {
+    const size_t limit = n - LZ_LAST_LITERALS;
+    while (ip < limit) {
+      const uint32_t v = load32(in + ip);
+      const uint32_t h = lz_hash(v);
+      const size_t ref = table[h];
+      table[h] = static_cast<uint32_t>(ip);
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || load32(in + ref) != v) {
+        /* skip faster through data that does not compress */
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      size_t len = LZ_MIN_MATCH;
+      while (ip + len < limit && in[ref + len] == in[ip + len]) len++;
+      if (lz_emit(out, &op, cap, in + anchor, ip - anchor, ip - ref, len) != 0)
+        return 0;
+      ip += len;
+      anchor = ip;
+    }
+  }
+
+  if (lz_emit(out, &op, cap, in + anchor, n - anchor, 0, 0) != 0) return 0;
+  return op;
+}
+
+int lz_get_len(const unsigned char** p, const unsigned char* end,
+               size_t* len) {
+  unsigned char b;
+  do {
+    if (*p >= end) return -1;
+    b = *(*p)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+/* lz_decompress: return the decompressed size, or -1 on errors */
+long lz_decompress(const unsigned char* in, size_t n, unsigned char* out,
+                   size_t cap) {
+  const unsigned char* p = in;
+  const unsigned char* const end = in + n;
+  size_t op = 0;
+
+  while (p < end) {
+    const unsigned token = *p++;
+    size_t nlit = token >> 4;
+    if (nlit == 15 && lz_get_len(&p, end, &nlit) != 0) return -1;
+    if (nlit > size_t(end - p) || nlit > cap - op) return -1;
+    memcpy(out + op, p, nlit);
+    p += nlit;
+    op += nlit;
+    if (p == end) break; /* last sequence */
+    if (end - p < 2) return -1;
+    const size_t off = p[0] | (size_t(p[1]) << 8);
+    p += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15 && lz_get_len(&p, end, &mlen) != 0) return -1;
+    mlen += LZ_MIN_MATCH;
+    if (off == 0 || off > op || mlen > cap - op) return -1;
+    if (off >= mlen) {
+      memcpy(out + op, out + op - off, mlen);
+    } else { /* overlapping copy repeats the last off bytes */
+      for (size_t i = 0; i < mlen; i++) out[op + i] = out[op + i - off];
+    }
+    op += mlen;
+  }
+
+  return long(op);
+}
+
+/*
+ * xform_encode: prefix code the name of each record against the previous
+ * one, then write every other byte column by column, each as the delta
+ * from the same byte of the previous record.  return the output size,
+ * which is at most n + n / rec_sz.
+ */
+size_t xform_encode(const unsigned char* in, size_t n, size_t rec_sz,
+                    size_t key_off, size_t key_len, unsigned char* out) {
+  const size_t nrec = n / rec_sz;
+  const unsigned char* prev = NULL;
+  unsigned char* p = out;
+
+  for (size_t i = 0; i < nrec; i++) {
+    const unsigned char* const key = in + i * rec_sz + key_off;
+    size_t s = 0;
+    if (prev != NULL) {
+      while (s < key_len && key[s] == prev[s]) s++;
+    }
+    *p++ = static_cast<unsigned char>(s);
+    memcpy(p, key + s, key_len - s);
+    p += key_len - s;
+    prev = key;
+  }
+
+  for (size_t c = 0; c < rec_sz; c++) {
+    if (c >= key_off && c < key_off + key_len) continue;
+    unsigned char last = 0;
+    for (size_t i = 0; i < nrec; i++) {
+      const unsigned char b = in[i * rec_sz + c];
+      *p++ = static_cast<unsigned char>(b - last);
+      last = b;
+    }
+  }
+
+  return p - out;
+}
+
+int xform_decode(const unsigned char* in, size_t tsz, size_t rec_sz,
+                 size_t key_off, size_t key_len, unsigned char* out,
+                 size_t n) {
+  const size_t nrec = n / rec_sz;
+  const unsigned char* p = in;
+  const unsigned char* const end = in + tsz;
+
+  for (size_t i = 0; i < nrec; i++) {
+    unsigned char* const key = out + i * rec_sz + key_off;
+    if (p >= end) return -1;
+    const size_t s = *p++;
+    if (s > key_len || (i == 0 && s != 0)) return -1;
+    if (key_len - s > size_t(end - p)) return -1;
+    if (s != 0) memcpy(key, key - rec_sz, s);
+    memcpy(key + s, p, key_len - s);
+    p += key_len - s;
+  }
+
+  for (size_t c = 0; c < rec_sz; c++) {
+    if (c >= key_off && c < key_off + key_len) continue;
+    if (size_t(end - p) < nrec) return -1;
+    unsigned char last = 0;
+    for (size_t i = 0; i < nrec; i++) {
+      last = static_cast<unsigned char>(last + *p++);
+      out[i * rec_sz + c] = last;
+    }
+  }
+
+  return p == end ? 0 : -1;
+}
+
+}  // namespace
+
+int shuffle_codec_method(const char* name) {
+  if (strcmp(name, "none") == 0) return SHUFFLE_CODEC_NONE;
+  if (strcmp(name, "lz") == 0) return SHUFFLE_CODEC_LZ;
+  if (strcmp(name, "xlz") == 0) return SHUFFLE_CODEC_XLZ;
+  return -1;
+}
+
+const char* shuffle_codec_name(int method) {
+  switch (method) {
+    case SHUFFLE_CODEC_NONE:
+      return "none";
+    case SHUFFLE_CODEC_LZ:
+      return "lz";
+    case SHUFFLE_CODEC_XLZ:
+      return "xlz";
+    default:
+      return "unknown";
+  }
+}
+
+size_t shuffle_codec_encode(int method, const char* in, size_t n,
+                            size_t rec_sz, size_t key_off, size_t key_len,
+                            char* out, char* scratch) {
+  const unsigned char* const src = reinterpret_cast<const unsigned char*>(in);
+  unsigned char* const dst = reinterpret_cast<unsigned char*>(out);
+  unsigned char* const tmp = reinterpret_cast<unsigned char*>(scratch);
+  unsigned char hdr[32];
+  size_t raw_sz;
+  size_t hdr_sz;
+  size_t sz;
+
+  /* raw frame size: anything we send must be smaller than this */
+  raw_sz = 1 + put_varint(hdr, n) + n;
+
+  if (method == SHUFFLE_CODEC_XLZ && rec_sz != 0 && n % rec_sz == 0 &&
+      n / rec_sz >= 2 && key_len <= 255 && key_off + key_len <= rec_sz) {
+    sz = xform_encode(src, n, rec_sz, key_off, key_len, tmp);
+    hdr[0] = SHUFFLE_CODEC_XLZ;
+    hdr_sz = 1 + put_varint(hdr + 1, n);
+    hdr_sz += put_varint(hdr + hdr_sz, rec_sz);
+    hdr_sz += put_varint(hdr + hdr_sz, key_off);
+    hdr_sz += put_varint(hdr + hdr_sz, key_len);
+    hdr_sz += put_varint(hdr + hdr_sz, sz);
+    if (hdr_sz < raw_sz) {
+      sz = lz_compress(tmp, sz, dst + hdr_sz, raw_sz - hdr_sz - 1);
+      if (sz != 0) {
+        memcpy(dst, hdr, hdr_sz);
+        return hdr_sz + sz;
+      }
+    }
+  } else if (method != SHUFFLE_CODEC_NONE && n != 0) {
+    hdr[0] = SHUFFLE_CODEC_LZ;
+    hdr_sz = 1 + put_varint(hdr + 1, n);
+    sz = lz_compress(src, n, dst + hdr_sz, raw_sz - hdr_sz - 1);
+    if (sz != 0) {
+      memcpy(dst, hdr, hdr_sz);
+      return hdr_sz + sz;
+    }
+  }
+
+  dst[0] = FRAME_RAW;
+  hdr_sz = 1 + put_varint(dst + 1, n);
+  memcpy(dst + hdr_sz, src, n);
+  return hdr_sz + n;
+}
+
+long shuffle_codec_decode(const char* in, size_t n, char* out, size_t cap,
+                          char* scratch) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+  const unsigned char* const end = p + n;
+  unsigned char* const dst = reinterpret_cast<unsigned char*>(out);
+  unsigned char* const tmp = reinterpret_cast<unsigned char*>(scratch);
+  size_t rec_sz;
+  size_t key_off;
+  size_t key_len;
+  size_t raw_sz;
+  size_t tsz;
+  int method;
+
+  if (p >= end) return -1;
+  method = *p++;
+  if (get_varint(&p, end, &raw_sz) != 0 || raw_sz > cap) return -1;
+
+  switch (method) {
+    case FRAME_RAW:
+      if (size_t(end - p) != raw_sz) return -1;
+      memcpy(dst, p, raw_sz);
+      return long(raw_sz);
+    case SHUFFLE_CODEC_LZ:
+      if (lz_decompress(p, end - p, dst, raw_sz) != long(raw_sz)) return -1;
+      return long(raw_sz);
+    case SHUFFLE_CODEC_XLZ:
+      if (get_varint(&p, end, &rec_sz) != 0 ||
+          get_varint(&p, end, &key_off) != 0 ||
+          get_varint(&p, end, &key_len) != 0 ||
+          get_varint(&p, end, &tsz) != 0)
+        return -1;
+      if (rec_sz == 0 || raw_sz % rec_sz != 0 || key_len > 255 ||
+          key_off + key_len > rec_sz || tsz > SHUFFLE_CODEC_SCRATCH(cap))
+        return -1;
+      if (lz_decompress(p, end - p, tmp, tsz) != long(tsz)) return -1;
+      if (xform_decode(tmp, tsz, rec_sz, key_off, key_len, dst, raw_sz) != 0)
+        return -1;
+      return long(raw_sz);
+    default:
+      return -1;
+  }
+}
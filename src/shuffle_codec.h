@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * shuffle_codec.h  compress batches of shuffle write requests
+ *
+ * rpc messages carry batches of write requests that are usually all the
+ * same size: a particle name followed by its data.  the codec turns such a
+ * batch into a frame that is sent instead of the batch.  names are prefix
+ * coded against the name before them, the remaining bytes are transposed
+ * into columns and delta coded so that mostly constant bytes (lengths,
+ * terminators, float exponents) become runs of zeros, and the result is
+ * compressed by a small lz77 coder.  frames describe themselves, so any
+ * frame can be decoded without knowing how it was encoded.  batches that
+ * do not shrink are sent as raw frames.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* codec methods */
+#define SHUFFLE_CODEC_NONE 0 /* no frames at all */
+#define SHUFFLE_CODEC_LZ 1   /* lz only */
+#define SHUFFLE_CODEC_XLZ 2  /* name prefix and column delta coding, then lz */
+
+/* a frame is never larger than its input plus this many bytes */
+#define SHUFFLE_CODEC_OVERHEAD 16
+
+/* scratch space needed to encode or decode a batch of n bytes */
+#define SHUFFLE_CODEC_SCRATCH(n) (2 * (n))
+
+/*
+ * shuffle_codec_method: parse a method name ("none", "lz", or "xlz").
+ * return -1 if the name is unknown.
+ */
+int shuffle_codec_method(const char* name);
+
+/* shuffle_codec_name: return the name of a method */
+const char* shuffle_codec_name(int method);
+
+/*
+ * shuffle_codec_encode: encode a batch of n bytes into a frame at out.
+ * rec_sz is the expected record size of the batch, with each record
+ * holding a key_len-byte name at key_off.  the column coding is skipped
+ * if n is not a multiple of rec_sz.  out must have room for n plus
+ * SHUFFLE_CODEC_OVERHEAD bytes and scratch for SHUFFLE_CODEC_SCRATCH(n).
+ * return the size of the frame.
+ */
+size_t shuffle_codec_encode(int method, const char* in, size_t n,
+                            size_t rec_sz, size_t key_off, size_t key_len,
+                            char* out, char* scratch);
+
+/*
+ * shuffle_codec_decode: decode a frame of n bytes into out, which has room
+ * for cap bytes.  scratch must hold SHUFFLE_CODEC_SCRATCH(cap) bytes.
+ * return the size of the decoded batch, or -1 if the frame is corrupted or
+ * does not fit.
+ */
+long shuffle_codec_decode(const char* in, size_t n, char* out, size_t cap,
+                          char* scratch);
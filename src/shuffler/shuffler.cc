@@ -109,6 +109,41 @@ static struct shufcfglog {
   int xtra_stderrlog;      /* always log to stderr for xtra log ranks */
 } shufcfg = { 0 };
 
+/*
+ * codec for network RPCs (disabled if enc is NULL)
+ */
+static struct shufcfgcodec {
+  shuffler_encode_t enc;   /* batch encoder */
+  shuffler_decode_t dec;   /* batch decoder */
+  size_t overhead;         /* max bytes enc adds */
+} shufcodec = { 0 };
+
+/*
+ * shuffler_cfgcodec: setup a codec for network RPCs before starting
+ * the shuffler.
+ */
+void shuffler_cfgcodec(shuffler_encode_t enc, shuffler_decode_t dec,
+                       size_t overhead) {
+  shufcodec.enc = enc;
+  shufcodec.dec = dec;
+  shufcodec.overhead = overhead;
+}
+
+/*
+ * checksum for batch RPCs (disabled if fn is NULL)
+ */
+static struct shufcfgchecksum {
+  shuffler_checksum_t fn;  /* crc function */
+} shufck = { 0 };
+
+/*
+ * shuffler_cfgchecksum: setup a checksum for batch RPCs before starting
+ * the shuffler.
+ */
+void shuffler_cfgchecksum(shuffler_checksum_t fn) {
+  shufck.fn = fn;
+}
+
 /*
  * shuffler_cfglog: setup logging before starting shuffler.  call
  * this before shuffler_init() so that everything can be properly
@@ -494,7 +529,33 @@ static uint32_t zero = 0;   /* for end of list marker */
 }
 
 /*
- * hg_proc_rpcin_t: encode/decode the rpcin_t structure
+ * rpcin_crc: extend crc over a request's 16 byte header and its data.
+ * headers are checksummed as in the flat layout of hg_proc_rpcin_z_t.
+ */
+static uint32_t rpcin_crc(uint32_t crc, const struct request *rp) {
+  uint32_t hdr[4];
+  hdr[0] = rp->datalen;
+  hdr[1] = rp->type;
+  hdr[2] = (uint32_t) rp->src;
+  hdr[3] = (uint32_t) rp->dst;
+  crc = shufck.fn(crc, (const char *)hdr, sizeof(hdr));
+  return shufck.fn(crc, (const char *)rp->data, rp->datalen);
+}
+
+/*
+ * rpcin_crc0: start a crc with the rpcin_t iseq and forwardrank
+ */
+static uint32_t rpcin_crc0(const rpcin_t *in) {
+  int32_t hdr[2];
+  hdr[0] = in->iseq;
+  hdr[1] = in->forwardrank;
+  return shufck.fn(0, (const char *)hdr, sizeof(hdr));
+}
+
+/*
+ * hg_proc_rpcin_t: encode/decode the rpcin_t structure.  if a checksum
+ * is set by shuffler_cfgchecksum(), a crc covering iseq, forwardrank,
+ * and all requests follows the end of list marker.
  *
  * @param proc the proc used to serialize/deserialize the data
  * @param data pointer to the data being worked on
@@ -506,7 +567,7 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
   rpcin_t *struct_data = (rpcin_t *) data;
   struct request *rp, *nrp;
   int cnt, lcv;
-  uint32_t dlen, typ;
+  uint32_t dlen, typ, crc = 0, wcrc;
   mlog(UTIL_CALL, "hg_proc_rpcin_t proc=%p op=%d", proc, op);
 
   if (op == HG_FREE)               /* we combine free and err handling below */
@@ -520,6 +581,8 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
   procheck(ret, "Proc err iseq");
   ret = hg_proc_hg_int32_t(proc, &struct_data->forwardrank);
   procheck(ret, "Proc err forwardrank");
+  if (shufck.fn)
+    crc = rpcin_crc0(struct_data);
 
   if (op == HG_ENCODE) {   /* serialize list to the proc */
     cnt = 0;
@@ -534,6 +597,8 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
       procheck(ret, "Proc en err dst");
       ret = hg_proc_memcpy(proc, rp->data, rp->datalen);
       procheck(ret, "Proc en err data");
+      if (shufck.fn)
+        crc = rpcin_crc(crc, rp);
       cnt++;
     }
     /* put in the end of list marker (2 uint32_t zeros) */
@@ -541,6 +606,10 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
       ret = hg_proc_hg_uint32_t(proc, &zero);
       procheck(ret, "Proc err zero");
     }
+    if (shufck.fn) {
+      ret = hg_proc_hg_uint32_t(proc, &crc);
+      procheck(ret, "Proc en err crc");
+    }
     mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, encoded=%d", proc, cnt);
     goto done;
   }
@@ -570,8 +639,16 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
 
     /* got it!  put at the end of the decoded list */
     XSIMPLEQ_INSERT_TAIL(&struct_data->inreqs, rp, next);
+    if (shufck.fn)
+      crc = rpcin_crc(crc, rp);
     cnt++;
   }
+  if (shufck.fn) {
+    ret = hg_proc_hg_uint32_t(proc, &wcrc);
+    procheck(ret, "Proc de err crc");
+    if (wcrc != crc) ret = HG_OTHER_ERROR;
+    procheck(ret, "Proc de checksum mismatch");
+  }
   mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, decoded=%d", proc, cnt);
 
 done:
@@ -585,6 +662,208 @@ done:
   return(ret);
 }
 
+/*
+ * per-thread buffers for hg_proc_rpcin_z_t, reused across rpcs so that
+ * encoding or decoding a batch does not malloc its flat and wire copies
+ * each time.  they only grow, and are freed when their thread exits.
+ */
+struct zbufs {
+  char *flat;              /* flattened requests */
+  size_t flatcap;
+  char *z;                 /* encoded bytes */
+  size_t zcap;
+};
+static pthread_key_t zbufs_key;
+static pthread_once_t zbufs_once = PTHREAD_ONCE_INIT;
+static int zbufs_keyok = 0;
+
+static void zbufs_free(void *arg) {
+  struct zbufs *zb = (struct zbufs *) arg;
+  free(zb->flat);
+  free(zb->z);
+  free(zb);
+}
+
+static void zbufs_mkkey(void) {
+  zbufs_keyok = (pthread_key_create(&zbufs_key, zbufs_free) == 0);
+}
+
+/*
+ * zbufs_get: return the calling thread's buffers, with flat and z
+ * holding at least flatsz and zsz bytes.
+ *
+ * @return the buffers or NULL if we are out of memory
+ */
+static struct zbufs *zbufs_get(size_t flatsz, size_t zsz) {
+  struct zbufs *zb;
+  char *p;
+
+  pthread_once(&zbufs_once, zbufs_mkkey);
+  if (!zbufs_keyok)
+    return(NULL);
+  zb = (struct zbufs *) pthread_getspecific(zbufs_key);
+  if (zb == NULL) {
+    zb = (struct zbufs *) calloc(1, sizeof(*zb));
+    if (zb == NULL)
+      return(NULL);
+    if (pthread_setspecific(zbufs_key, zb) != 0) {
+      free(zb);
+      return(NULL);
+    }
+  }
+  if (flatsz > zb->flatcap) {
+    p = (char *) realloc(zb->flat, flatsz);
+    if (p == NULL)
+      return(NULL);
+    zb->flat = p;
+    zb->flatcap = flatsz;
+  }
+  if (zsz > zb->zcap) {
+    p = (char *) realloc(zb->z, zsz);
+    if (p == NULL)
+      return(NULL);
+    zb->z = p;
+    zb->zcap = zsz;
+  }
+  return(zb);
+}
+
+/*
+ * hg_proc_rpcin_z_t: encode/decode the rpcin_t structure through the
+ * codec set by shuffler_cfgcodec().  requests are first laid out in a
+ * flat buffer (16 byte header + data each) which is then encoded as a
+ * whole.  on the wire: iseq, forwardrank, flat size, encoded size, and
+ * the encoded bytes, followed by a crc of the flat buffer if a checksum
+ * is set by shuffler_cfgchecksum().
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param data pointer to the data being worked on
+ * @return HG_SUCCESS or an error code
+ */
+static hg_return_t hg_proc_rpcin_z_t(hg_proc_t proc, void *data) {
+  hg_return_t ret = HG_SUCCESS;
+  hg_proc_op_t op = hg_proc_get_op(proc);
+  rpcin_t *struct_data = (rpcin_t *) data;
+  struct request *rp, *nrp;
+  struct zbufs *zb;
+  char *flat, *z, *p;
+  uint32_t rawlen, zlen, left, hdr[4], crc = 0, wcrc;
+  int cnt = 0;
+  mlog(UTIL_CALL, "hg_proc_rpcin_z_t proc=%p op=%d", proc, op);
+
+  if (op == HG_FREE)               /* we combine free and err handling below */
+    goto done;
+
+  if (op == HG_DECODE) {           /* start with an empty inreqs list */
+    XSIMPLEQ_INIT(&struct_data->inreqs);
+  }
+
+  ret = hg_proc_hg_int32_t(proc, &struct_data->iseq);
+  procheck(ret, "Proc err iseq");
+  ret = hg_proc_hg_int32_t(proc, &struct_data->forwardrank);
+  procheck(ret, "Proc err forwardrank");
+  if (shufck.fn)
+    crc = rpcin_crc0(struct_data);
+
+  if (op == HG_ENCODE) {   /* flatten, encode, and serialize */
+    rawlen = 0;
+    XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
+      rawlen += sizeof(hdr) + rp->datalen;
+    }
+    zb = zbufs_get(rawlen + 1, rawlen + shufcodec.overhead);
+    if (zb == NULL) ret = HG_NOMEM_ERROR;
+    procheck(ret, "Proc en malloc");
+    flat = zb->flat;
+    z = zb->z;
+    p = flat;
+    XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
+      hdr[0] = rp->datalen;
+      hdr[1] = rp->type;
+      hdr[2] = (uint32_t) rp->src;
+      hdr[3] = (uint32_t) rp->dst;
+      memcpy(p, hdr, sizeof(hdr));
+      memcpy(p + sizeof(hdr), rp->data, rp->datalen);
+      p += sizeof(hdr) + rp->datalen;
+      cnt++;
+    }
+    zlen = shufcodec.enc(flat, rawlen, z);
+    ret = hg_proc_hg_uint32_t(proc, &rawlen);
+    procheck(ret, "Proc en err rawlen");
+    ret = hg_proc_hg_uint32_t(proc, &zlen);
+    procheck(ret, "Proc en err zlen");
+    ret = hg_proc_memcpy(proc, z, zlen);
+    procheck(ret, "Proc en err data");
+    if (shufck.fn) {
+      crc = shufck.fn(crc, flat, rawlen);
+      ret = hg_proc_hg_uint32_t(proc, &crc);
+      procheck(ret, "Proc en err crc");
+    }
+    mlog(UTIL_D1, "hg_proc_rpcin_z_t proc %p, encoded=%d (%u/%u)", proc,
+         cnt, zlen, rawlen);
+    goto done;
+  }
+
+  /* op == HG_DECODE */
+  ret = hg_proc_hg_uint32_t(proc, &rawlen);
+  procheck(ret, "Proc de err rawlen");
+  ret = hg_proc_hg_uint32_t(proc, &zlen);
+  procheck(ret, "Proc de err zlen");
+  zb = zbufs_get(rawlen + 1, zlen + 1);
+  if (zb == NULL) ret = HG_NOMEM_ERROR;
+  procheck(ret, "Proc de malloc");
+  flat = zb->flat;
+  z = zb->z;
+  ret = hg_proc_memcpy(proc, z, zlen);
+  procheck(ret, "Proc de err data");
+  if (shufcodec.dec(z, zlen, flat, rawlen) != (long) rawlen)
+    ret = HG_OTHER_ERROR;
+  procheck(ret, "Proc de err codec");
+  if (shufck.fn) {
+    ret = hg_proc_hg_uint32_t(proc, &wcrc);
+    procheck(ret, "Proc de err crc");
+    if (wcrc != shufck.fn(crc, flat, rawlen)) ret = HG_OTHER_ERROR;
+    procheck(ret, "Proc de checksum mismatch");
+  }
+
+  p = flat;
+  left = rawlen;
+  while (left != 0) {
+    if (left < sizeof(hdr)) ret = HG_OTHER_ERROR;
+    procheck(ret, "Proc de short header");
+    memcpy(hdr, p, sizeof(hdr));
+    p += sizeof(hdr);
+    left -= sizeof(hdr);
+    if (hdr[0] > left) ret = HG_OTHER_ERROR;
+    procheck(ret, "Proc de short data");
+    rp = (request*)malloc(sizeof(*rp) + hdr[0]);
+    if (rp == NULL) ret = HG_NOMEM_ERROR;
+    procheck(ret, "Proc de malloc");
+    rp->datalen = hdr[0];
+    rp->type = hdr[1];
+    rp->src = (int32_t) hdr[2];
+    rp->dst = (int32_t) hdr[3];
+    rp->data = ((char *)rp) + sizeof(*rp);
+    memcpy(rp->data, p, rp->datalen);
+    rp->owner = NULL;
+    p += rp->datalen;
+    left -= rp->datalen;
+
+    XSIMPLEQ_INSERT_TAIL(&struct_data->inreqs, rp, next);
+    cnt++;
+  }
+  mlog(UTIL_D1, "hg_proc_rpcin_z_t proc %p, decoded=%d", proc, cnt);
+
+done:
+  if ( ((op == HG_DECODE && ret != HG_SUCCESS) || op == HG_FREE) &&
+       XSIMPLEQ_FIRST(&struct_data->inreqs) != NULL) {
+    XSIMPLEQ_FOREACH_SAFE(rp, &struct_data->inreqs, next, nrp) {
+      free(rp);
+    }
+    XSIMPLEQ_INIT(&struct_data->inreqs);
+  }
+  return(ret);
+}
+
 /*
  * hg_proc_rpcout_t: encode/decode the rpcout_t structure
  *
@@ -788,8 +1067,11 @@ int shuffler_init_hgthread(struct shuffler *sh, struct hgthread *hgt,
    * there is no API to unregister an RPC other than shutting down
    * mercury, so hopefully HG_Register_data() can't fail...
    */
+  /* only network rpcs go through the codec */
   hgt->rpcid = HG_Register_name(cls, myfunname,
-                 hg_proc_rpcin_t, hg_proc_rpcout_t,  rpchand);
+                 (shufcodec.enc && hgt == &sh->hgt_remote) ?
+                 hg_proc_rpcin_z_t : hg_proc_rpcin_t,
+                 hg_proc_rpcout_t,  rpchand);
   if (HG_Register_data(cls, hgt->rpcid, hgt, NULL) != HG_SUCCESS)
     return(-1);
 
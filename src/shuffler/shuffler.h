@@ -282,6 +282,53 @@ int shuffler_cfglog(int max_xtra_rank, const char *defpri,
                     int alllogs, int msgbufsz, int stderrlog,
                     int xtra_stderrlog);
 
+/*
+ * shuffler_encode_t: pointer to a callback function used to compress
+ * the requests of a batch RPC sent over the network.  "in" holds "n"
+ * bytes of requests, each being a 16 byte header (datalen, type, src,
+ * and dst as 32 bit ints) followed by the data.  the function may write
+ * up to n plus the overhead given to shuffler_cfgcodec() bytes to "out"
+ * and returns the number of bytes written.
+ */
+typedef size_t (*shuffler_encode_t)(const char *in, size_t n, char *out);
+
+/*
+ * shuffler_decode_t: pointer to a callback function that reverses the
+ * above.  writes up to "cap" bytes to "out" and returns the number of
+ * bytes written, or -1 on errors.
+ */
+typedef long (*shuffler_decode_t)(const char *in, size_t n, char *out,
+                                  size_t cap);
+
+/*
+ * shuffler_cfgcodec: compress batch RPCs sent over the network with
+ * a pair of application callbacks.  local na+sm RPCs are not affected.
+ * call this before shuffler_init(), on either all ranks or none.
+ *
+ * @param enc encoder callback
+ * @param dec decoder callback
+ * @param overhead max number of bytes enc adds to its input
+ */
+void shuffler_cfgcodec(shuffler_encode_t enc, shuffler_decode_t dec,
+                       size_t overhead);
+
+/*
+ * shuffler_checksum_t: pointer to a callback function that extends a
+ * 32 bit crc over "n" bytes of "data" and returns the new crc (e.g.
+ * crc32c).  crc is 0 for the first call.
+ */
+typedef uint32_t (*shuffler_checksum_t)(uint32_t crc, const char *data,
+                                        size_t n);
+
+/*
+ * shuffler_cfgchecksum: append a checksum to every batch RPC (both
+ * network and local na+sm) and verify it on the receiving side.  call
+ * this before shuffler_init(), on either all ranks or none.
+ *
+ * @param fn checksum callback
+ */
+void shuffler_cfgchecksum(shuffler_checksum_t fn);
+
 /*
  * shuffler_send_stats: retrieve shuffle sender statistics
  * @param sh shuffler service handle
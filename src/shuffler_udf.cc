@@ -48,12 +48,34 @@ void shuffler_udf ::init(preload_ctx_t *pctx_arg) {
   return;
 }
 
-int shuffler_udf ::process(const char* fname, unsigned char fname_len, char* data, unsigned char data_len, int epoch) {
+int shuffler_udf ::process(const char* fname, size_t fname_len, char* data, size_t data_len, int epoch) {
   assert(pctx);
   int rv = shuffle_write(&pctx->sctx, fname, fname_len, data, data_len, epoch);
   return rv;
 }
 
+int shuffler_udf ::target(const char* fname, size_t fname_len) {
+  assert(pctx);
+  if (fname_len != pctx->sctx.fname_len) return -1;
+  return shuffle_target(&pctx->sctx, const_cast<char*>(fname), fname_len);
+}
+
+int shuffler_udf ::process_req(char* req, size_t req_sz, int target, int epoch) {
+  assert(pctx);
+  int rv = shuffle_write_req(&pctx->sctx, req, req_sz, target, epoch);
+  return rv;
+}
+
+char* shuffler_udf ::reserve_req(size_t req_sz, int target, int epoch) {
+  assert(pctx);
+  return shuffle_reserve_req(&pctx->sctx, req_sz, target, epoch);
+}
+
+void shuffler_udf ::commit_req(char* req, size_t req_sz, int target, int epoch) {
+  assert(pctx);
+  shuffle_commit_req(&pctx->sctx, req, req_sz, target, epoch);
+}
+
 int shuffler_udf ::pause() {
   assert(pctx);
   shuffle_pause(&pctx->sctx);
@@ -151,6 +173,12 @@ int shuffler_udf ::epoch_start(int num_eps) {
       logf(LOG_INFO, "receiver flushing done %s",
           pretty_dura(flush_end - flush_start).c_str());
     }
+    if (pctx->sctx.rp != NULL) {
+      shuffle_epoch_repartition(&pctx->sctx, num_eps);
+    }
+    if (pctx->sctx.reweight) {
+      shuffle_epoch_reweight(&pctx->sctx, num_eps);
+    }
   }
   return 0;
 }
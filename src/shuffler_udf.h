@@ -15,7 +15,11 @@ class shuffler_udf : udf_interface {
     shuffler_udf();
     ~shuffler_udf();
     void init(preload_ctx_t *pctx_arg);
-    int process(const char* fname, unsigned char fname_len, char* data, unsigned char data_len, int epoch);
+    int process(const char* fname, size_t fname_len, char* data, size_t data_len, int epoch);
+    int target(const char* fname, size_t fname_len);
+    int process_req(char* req, size_t req_sz, int target, int epoch);
+    char* reserve_req(size_t req_sz, int target, int epoch);
+    void commit_req(char* req, size_t req_sz, int target, int epoch);
     int epoch_start(int num_eps);
     int epoch_end();
     int epoch_pre_start();
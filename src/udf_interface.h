@@ -9,7 +9,11 @@
 class udf_interface {
   public:
     virtual void init(preload_ctx_t *pctx_arg) = 0;
-    virtual int process(const char* fname, unsigned char fname_len, char* data, unsigned char data_len, int epoch) = 0;
+    virtual int process(const char* fname, size_t fname_len, char* data, size_t data_len, int epoch) = 0;
+    virtual int target(const char* fname, size_t fname_len) = 0;
+    virtual int process_req(char* req, size_t req_sz, int target, int epoch) = 0;
+    virtual char* reserve_req(size_t req_sz, int target, int epoch) = 0;
+    virtual void commit_req(char* req, size_t req_sz, int target, int epoch) = 0;
     virtual int epoch_start(int num_eps) = 0;
     virtual int epoch_end() = 0;
     virtual int epoch_pre_start() = 0;
@@ -30,10 +30,13 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "common.h"
+#include "crc32c.h"
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
+#include "shuffle_codec.h"
 #include "xn_shuffler.h"
 
 /* xn_local_barrier: perform a barrier across all node-local ranks. */
@@ -110,7 +113,87 @@ static void xn_shuffler_deliver(int src, int dst, uint32_t type, void* buf,
   }
 }
 
-void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
+namespace {
+/*
+ * per-thread codec scratch space.  the codec callbacks run once per rpc
+ * inside the shuffler's proc, so the space is kept across rpcs instead
+ * of being allocated each time.  it only grows, and is freed when its
+ * thread exits.
+ */
+struct xn_scratch {
+  char* buf;
+  size_t cap;
+};
+
+pthread_key_t xn_scratch_key;
+pthread_once_t xn_scratch_once = PTHREAD_ONCE_INIT;
+
+void xn_scratch_free(void* arg) {
+  xn_scratch* s = static_cast<xn_scratch*>(arg);
+  free(s->buf);
+  free(s);
+}
+
+void xn_scratch_mkkey() {
+  if (pthread_key_create(&xn_scratch_key, xn_scratch_free) != 0) {
+    ABORT("pthread_key_create");
+  }
+}
+
+char* xn_scratch_get(size_t sz) {
+  pthread_once(&xn_scratch_once, xn_scratch_mkkey);
+  xn_scratch* s = static_cast<xn_scratch*>(pthread_getspecific(xn_scratch_key));
+  if (s == NULL) {
+    s = static_cast<xn_scratch*>(calloc(1, sizeof(*s)));
+    if (s == NULL) ABORT("malloc");
+    pthread_setspecific(xn_scratch_key, s);
+  }
+  if (sz > s->cap) {
+    free(s->buf);
+    s->buf = static_cast<char*>(malloc(sz));
+    if (s->buf == NULL) ABORT("malloc");
+    s->cap = sz;
+  }
+  return s->buf;
+}
+}  // namespace
+
+/* xn_shuffler_encode: codec callback for network rpcs. each request is a
+ * 16-byte shuffler header followed by a write req starting with its name. */
+static size_t xn_shuffler_encode(const char* in, size_t n, char* out) {
+  const uint64_t start = now_micros();
+  uint32_t datalen;
+  char* scratch;
+  size_t sz;
+
+  datalen = 0;
+  if (n >= 16) {
+    memcpy(&datalen, in, sizeof(datalen));
+  }
+  scratch = xn_scratch_get(SHUFFLE_CODEC_SCRATCH(n));
+  sz = shuffle_codec_encode(pctx.sctx.codec, in, n, 16 + datalen, 16,
+                            pctx.sctx.fname_len, out, scratch);
+
+  __sync_fetch_and_add(&pctx.mctx.codec_raw_bytes, n);
+  __sync_fetch_and_add(&pctx.mctx.codec_wire_bytes, sz);
+  __sync_fetch_and_add(&pctx.mctx.codec_enc_micros, now_micros() - start);
+  return sz;
+}
+
+static long xn_shuffler_decode(const char* in, size_t n, char* out,
+                               size_t cap) {
+  const uint64_t start = now_micros();
+  char* scratch;
+  long rv;
+
+  scratch = xn_scratch_get(SHUFFLE_CODEC_SCRATCH(cap));
+  rv = shuffle_codec_decode(in, n, out, cap, scratch);
+
+  __sync_fetch_and_add(&pctx.mctx.codec_dec_micros, now_micros() - start);
+  return rv;
+}
+
+void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, size_t buf_sz,
                          int epoch, int dst, int src) {
   hg_return_t hret;
   assert(ctx->sh != NULL);
@@ -257,6 +340,15 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
     shuffler_cfglog(DEF_CFGLOG_ARGS(logfile));
   }
 
+  if (pctx.sctx.codec != SHUFFLE_CODEC_NONE) {
+    shuffler_cfgcodec(xn_shuffler_encode, xn_shuffler_decode,
+                      SHUFFLE_CODEC_OVERHEAD);
+  }
+
+  if (!is_envset("SHUFFLE_Skip_checksums")) {
+    shuffler_cfgchecksum(crc32c_extend);
+  }
+
   ctx->sh = shuffler_init(ctx->nx, const_cast<char*>("shuffle_rpc_write"),
                           lsenderlimit, rsenderlimit, lomaxrpc, lobuftarget,
                           lrmaxrpc, lrbuftarget, rmaxrpc, rbuftarget,
@@ -65,6 +65,8 @@
  *    The max port number we can use
  *  SHUFFLE_Subnet
  *    IP prefix of the subnet
+ *  SHUFFLE_Skip_checksums
+ *    Do not append or verify a crc32c checksum for each batch rpc
  */
 
 #pragma once
@@ -106,7 +108,7 @@ extern int xn_shuffler_world_size(xn_ctx_t* ctx);
 /* xn_shuffler_my_rank: return my rank id */
 extern int xn_shuffler_my_rank(xn_ctx_t* ctx);
 
-void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
+void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, size_t buf_sz,
                          int epoch, int dst, int src);
 
 /* xn_shuffler_epoch_end: do necessary flush at the end of an epoch */
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "xxhash_batch.h"
+
+#include <string.h>
+
+#include <pdlfs-common/xxhash.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define XXHASH_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * the simd kernels follow the xxhash spec for inputs shorter than one
+ * stripe (16 bytes for xxh32, 32 bytes for xxh64), which covers all
+ * practical particle id sizes.  longer keys use the scalar code.
+ */
+#define XXH32_SIMD_MAX_LEN 15
+#define XXH64_SIMD_MAX_LEN 31
+
+namespace {
+
+const uint32_t P32_1 = 2654435761U;
+const uint32_t P32_2 = 2246822519U;
+const uint32_t P32_3 = 3266489917U;
+const uint32_t P32_4 = 668265263U;
+const uint32_t P32_5 = 374761393U;
+
+const uint64_t P64_1 = 11400714785074694791ULL;
+const uint64_t P64_2 = 14029467366897019727ULL;
+const uint64_t P64_3 = 1609587929392839161ULL;
+const uint64_t P64_4 = 9650029242287828579ULL;
+const uint64_t P64_5 = 2870177450012600261ULL;
+
+void xxh32_scalar(const char* keys, size_t stride, size_t key_len, size_t n,
+                  uint32_t seed, uint32_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = pdlfs::xxhash32(keys + i * stride, key_len, seed);
+  }
+}
+
+void xxh64_scalar(const char* keys, size_t stride, size_t key_len, size_t n,
+                  uint64_t seed, uint64_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = pdlfs::xxhash64(keys + i * stride, key_len, seed);
+  }
+}
+
+#if defined(XXHASH_BATCH_X86)
+
+inline uint32_t ld32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t ld64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+ * sse4.2: 4 xxh32 lanes
+ */
+#define ROTL32X4(x, r) \
+  _mm_or_si128(_mm_slli_epi32(x, r), _mm_srli_epi32(x, 32 - (r)))
+
+__attribute__((target("sse4.2"))) void xxh32_sse42(
+    const char* keys, size_t stride, size_t key_len, size_t n, uint32_t seed,
+    uint32_t* out) {
+  const __m128i p1 = _mm_set1_epi32(int(P32_1));
+  const __m128i p2 = _mm_set1_epi32(int(P32_2));
+  const __m128i p3 = _mm_set1_epi32(int(P32_3));
+  const __m128i p4 = _mm_set1_epi32(int(P32_4));
+  const __m128i p5 = _mm_set1_epi32(int(P32_5));
+  const __m128i h0 = _mm_set1_epi32(int(seed + P32_5 + uint32_t(key_len)));
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    const char* const k = keys + i * stride;
+    __m128i h = h0;
+    size_t p = 0;
+    for (; p + 4 <= key_len; p += 4) {
+      __m128i v = _mm_set_epi32(
+          int(ld32(k + 3 * stride + p)), int(ld32(k + 2 * stride + p)),
+          int(ld32(k + stride + p)), int(ld32(k + p)));
+      h = _mm_add_epi32(h, _mm_mullo_epi32(v, p3));
+      h = _mm_mullo_epi32(ROTL32X4(h, 17), p4);
+    }
+    for (; p < key_len; p++) {
+      __m128i v = _mm_set_epi32(
+          int(uint8_t(k[3 * stride + p])), int(uint8_t(k[2 * stride + p])),
+          int(uint8_t(k[stride + p])), int(uint8_t(k[p])));
+      h = _mm_add_epi32(h, _mm_mullo_epi32(v, p5));
+      h = _mm_mullo_epi32(ROTL32X4(h, 11), p1);
+    }
+    h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+    h = _mm_mullo_epi32(h, p2);
+    h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+    h = _mm_mullo_epi32(h, p3);
+    h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), h);
+  }
+
+  xxh32_scalar(keys + i * stride, stride, key_len, n - i, seed, out + i);
+}
+
+#undef ROTL32X4
+
+/*
+ * avx2: 8 xxh32 lanes, or 4 xxh64 lanes.  avx2 has no 64x64-bit multiply
+ * so we build one out of three 32x32->64-bit multiplies.
+ */
+#define ROTL32X8(x, r) \
+  _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - (r)))
+#define ROTL64X4(x, r) \
+  _mm256_or_si256(_mm256_slli_epi64(x, r), _mm256_srli_epi64(x, 64 - (r)))
+
+__attribute__((target("avx2"))) void xxh32_avx2(const char* keys,
+                                                size_t stride, size_t key_len,
+                                                size_t n, uint32_t seed,
+                                                uint32_t* out) {
+  const __m256i p1 = _mm256_set1_epi32(int(P32_1));
+  const __m256i p2 = _mm256_set1_epi32(int(P32_2));
+  const __m256i p3 = _mm256_set1_epi32(int(P32_3));
+  const __m256i p4 = _mm256_set1_epi32(int(P32_4));
+  const __m256i p5 = _mm256_set1_epi32(int(P32_5));
+  const __m256i h0 = _mm256_set1_epi32(int(seed + P32_5 + uint32_t(key_len)));
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    const char* const k = keys + i * stride;
+    __m256i h = h0;
+    size_t p = 0;
+    for (; p + 4 <= key_len; p += 4) {
+      __m256i x = _mm256_set_epi32(
+          int(ld32(k + 7 * stride + p)), int(ld32(k + 6 * stride + p)),
+          int(ld32(k + 5 * stride + p)), int(ld32(k + 4 * stride + p)),
+          int(ld32(k + 3 * stride + p)), int(ld32(k + 2 * stride + p)),
+          int(ld32(k + stride + p)), int(ld32(k + p)));
+      h = _mm256_add_epi32(h, _mm256_mullo_epi32(x, p3));
+      h = _mm256_mullo_epi32(ROTL32X8(h, 17), p4);
+    }
+    for (; p < key_len; p++) {
+      __m256i x = _mm256_set_epi32(
+          uint8_t(k[7 * stride + p]), uint8_t(k[6 * stride + p]),
+          uint8_t(k[5 * stride + p]), uint8_t(k[4 * stride + p]),
+          uint8_t(k[3 * stride + p]), uint8_t(k[2 * stride + p]),
+          uint8_t(k[stride + p]), uint8_t(k[p]));
+      h = _mm256_add_epi32(h, _mm256_mullo_epi32(x, p5));
+      h = _mm256_mullo_epi32(ROTL32X8(h, 11), p1);
+    }
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, p2);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, p3);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), h);
+  }
+
+  xxh32_sse42(keys + i * stride, stride, key_len, n - i, seed, out + i);
+}
+
+/* mul64x4: a * b (mod 2^64) lane by lane; bh must be b >> 32 */
+__attribute__((target("avx2"))) inline __m256i mul64x4(__m256i a, __m256i b,
+                                                       __m256i bh) {
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i mid = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                 _mm256_mul_epu32(a, bh));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(mid, 32));
+}
+
+__attribute__((target("avx2"))) void xxh64_avx2(const char* keys,
+                                                size_t stride, size_t key_len,
+                                                size_t n, uint64_t seed,
+                                                uint64_t* out) {
+#define P64(x) _mm256_set1_epi64x(static_cast<long long>(x))
+  const __m256i p1 = P64(P64_1), p1h = P64(P64_1 >> 32);
+  const __m256i p2 = P64(P64_2), p2h = P64(P64_2 >> 32);
+  const __m256i p3 = P64(P64_3), p3h = P64(P64_3 >> 32);
+  const __m256i p5 = P64(P64_5), p5h = P64(P64_5 >> 32);
+  const __m256i p3a = P64(P64_3);
+  const __m256i p4a = P64(P64_4);
+  const __m256i h0 = P64(seed + P64_5 + key_len);
+#undef P64
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    const char* const k = keys + i * stride;
+    __m256i h = h0;
+    __m256i x;
+    size_t p = 0;
+    for (; p + 8 <= key_len; p += 8) {
+      x = _mm256_set_epi64x(
+          static_cast<long long>(ld64(k + 3 * stride + p)),
+          static_cast<long long>(ld64(k + 2 * stride + p)),
+          static_cast<long long>(ld64(k + stride + p)),
+          static_cast<long long>(ld64(k + p)));
+      x = mul64x4(ROTL64X4(mul64x4(x, p2, p2h), 31), p1, p1h);
+      h = _mm256_xor_si256(h, x);
+      h = _mm256_add_epi64(mul64x4(ROTL64X4(h, 27), p1, p1h), p4a);
+    }
+    if (p + 4 <= key_len) {
+      x = _mm256_set_epi64x(ld32(k + 3 * stride + p), ld32(k + 2 * stride + p),
+                            ld32(k + stride + p), ld32(k + p));
+      h = _mm256_xor_si256(h, mul64x4(x, p1, p1h));
+      h = _mm256_add_epi64(mul64x4(ROTL64X4(h, 23), p2, p2h), p3a);
+      p += 4;
+    }
+    for (; p < key_len; p++) {
+      x = _mm256_set_epi64x(uint8_t(k[3 * stride + p]),
+                            uint8_t(k[2 * stride + p]), uint8_t(k[stride + p]),
+                            uint8_t(k[p]));
+      h = _mm256_xor_si256(h, mul64x4(x, p5, p5h));
+      h = mul64x4(ROTL64X4(h, 11), p1, p1h);
+    }
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+    h = mul64x4(h, p2, p2h);
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 29));
+    h = mul64x4(h, p3, p3h);
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 32));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), h);
+  }
+
+  xxh64_scalar(keys + i * stride, stride, key_len, n - i, seed, out + i);
+}
+
+#undef ROTL64X4
+#undef ROTL32X8
+
+#endif /* XXHASH_BATCH_X86 */
+
+typedef void (*xxh32_fn)(const char*, size_t, size_t, size_t, uint32_t,
+                         uint32_t*);
+typedef void (*xxh64_fn)(const char*, size_t, size_t, size_t, uint64_t,
+                         uint64_t*);
+
+/*
+ * kernels picked once at first use.  resolving is idempotent, so racing
+ * threads simply store the same pointers.
+ */
+struct impl {
+  xxh32_fn xxh32;
+  xxh64_fn xxh64;
+  const char* name;
+};
+
+const impl* get_impl() {
+  static const impl scalar = {xxh32_scalar, xxh64_scalar, "scalar"};
+#if defined(XXHASH_BATCH_X86)
+  static const impl sse42 = {xxh32_sse42, xxh64_scalar, "sse4.2"};
+  static const impl avx2 = {xxh32_avx2, xxh64_avx2, "avx2"};
+#endif
+  static const impl* volatile resolved = NULL;
+  const impl* rv = resolved;
+  if (rv == NULL) {
+    rv = &scalar;
+#if defined(XXHASH_BATCH_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      rv = &avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+      rv = &sse42;
+    }
+#endif
+    resolved = rv;
+  }
+  return rv;
+}
+
+}  // namespace
+
+void xxhash32_batch(const char* keys, size_t stride, size_t key_len,
+                    size_t n, uint32_t seed, uint32_t* out) {
+  if (key_len > XXH32_SIMD_MAX_LEN) {
+    xxh32_scalar(keys, stride, key_len, n, seed, out);
+  } else {
+    get_impl()->xxh32(keys, stride, key_len, n, seed, out);
+  }
+}
+
+void xxhash64_batch(const char* keys, size_t stride, size_t key_len,
+                    size_t n, uint64_t seed, uint64_t* out) {
+  if (key_len > XXH64_SIMD_MAX_LEN) {
+    xxh64_scalar(keys, stride, key_len, n, seed, out);
+  } else {
+    get_impl()->xxh64(keys, stride, key_len, n, seed, out);
+  }
+}
+
+const char* xxhash_batch_impl() { return get_impl()->name; }
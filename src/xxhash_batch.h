@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * xxhash_batch.h  hash many fixed-length keys at once
+ *
+ * batch versions of pdlfs::xxhash32() and pdlfs::xxhash64() for keys of
+ * the same length placed every stride bytes (such as particle ids inside
+ * fixed-size write requests).  short keys are hashed several at a time
+ * with SSE4.2 or AVX2 kernels when the cpu has them; everything else goes
+ * through the scalar code.  results are always bit-identical to the scalar
+ * functions.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * xxhash32_batch: out[i] = xxhash32(keys + i * stride, key_len, seed)
+ * for 0 <= i < n.
+ */
+void xxhash32_batch(const char* keys, size_t stride, size_t key_len,
+                    size_t n, uint32_t seed, uint32_t* out);
+
+/*
+ * xxhash64_batch: out[i] = xxhash64(keys + i * stride, key_len, seed)
+ * for 0 <= i < n.
+ */
+void xxhash64_batch(const char* keys, size_t stride, size_t key_len,
+                    size_t n, uint64_t seed, uint64_t* out);
+
+/* xxhash_batch_impl: name of the kernels in use ("avx2", "sse4.2", ...) */
+const char* xxhash_batch_impl();
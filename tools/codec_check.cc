@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * codec_check.cc  round-trip and corrupt-frame checks for the shuffle
+ * codec (see src/shuffle_codec.h), plus its ratio and speed on batches
+ * laid out like those of the nn shuffler.
+ *
+ * every batch is encoded with every method, decoded, and compared
+ * with the input.  each frame is then damaged (a flipped bit, or cut
+ * short) and decoded again: the decoder may fail or return garbage but
+ * must never write past its output or scratch space, which are fenced
+ * with guard bytes.  decoding into a buffer one byte too small must fail.
+ */
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "shuffle_codec.h"
+
+/*
+ * helper/utility functions, included inline here so we are self-contained
+ * in one single source file...
+ */
+static char* argv0; /* argv[0], program name */
+
+/*
+ * complain about something and exit.
+ */
+static void complain(const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  fprintf(stderr, "%s: ", argv0);
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * now_micros: current time in microseconds
+ */
+static uint64_t now_micros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  uint64_t t = static_cast<uint64_t>(tv.tv_sec) * 1000000;
+  t += tv.tv_usec;
+  return t;
+}
+
+/*
+ * default values
+ */
+#define DEF_ITERS 100000 /* random batches to check */
+#define DEF_MAXSZ 4096   /* max random batch size */
+#define DEF_SEED 1       /* random seed */
+
+#define GUARD 64     /* guard bytes after each buffer */
+#define GUARD_BYTE 0xA5
+
+/*
+ * gs: shared global data (e.g. from the command line)
+ */
+static struct gs {
+  int iters;         /* random batches to check */
+  int maxsz;         /* max random batch size */
+  uint64_t rng;      /* xorshift state */
+} g;
+
+/*
+ * usage
+ */
+static void usage(const char* msg) {
+  if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
+  fprintf(stderr, "usage: %s [options]\n", argv0);
+  fprintf(stderr, "\noptions:\n");
+  fprintf(stderr, "\t-n iters    number of random batches to check\n");
+  fprintf(stderr, "\t-m maxsz    max random batch size\n");
+  fprintf(stderr, "\t-s seed     random seed\n");
+  exit(1);
+}
+
+/*
+ * rnd: xorshift64 random numbers
+ */
+static uint64_t rnd() {
+  g.rng ^= g.rng << 13;
+  g.rng ^= g.rng >> 7;
+  g.rng ^= g.rng << 17;
+  return g.rng;
+}
+
+/*
+ * buffers: input, frame, output, and scratch space, the last three
+ * followed by guard bytes.  sized for batches of up to cap bytes.
+ */
+static struct bufs {
+  size_t cap;
+  char* in;
+  char* frame;
+  char* out;
+  char* scratch;
+} b;
+
+static char* alloc_guarded(size_t sz) {
+  char* p = static_cast<char*>(malloc(sz + GUARD));
+  if (!p) complain("!malloc");
+  return p;
+}
+
+static void bufs_init(size_t cap) {
+  b.cap = cap;
+  b.in = alloc_guarded(cap);
+  b.frame = alloc_guarded(cap + SHUFFLE_CODEC_OVERHEAD);
+  b.out = alloc_guarded(cap);
+  b.scratch = alloc_guarded(SHUFFLE_CODEC_SCRATCH(cap));
+}
+
+/*
+ * decode_guarded: decode a frame into out with room for cap bytes and
+ * check that nothing was written past out or the scratch space.
+ */
+static long decode_guarded(const char* frame, size_t n, size_t cap,
+                           const char* what) {
+  long rv;
+  memset(b.out + cap, GUARD_BYTE, GUARD);
+  memset(b.scratch + SHUFFLE_CODEC_SCRATCH(cap), GUARD_BYTE, GUARD);
+  rv = shuffle_codec_decode(frame, n, b.out, cap, b.scratch);
+  for (size_t i = 0; i < GUARD; i++) {
+    if (static_cast<unsigned char>(b.out[cap + i]) != GUARD_BYTE ||
+        static_cast<unsigned char>(
+            b.scratch[SHUFFLE_CODEC_SCRATCH(cap) + i]) != GUARD_BYTE)
+      complain("%s: decoder wrote past its buffers (cap %zu)", what, cap);
+  }
+  if (rv > static_cast<long>(cap))
+    complain("%s: decoded %ld bytes into %zu", what, rv, cap);
+  return rv;
+}
+
+/*
+ * check_batch: round-trip the n bytes at b.in through every method,
+ * then decode damaged copies of each frame.
+ */
+static void check_batch(size_t n, size_t rec_sz, size_t key_off,
+                        size_t key_len) {
+  for (int m = SHUFFLE_CODEC_NONE; m <= SHUFFLE_CODEC_XLZ; m++) {
+    memset(b.frame + n + SHUFFLE_CODEC_OVERHEAD, GUARD_BYTE, GUARD);
+    memset(b.scratch + SHUFFLE_CODEC_SCRATCH(n), GUARD_BYTE, GUARD);
+    const size_t z = shuffle_codec_encode(m, b.in, n, rec_sz, key_off,
+                                          key_len, b.frame, b.scratch);
+    if (z > n + SHUFFLE_CODEC_OVERHEAD)
+      complain("%s: %zu byte frame for %zu bytes", shuffle_codec_name(m), z,
+               n);
+    for (size_t i = 0; i < GUARD; i++) {
+      if (static_cast<unsigned char>(
+              b.frame[n + SHUFFLE_CODEC_OVERHEAD + i]) != GUARD_BYTE ||
+          static_cast<unsigned char>(b.scratch[SHUFFLE_CODEC_SCRATCH(n) + i]) !=
+              GUARD_BYTE)
+        complain("%s: encoder wrote past its buffers", shuffle_codec_name(m));
+    }
+
+    /* round trip */
+    if (decode_guarded(b.frame, z, n, "round trip") != static_cast<long>(n) ||
+        memcmp(b.out, b.in, n) != 0)
+      complain("%s: round trip failed (%zu bytes, rec %zu, key %zu+%zu)",
+               shuffle_codec_name(m), n, rec_sz, key_off, key_len);
+
+    /* too small an output buffer */
+    if (n != 0 && decode_guarded(b.frame, z, n - 1, "short output") != -1)
+      complain("%s: decoded %zu bytes into %zu", shuffle_codec_name(m), n,
+               n - 1);
+
+    /* damaged frames */
+    if (z != 0) {
+      decode_guarded(b.frame, rnd() % z, n, "truncated frame");
+      const size_t pos = rnd() % z;
+      const char bit = static_cast<char>(1 << (rnd() % 8));
+      b.frame[pos] ^= bit;
+      decode_guarded(b.frame, z, n, "corrupted frame");
+      b.frame[pos] ^= bit;
+    }
+  }
+}
+
+/*
+ * run_random: check random batches of random layout and content
+ */
+static void run_random() {
+  printf("random batches:\n");
+  for (int it = 0; it < g.iters; it++) {
+    const size_t n = rnd() % (g.maxsz + 1);
+    const size_t rec_sz = 1 + rnd() % 64;
+    const size_t key_off = rnd() % rec_sz;
+    const size_t key_len = rnd() % (rec_sz - key_off + 1);
+    const int kind = rnd() % 3;
+    for (size_t i = 0; i < n; i++) {
+      if (kind == 0) {
+        b.in[i] = static_cast<char>(rnd());
+      } else if (kind == 1) {
+        b.in[i] = static_cast<char>(rnd() % 3);
+      } else {
+        b.in[i] = static_cast<char>(i % rec_sz);
+      }
+    }
+    check_batch(n, rec_sz, key_off, key_len);
+  }
+  printf("  %d batches ok\n\n", g.iters);
+}
+
+/*
+ * run_particles: batches of nn write requests (an 8-byte name, its
+ * terminator, and 40 bytes of particle data) with increasing names,
+ * the common case on the wire.
+ */
+static void run_particles() {
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const size_t rec_sz = 8 + 1 + 40;
+  const int rounds = 200;
+  uint64_t id = 1000000;
+
+  printf("particle batches (%zu byte requests):\n", rec_sz);
+  for (size_t qs = 4096; qs <= 65536 && qs <= b.cap; qs *= 4) {
+    const size_t n = (qs / rec_sz) * rec_sz;
+    uint64_t raw = 0, wire[3] = {0, 0, 0}, enc[3] = {0, 0, 0};
+    uint64_t dec[3] = {0, 0, 0};
+    for (int r = 0; r < rounds; r++) {
+      for (char* p = b.in; p < b.in + n; p += rec_sz) {
+        uint64_t v = id;
+        id += 1 + rnd() % 64;
+        for (int k = 7; k >= 0; k--) {
+          p[k] = b64[v % 64];
+          v /= 64;
+        }
+        p[8] = 0;
+        float f[10];
+        for (int j = 0; j < 10; j++)
+          f[j] = j < 3 ? (rnd() % 100000) / 1000.0f
+                       : 1.0f + (rnd() % 1000) / 100000.0f;
+        memcpy(p + 9, f, sizeof(f));
+      }
+      raw += n;
+      for (int m = SHUFFLE_CODEC_NONE; m <= SHUFFLE_CODEC_XLZ; m++) {
+        uint64_t start = now_micros();
+        const size_t z = shuffle_codec_encode(m, b.in, n, rec_sz, 0, 8,
+                                              b.frame, b.scratch);
+        enc[m] += now_micros() - start;
+        start = now_micros();
+        const long d = shuffle_codec_decode(b.frame, z, b.out, n, b.scratch);
+        dec[m] += now_micros() - start;
+        if (d != static_cast<long>(n) || memcmp(b.out, b.in, n) != 0)
+          complain("%s: particle round trip failed", shuffle_codec_name(m));
+        wire[m] += z;
+      }
+    }
+    for (int m = SHUFFLE_CODEC_NONE; m <= SHUFFLE_CODEC_XLZ; m++) {
+      printf("  %6zu bytes %-5s ratio %5.2f, enc %7.1f MB/s, dec %7.1f MB/s\n",
+             n, shuffle_codec_name(m), double(raw) / wire[m],
+             enc[m] ? double(raw) / enc[m] : 0.0,
+             dec[m] ? double(raw) / dec[m] : 0.0);
+    }
+  }
+  printf("\n");
+}
+
+/*
+ * main program.
+ */
+int main(int argc, char* argv[]) {
+  int ch;
+
+  argv0 = argv[0];
+
+  /* we want lines!! */
+  setlinebuf(stdout);
+
+  g.iters = DEF_ITERS;
+  g.maxsz = DEF_MAXSZ;
+  g.rng = DEF_SEED;
+
+  while ((ch = getopt(argc, argv, "m:n:s:")) != -1) {
+    switch (ch) {
+      case 'm':
+        g.maxsz = atoi(optarg);
+        if (g.maxsz < 1) usage("bad max size");
+        break;
+      case 'n':
+        g.iters = atoi(optarg);
+        if (g.iters < 0) usage("bad num iters");
+        break;
+      case 's':
+        g.rng = strtoull(optarg, NULL, 0);
+        if (g.rng == 0) usage("bad seed");
+        break;
+      default:
+        usage(NULL);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc != 0) usage("too many args");
+
+  printf("== Program options:\n");
+  printf(" > iters: %d\n", g.iters);
+  printf(" > max size: %d\n", g.maxsz);
+  printf(" > seed: %llu\n", static_cast<unsigned long long>(g.rng));
+  printf("\n");
+
+  bufs_init(g.maxsz > 65536 ? g.maxsz : 65536);
+  run_random();
+  run_particles();
+
+  printf("all ok\n");
+  return 0;
+}
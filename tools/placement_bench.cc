@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * placement_bench.cc  compare ch-placement protocols against the
+ * placement table (see src/placement_table.h) at large world sizes:
+ * setup time, lookup cost, memory, how many lookups land in ambiguous
+ * slices, and how many names the table places differently from
+ * ch-placement's "ring" (the two rings position vnodes differently).
+ */
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <ch-placement.h>
+#include <pdlfs-common/xxhash.h>
+
+#include "placement_table.h"
+#include "xxhash_batch.h"
+
+/*
+ * helper/utility functions, included inline here so we are self-contained
+ * in one single source file...
+ */
+static char* argv0; /* argv[0], program name */
+
+/*
+ * complain about something and exit.
+ */
+static void complain(const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  fprintf(stderr, "%s: ", argv0);
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * msg_abort: ABORT() target for the placement table code we compile in
+ * (we do not link the preload library, so its stdio calls stay in libc).
+ */
+void msg_abort(int err, const char* msg, const char* func, const char* file,
+               int line) {
+  fprintf(stderr, "*** ABORT *** @@ %s:%d @@ %s] %s", file, line, func, msg);
+  if (err != 0) fprintf(stderr, ": %s (errno=%d)", strerror(err), err);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+/*
+ * now_micros: current time in microseconds
+ */
+static uint64_t now_micros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  uint64_t t = static_cast<uint64_t>(tv.tv_sec) * 1000000;
+  t += tv.tv_usec;
+  return t;
+}
+
+/*
+ * default values
+ */
+#define DEF_NLOOKUPS (1 << 22) /* lookups per test */
+#define DEF_VF 1024            /* virtual factor */
+#define DEF_BITS 0             /* table bits (0 for auto) */
+
+/*
+ * gs: shared global data (e.g. from the command line)
+ */
+static struct gs {
+  int nlookups; /* lookups per test */
+  int vf;       /* virtual factor */
+  int bits;     /* table bits */
+} g;
+
+/*
+ * usage
+ */
+static void usage(const char* msg) {
+  if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
+  fprintf(stderr, "usage: %s [options] [world_sz ...]\n", argv0);
+  fprintf(stderr, "\noptions:\n");
+  fprintf(stderr, "\t-b bits     table bits (0 for auto)\n");
+  fprintf(stderr, "\t-n lookups  number of lookups per test\n");
+  fprintf(stderr, "\t-v vf       virtual factor\n");
+  exit(1);
+}
+
+/*
+ * make_hashes: hash synthetic 8-byte particle names the same way the
+ * shuffle layer does.
+ */
+static uint64_t* make_hashes(int n) {
+  uint64_t* h = static_cast<uint64_t*>(malloc(n * sizeof(uint64_t)));
+  if (!h) complain("!malloc");
+  for (int i = 0; i < n; i++) {
+    uint64_t name = static_cast<uint64_t>(i) * 0x9E3779B97F4A7C15ULL;
+    h[i] = pdlfs::xxhash64(&name, sizeof(name), 0);
+  }
+  return h;
+}
+
+/*
+ * run_hash: time scalar and batch hashing of the particle names
+ */
+static void run_hash() {
+  uint64_t* names = static_cast<uint64_t*>(malloc(g.nlookups * 8));
+  uint64_t* h = static_cast<uint64_t*>(malloc(g.nlookups * 8));
+  uint64_t* hb = static_cast<uint64_t*>(malloc(g.nlookups * 8));
+  uint64_t start, scalar, batch;
+  int mismatches = 0;
+
+  if (!names || !h || !hb) complain("!malloc");
+  for (int i = 0; i < g.nlookups; i++) {
+    names[i] = static_cast<uint64_t>(i) * 0x9E3779B97F4A7C15ULL;
+  }
+  start = now_micros();
+  for (int i = 0; i < g.nlookups; i++) {
+    h[i] = pdlfs::xxhash64(&names[i], sizeof(names[i]), 0);
+  }
+  scalar = now_micros() - start;
+  start = now_micros();
+  xxhash64_batch(reinterpret_cast<char*>(names), sizeof(names[0]),
+                 sizeof(names[0]), g.nlookups, 0, hb);
+  batch = now_micros() - start;
+  for (int i = 0; i < g.nlookups; i++) {
+    if (hb[i] != h[i]) mismatches++;
+  }
+
+  printf("xxhash64: scalar %.2f ns, batch (%s) %.2f ns, %d mismatches\n\n",
+         1000.0 * scalar / g.nlookups, xxhash_batch_impl(),
+         1000.0 * batch / g.nlookups, mismatches);
+  free(names);
+  free(h);
+  free(hb);
+}
+
+/*
+ * run_chp: time setup and lookups with a ch-placement protocol
+ */
+static void run_chp(const char* proto, int world_sz, const uint64_t* h) {
+  struct ch_placement_instance* chp;
+  uint64_t start, setup, lookup;
+  unsigned long target;
+  unsigned long sum = 0;
+
+  start = now_micros();
+  chp = ch_placement_initialize(proto, world_sz, g.vf, 0);
+  if (!chp) complain("!ch_placement_initialize %s", proto);
+  setup = now_micros() - start;
+  start = now_micros();
+  for (int i = 0; i < g.nlookups; i++) {
+    ch_placement_find_closest(chp, h[i], 1, &target);
+    sum += target;
+  }
+  lookup = now_micros() - start;
+  ch_placement_finalize(chp);
+
+  printf("  %-14s setup %10.3f ms, lookup %8.2f ns (%lu)\n", proto,
+         setup / 1000.0, 1000.0 * lookup / g.nlookups, sum % 10);
+}
+
+/*
+ * run_table: time setup and lookups with the placement table, check
+ * every lookup against a binary search of the table's own ring, and
+ * count names placed differently from ch-placement's "ring".
+ */
+static void run_table(int world_sz, const uint64_t* h) {
+  struct ch_placement_instance* chp;
+  placement_table_t pt;
+  uint64_t start, setup, lookup;
+  unsigned long target;
+  unsigned long sum = 0;
+  int mismatches = 0;
+  int ambiguous = 0;
+  int moved = 0;
+
+  start = now_micros();
+  placement_table_init(&pt, world_sz, g.vf, g.bits);
+  setup = now_micros() - start;
+  start = now_micros();
+  for (int i = 0; i < g.nlookups; i++) {
+    sum += placement_table_lookup(&pt, h[i]);
+  }
+  lookup = now_micros() - start;
+  chp = ch_placement_initialize("ring", world_sz, g.vf, 0);
+  if (!chp) complain("!ch_placement_initialize ring");
+  for (int i = 0; i < g.nlookups; i++) {
+    const int r = placement_table_lookup(&pt, h[i]);
+    if (r != placement_table_ring_lookup(&pt, h[i])) mismatches++;
+    if (pt.entries[h[i] >> (64 - pt.bits)] < 0) ambiguous++;
+    ch_placement_find_closest(chp, h[i], 1, &target);
+    if (static_cast<unsigned long>(r) != target) moved++;
+  }
+  ch_placement_finalize(chp);
+
+  printf("  %-14s setup %10.3f ms, lookup %8.2f ns (%lu)\n", "table",
+         setup / 1000.0, 1000.0 * lookup / g.nlookups, sum % 10);
+  printf("  %-14s %d bits, %.3f%% slices and %.3f%% lookups ambiguous "
+         "(max scan %d)\n",
+         "", pt.bits, 100.0 * pt.num_ambiguous / (size_t(1) << pt.bits),
+         100.0 * ambiguous / g.nlookups, pt.max_scan);
+  printf("  %-14s %.1f MiB table + %.1f MiB ring, %d mismatches, "
+         "%.3f%% names placed differently from ring\n",
+         "", (sizeof(int) << pt.bits) / 1048576.0,
+         pt.num_vnodes * sizeof(placement_vnode_t) / 1048576.0, mismatches,
+         100.0 * moved / g.nlookups);
+  placement_table_destroy(&pt);
+}
+
+/*
+ * main program.
+ */
+int main(int argc, char* argv[]) {
+  static const int def_sizes[] = {1024, 4096, 16384, 65536, 102400};
+  static const char* const protos[] = {"ring", "static_modulo",
+                                       "hash_lookup3", "xor"};
+  uint64_t* h;
+  int ch;
+
+  argv0 = argv[0];
+
+  /* we want lines!! */
+  setlinebuf(stdout);
+
+  g.nlookups = DEF_NLOOKUPS;
+  g.vf = DEF_VF;
+  g.bits = DEF_BITS;
+
+  while ((ch = getopt(argc, argv, "b:n:v:")) != -1) {
+    switch (ch) {
+      case 'b':
+        g.bits = atoi(optarg);
+        if (g.bits < 0 || g.bits > 30) usage("bad table bits");
+        break;
+      case 'n':
+        g.nlookups = atoi(optarg);
+        if (g.nlookups < 1) usage("bad num lookups");
+        break;
+      case 'v':
+        g.vf = atoi(optarg);
+        if (g.vf < 1) usage("bad virtual factor");
+        break;
+      default:
+        usage(NULL);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  printf("== Program options:\n");
+  printf(" > lookups: %d\n", g.nlookups);
+  printf(" > virtual factor: %d\n", g.vf);
+  printf(" > table bits: %d\n", g.bits);
+  printf("\n");
+
+  run_hash();
+  h = make_hashes(g.nlookups);
+  for (int i = 0; i < (argc ? argc : 5); i++) {
+    int world_sz = argc ? atoi(argv[i]) : def_sizes[i];
+    if (world_sz < 1) complain("bad world size %s", argv[i]);
+    printf("world size %d:\n", world_sz);
+    for (size_t j = 0; j < sizeof(protos) / sizeof(protos[0]); j++) {
+      run_chp(protos[j], world_sz, h);
+    }
+    run_table(world_sz, h);
+  }
+
+  free(h);
+  return 0;
+}
@@ -49,12 +49,17 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <ch-placement.h>
 #include <deltafs/deltafs_api.h>
+#include <pdlfs-common/xxhash.h>
 
 #include <algorithm>
+#include <map>
 #include <string>
 #include <vector>
 
+#include "range_placement.h"
+
 /*
  * helper/utility functions, included inline here so we are self-contained
  * in one single source file...
@@ -75,6 +80,14 @@ static struct deltafs_conf {
   int unordered_storage;
   int io_engine;
   int comm_sz;
+  int range_placement; /* names are range partitioned */
+  /* range pivots by the first epoch they apply to */
+  std::map<int, std::vector<uint64_t> >* pivots;
+  int two_choices;     /* names go to one of two ring candidates */
+  char* placement_protocol;
+  int virtual_factor;
+  int ring_sz;         /* number of ranks in the ring (senders included) */
+  int receiver_rate;   /* ring ranks per receiver */
 } c; /* plfsdir conf */
 
 /*
@@ -137,6 +150,7 @@ static uint64_t now() {
  */
 struct gs {
   int a;         /* anti-shuffle mode (query rank 0 names across all ranks)*/
+  int p;         /* route each query by range pivots (range placement only) */
   int r;         /* number of ranks to read */
   int d;         /* number of names to read per rank */
   int bg;        /* number of background worker threads */
@@ -229,6 +243,7 @@ static void usage(const char* msg) {
   fprintf(stderr, "usage: %s [options] plfsdir infodir\n", argv0);
   fprintf(stderr, "\noptions:\n");
   fprintf(stderr, "\t-a        enable the special anti-shuffle mode\n");
+  fprintf(stderr, "\t-p        route queries to owner ranks by placement\n");
   fprintf(stderr, "\t-r ranks  number of ranks to read\n");
   fprintf(stderr, "\t-d depth  number of names to read per rank\n");
   fprintf(stderr, "\t-j num    number of background worker threads\n");
@@ -243,17 +258,37 @@ static void usage(const char* msg) {
 /*
  * get_manifest: parse the conf from the dir manifest file
  */
+static void get_pivots(const char* ch) {
+  std::vector<uint64_t> pivots;
+  char* end;
+  int epoch;
+
+  epoch = strtol(ch, &end, 10);
+  if (end == ch || *end != '=' || epoch < 0)
+    complain("bad range_pivots from manifest");
+  ch = end + 1;
+  while (*ch != 0 && *ch != '\n') {
+    pivots.push_back(strtoull(ch, &end, 16));
+    if (end == ch) complain("bad range_pivots from manifest");
+    ch = (*end == ',') ? end + 1 : end;
+  }
+  (*c.pivots)[epoch] = pivots;
+}
+
 static void get_manifest() {
   char* ch;
   char fname[PATH_MAX];
-  char tmp[100];
+  char* tmp = NULL;
+  size_t tmpsz = 0;
   FILE* f;
 
   snprintf(fname, sizeof(fname), "%s/MANIFEST", g.in);
   f = fopen(fname, "r");
   if (!f) complain("error opening %s: %s", fname, strerror(errno));
 
-  while ((ch = fgets(tmp, sizeof(tmp), f)) != NULL) {
+  /* pivot lines grow with comm_sz, so do not use a fixed-size buffer */
+  while (getline(&tmp, &tmpsz, f) != -1) {
+    ch = tmp;
     if (strncmp(ch, "num_epochs=", strlen("num_epochs=")) == 0) {
       c.num_epochs = atoi(ch + strlen("num_epochs="));
       if (c.num_epochs < 0) complain("bad num_epochs from manifest");
@@ -299,8 +334,31 @@ static void get_manifest() {
     } else if (strncmp(ch, "comm_sz=", strlen("comm_sz=")) == 0) {
       c.comm_sz = atoi(ch + strlen("comm_sz="));
       if (c.comm_sz < 0) complain("bad comm_sz from manifests");
+    } else if (strcmp(ch, "placement=range\n") == 0) {
+      c.range_placement = 1;
+    } else if (strncmp(ch, "range_pivots.", strlen("range_pivots.")) == 0) {
+      get_pivots(ch + strlen("range_pivots."));
+    } else if (strcmp(ch, "placement=two_choices\n") == 0) {
+      c.two_choices = 1;
+    } else if (strncmp(ch, "placement_protocol=",
+                       strlen("placement_protocol=")) == 0) {
+      c.placement_protocol = strdup(ch + strlen("placement_protocol="));
+      if (c.placement_protocol[0] != 0 &&
+          c.placement_protocol[strlen(c.placement_protocol) - 1] == '\n')
+        c.placement_protocol[strlen(c.placement_protocol) - 1] = 0;
+    } else if (strncmp(ch, "virtual_factor=", strlen("virtual_factor=")) ==
+               0) {
+      c.virtual_factor = atoi(ch + strlen("virtual_factor="));
+      if (c.virtual_factor < 0) complain("bad virtual_factor from manifest");
+    } else if (strncmp(ch, "ring_sz=", strlen("ring_sz=")) == 0) {
+      c.ring_sz = atoi(ch + strlen("ring_sz="));
+      if (c.ring_sz < 0) complain("bad ring_sz from manifest");
+    } else if (strncmp(ch, "receiver_rate=", strlen("receiver_rate=")) == 0) {
+      c.receiver_rate = atoi(ch + strlen("receiver_rate="));
+      if (c.receiver_rate < 0) complain("bad receiver_rate from manifest");
     }
   }
+  free(tmp);
 
   if (ferror(f)) {
     complain("error reading %s: %s", fname, strerror(errno));
@@ -308,6 +366,19 @@ static void get_manifest() {
 
   if (c.key_size == 0 || c.comm_sz == 0)
     complain("bad manifest: key_size or comm_sz is 0?!");
+  if (c.range_placement) {
+    if (c.pivots->empty() || c.pivots->begin()->first != 0)
+      complain("bad manifest: missing range pivots for epoch 0");
+    std::map<int, std::vector<uint64_t> >::iterator it = c.pivots->begin();
+    for (; it != c.pivots->end(); ++it)
+      if (it->second.size() != size_t(c.comm_sz - 1))
+        complain("bad manifest: range pivots do not match comm_sz");
+  }
+  if (c.two_choices) {
+    if (c.placement_protocol == NULL || c.receiver_rate < 1 ||
+        c.ring_sz / c.receiver_rate != c.comm_sz)
+      complain("bad manifest: two-choice placement does not match comm_sz");
+  }
 
   fclose(f);
 }
@@ -346,6 +417,23 @@ static void prepare_conf(int rank, int* io_engine, int* unordered,
 #endif
 }
 
+/*
+ * account: add the measurements of one query.
+ */
+static void account(uint64_t latency, size_t sz, size_t table_seeks,
+                    size_t seeks) {
+  m.latencies->push_back(latency);
+  m.table_seeks[SUM] += table_seeks;
+  m.table_seeks[MIN] = std::min<uint64_t>(table_seeks, m.table_seeks[MIN]);
+  m.table_seeks[MAX] = std::max<uint64_t>(table_seeks, m.table_seeks[MAX]);
+  m.seeks[SUM] += seeks;
+  m.seeks[MIN] = std::min<uint64_t>(seeks, m.seeks[MIN]);
+  m.seeks[MAX] = std::max<uint64_t>(seeks, m.seeks[MAX]);
+  m.bytes += sz;
+  if (sz != 0) m.okops++;
+  m.ops++;
+}
+
 /*
  * do_read: read from plfsdir and measure the performance.
  */
@@ -372,16 +460,7 @@ static void do_read(deltafs_plfsdir_t* dir, const char* name) {
 
   free(data);
 
-  m.latencies->push_back(end - start);
-  m.table_seeks[SUM] += table_seeks;
-  m.table_seeks[MIN] = std::min<uint64_t>(table_seeks, m.table_seeks[MIN]);
-  m.table_seeks[MAX] = std::max<uint64_t>(table_seeks, m.table_seeks[MAX]);
-  m.seeks[SUM] += seeks;
-  m.seeks[MIN] = std::min<uint64_t>(seeks, m.seeks[MIN]);
-  m.seeks[MAX] = std::max<uint64_t>(seeks, m.seeks[MAX]);
-  m.bytes += sz;
-  if (sz != 0) m.okops++;
-  m.ops++;
+  account(end - start, sz, table_seeks, seeks);
 }
 
 /*
@@ -411,18 +490,15 @@ static void get_names(int rank, std::vector<std::string>* results) {
 }
 
 /*
- * run_queries: open plfsdir and do reads on a specific rank.
+ * open_dir: open the plfsdir of a specific rank.
  */
-static void run_queries(int rank) {
-  std::vector<std::string> names;
+static deltafs_plfsdir_t* open_dir(int rank) {
   deltafs_plfsdir_t* dir;
   int unordered;
   int force_leveldb_fmt;
   int io_engine;
   int r;
 
-  get_names((g.a || c.bypass_shuffle) ? 0 : rank, &names);
-  std::random_shuffle(names.begin(), names.end());
   prepare_conf(rank, &io_engine, &unordered, &force_leveldb_fmt);
 
   dir = deltafs_plfsdir_create_handle(cf, O_RDONLY, io_engine);
@@ -436,13 +512,13 @@ static void run_queries(int rank) {
   r = deltafs_plfsdir_open(dir, g.dirname);
   if (r) complain("error opening plfsdir: %s", strerror(errno));
 
-  if (g.v)
-    info("rank %d (%d reads) ...\t\t(%d samples available)", rank,
-         std::min(g.d, int(names.size())), int(names.size()));
-  for (int i = 0; i < g.d && i < int(names.size()); i++) {
-    do_read(dir, names[i].c_str());
-  }
+  return dir;
+}
 
+/*
+ * close_dir: collect io stats of a dir and free it.
+ */
+static void close_dir(deltafs_plfsdir_t* dir) {
   m.under_bytes +=
       deltafs_plfsdir_get_integer_property(dir, "io.total_bytes_read");
   m.under_files +=
@@ -453,6 +529,158 @@ static void run_queries(int rank) {
   m.partitions++;
 }
 
+/*
+ * run_queries: open plfsdir and do reads on a specific rank.
+ */
+static void run_queries(int rank) {
+  std::vector<std::string> names;
+  deltafs_plfsdir_t* dir;
+
+  get_names((g.a || c.bypass_shuffle) ? 0 : rank, &names);
+  std::random_shuffle(names.begin(), names.end());
+  dir = open_dir(rank);
+
+  if (g.v)
+    info("rank %d (%d reads) ...\t\t(%d samples available)", rank,
+         std::min(g.d, int(names.size())), int(names.size()));
+  for (int i = 0; i < g.d && i < int(names.size()); i++) {
+    do_read(dir, names[i].c_str());
+  }
+
+  close_dir(dir);
+}
+
+/*
+ * do_routed_read: read a name epoch by epoch, each time from the one rank
+ * owning the name in that epoch according to the range pivots.
+ */
+static void do_routed_read(std::vector<deltafs_plfsdir_t*>* dirs,
+                           const std::string& name) {
+  std::map<int, std::vector<uint64_t> >::iterator it;
+  const uint64_t key = range_key(name.data(), name.size());
+  size_t table_seeks;
+  size_t seeks;
+  size_t sz;
+  uint64_t start;
+  uint64_t end;
+  size_t total_table_seeks = 0;
+  size_t total_seeks = 0;
+  size_t total_sz = 0;
+  char* data;
+  int rank;
+
+  start = now();
+
+  for (int epoch = 0; epoch < c.num_epochs; epoch++) {
+    it = c.pivots->upper_bound(epoch);
+    --it; /* pivots of epoch 0 are always present */
+    rank = range_lookup(&it->second[0], c.comm_sz, key);
+    if ((*dirs)[rank] == NULL) (*dirs)[rank] = open_dir(rank);
+    table_seeks = seeks = 0;
+    data = static_cast<char*>(deltafs_plfsdir_read(
+        (*dirs)[rank], name.c_str(), epoch, &sz, &table_seeks, &seeks));
+    if (data == NULL)
+      complain("error reading %s: %s", name.c_str(), strerror(errno));
+    free(data);
+    total_table_seeks += table_seeks;
+    total_seeks += seeks;
+    total_sz += sz;
+  }
+
+  end = now();
+
+  if (total_sz == 0 && c.value_size != 0)
+    complain("file %s is empty!!", name.c_str());
+
+  account(end - start, total_sz, total_table_seeks, total_seeks);
+}
+
+/*
+ * do_dual_read: read a name from both of its ring candidates. each write of
+ * the name went to one of them depending on sender-side backlogs, so the
+ * name may have data in either dir and we merge the two. the bloom filters
+ * of a dir reject the name cheaply when it never went there.
+ */
+static void do_dual_read(std::vector<deltafs_plfsdir_t*>* dirs,
+                         struct ch_placement_instance* chp,
+                         const std::string& name) {
+  unsigned long cands[2];
+  size_t table_seeks;
+  size_t seeks;
+  size_t sz;
+  uint64_t start;
+  uint64_t end;
+  size_t total_table_seeks = 0;
+  size_t total_seeks = 0;
+  size_t total_sz = 0;
+  char* data;
+  int rank;
+
+  start = now();
+
+  /* must hash names exactly as the writer does */
+  ch_placement_find_closest(chp, pdlfs::xxhash64(name.data(), name.size(), 0),
+                            2, cands);
+  for (int i = 0; i < 2; i++) {
+    rank = int(cands[i]) / c.receiver_rate;
+    if (i != 0 && rank == int(cands[0]) / c.receiver_rate) break;
+    if ((*dirs)[rank] == NULL) (*dirs)[rank] = open_dir(rank);
+    table_seeks = seeks = 0;
+    data = static_cast<char*>(deltafs_plfsdir_read(
+        (*dirs)[rank], name.c_str(), -1, &sz, &table_seeks, &seeks));
+    if (data == NULL)
+      complain("error reading %s: %s", name.c_str(), strerror(errno));
+    free(data);
+    total_table_seeks += table_seeks;
+    total_seeks += seeks;
+    total_sz += sz;
+  }
+
+  end = now();
+
+  if (total_sz == 0 && c.value_size != 0)
+    complain("file %s is empty!!", name.c_str());
+
+  account(end - start, total_sz, total_table_seeks, total_seeks);
+}
+
+/*
+ * run_routed_queries: read names sampled by the given ranks, opening only
+ * the dirs of the ranks that own them.
+ */
+static void run_routed_queries(const std::vector<int>& ranks, int nranks) {
+  std::vector<deltafs_plfsdir_t*> dirs(c.comm_sz, NULL);
+  std::vector<std::string> names;
+  struct ch_placement_instance* chp = NULL;
+
+  if (c.two_choices) {
+    chp = ch_placement_initialize(c.placement_protocol, c.ring_sz,
+                                  c.virtual_factor, 0 /* hash seed */);
+    if (!chp) complain("fail to init ch-placement");
+  }
+
+  for (int i = 0; i < nranks && i < int(ranks.size()); i++) {
+    get_names(ranks[i], &names);
+    std::random_shuffle(names.begin(), names.end());
+    if (g.v)
+      info("rank %d names (%d reads) ...\t\t(%d samples available)",
+           ranks[i], std::min(g.d, int(names.size())), int(names.size()));
+    for (int j = 0; j < g.d && j < int(names.size()); j++) {
+      if (chp != NULL) {
+        do_dual_read(&dirs, chp, names[j]);
+      } else {
+        do_routed_read(&dirs, names[j]);
+      }
+    }
+  }
+
+  if (chp) ch_placement_finalize(chp);
+
+  for (int i = 0; i < c.comm_sz; i++) {
+    if (dirs[i] != NULL) close_dir(dirs[i]);
+  }
+}
+
 /*
  * main program
  */
@@ -471,11 +699,14 @@ int main(int argc, char* argv[]) {
   /* setup default to zero/null, except as noted below */
   memset(&g, 0, sizeof(g));
   g.timeout = DEF_TIMEOUT;
-  while ((ch = getopt(argc, argv, "ar:d:j:t:ickv")) != -1) {
+  while ((ch = getopt(argc, argv, "apr:d:j:t:ickv")) != -1) {
     switch (ch) {
       case 'a':
         g.a = 1;
         break;
+      case 'p':
+        g.p = 1;
+        break;
       case 'r':
         g.r = atoi(optarg);
         if (g.r < 0) usage("bad rank number");
@@ -522,12 +753,21 @@ int main(int argc, char* argv[]) {
     complain("cannot access %s: %s", g.in, strerror(errno));
 
   memset(&c, 0, sizeof(c));
+  c.pivots = new std::map<int, std::vector<uint64_t> >;
   get_manifest();
+  if (g.p && !c.range_placement && !c.two_choices)
+    complain("-p needs range or two-choice placement");
+  if (g.p && g.a) usage("-p and -a are exclusive");
+  /* a name may be split across two dirs, so reading one dir is not enough */
+  if (c.two_choices && !g.a) g.p = 1;
+  if (c.two_choices && g.nobf)
+    info("two-choice placement without bloom filters doubles read costs");
 
   printf("\n%s\n==options:\n", argv0);
   printf("\tqueries: %d x %d (ranks x reads)\n", g.r, g.d);
   printf("\tnum bg threads: %d (reader thread pool)\n", g.bg);
   printf("\tanti-shuffle: %d\n", g.a);
+  printf("\trouted by placement: %d\n", g.p);
   printf("\tinfodir: %s\n", g.in);
   printf("\tplfsdir: %s\n", g.dirname);
   printf("\ttimeout: %d s\n", g.timeout);
@@ -548,6 +788,13 @@ int main(int argc, char* argv[]) {
   printf("\tbypass shuffle: %d\n", c.bypass_shuffle);
   printf("\tlg parts: %d\n", c.lg_parts);
   printf("\tcomm sz: %d\n", c.comm_sz);
+  printf("\trange placement: %d (%d pivot sets)\n", c.range_placement,
+         int(c.pivots->size()));
+  printf("\ttwo-choice placement: %d", c.two_choices);
+  if (c.two_choices)
+    printf(" (%s, vir-factor: %d, ring: %d ranks)", c.placement_protocol,
+           c.virtual_factor, c.ring_sz);
+  printf("\n");
   printf("\n");
 
   signal(SIGALRM, sigalarm);
@@ -563,15 +810,21 @@ int main(int argc, char* argv[]) {
   std::random_shuffle(ranks.begin(), ranks.end());
   nranks = (g.a || c.bypass_shuffle) ? c.comm_sz : g.r;
   if (g.v) info("start queries (%d ranks) ...", std::min(nranks, c.comm_sz));
-  for (int i = 0; i < nranks && i < c.comm_sz; i++) {
-    run_queries(ranks[i]);
+  if (g.p) {
+    run_routed_queries(ranks, nranks);
+  } else {
+    for (int i = 0; i < nranks && i < c.comm_sz; i++) {
+      run_queries(ranks[i]);
+    }
   }
   report();
 
   if (tp) deltafs_tp_close(tp);
   if (c.memtable_size) free(c.memtable_size);
   if (c.filter_bits_per_key) free(c.filter_bits_per_key);
+  if (c.placement_protocol) free(c.placement_protocol);
   delete m.latencies;
+  delete c.pivots;
 
   if (g.v) info("all done!");
   if (g.v) info("bye");
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * preload_stdio_bench.cc  measure the per-call overhead the preload
+ * library adds to stdio calls on streams it does not own (e.g. vpic
+ * logs and checkpoints), with 1 and N concurrent threads.
+ */
+
+/*
+ * To run this program, either compile and link this program with the
+ * rest preload code, or compile and link it without the preload
+ * code to get the baseline numbers for the same machine.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * helper/utility functions, included inline here so we are self-contained
+ * in one single source file...
+ */
+static char* argv0; /* argv[0], program name */
+
+/*
+ * complain about something and exit.
+ */
+static void complain(const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  fprintf(stderr, "%s: ", argv0);
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * now_micros: current time in microseconds
+ */
+static uint64_t now_micros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  uint64_t t = static_cast<uint64_t>(tv.tv_sec) * 1000000;
+  t += tv.tv_usec;
+  return t;
+}
+
+/*
+ * default values
+ */
+#define DEF_NOPS (4 << 20) /* stdio calls per thread */
+#define DEF_NTHREADS 8     /* max number of threads */
+#define DEF_WRITESIZE 8    /* bytes per fwrite */
+
+/*
+ * gs: shared global data (e.g. from the command line)
+ */
+static struct gs {
+  int nops;      /* stdio calls per thread */
+  int nthreads;  /* max number of threads */
+  int writesize; /* bytes per fwrite */
+} g;
+
+/*
+ * usage
+ */
+static void usage(const char* msg) {
+  if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
+  fprintf(stderr, "usage: %s [options]\n", argv0);
+  fprintf(stderr, "\noptions:\n");
+  fprintf(stderr, "\t-b bytes    bytes per fwrite\n");
+  fprintf(stderr, "\t-n ops      number of stdio calls per thread\n");
+  fprintf(stderr, "\t-t threads  max number of threads\n");
+  exit(1);
+}
+
+/*
+ * per-thread state.
+ */
+struct ts {
+  pthread_t tid;
+  FILE* file; /* a stream owned by libc, not us */
+  uint64_t fwrite_micros;
+  uint64_t fputc_micros;
+};
+
+/*
+ * run_bench: issue fwrite and fputc calls against a private stream.  each
+ * thread has its own stream so that libc's per-stream lock does not show
+ * up in the results, only whatever the interposed calls add.
+ */
+static void* run_bench(void* arg) {
+  struct ts* t = static_cast<struct ts*>(arg);
+  char buf[256];
+  uint64_t start;
+
+  memset(buf, 0, sizeof(buf));
+  start = now_micros();
+  for (int i = 0; i < g.nops; i++) {
+    fwrite(buf, 1, g.writesize, t->file);
+  }
+  t->fwrite_micros = now_micros() - start;
+  start = now_micros();
+  for (int i = 0; i < g.nops; i++) {
+    fputc(i, t->file);
+  }
+  t->fputc_micros = now_micros() - start;
+
+  return NULL;
+}
+
+/*
+ * run_threads: run the bench with n threads and report ns/call
+ */
+static void run_threads(int n) {
+  struct ts* ts;
+  double fwrite_ns = 0;
+  double fputc_ns = 0;
+
+  ts = static_cast<struct ts*>(calloc(n, sizeof(struct ts)));
+  if (!ts) complain("!calloc");
+  for (int i = 0; i < n; i++) {
+    ts[i].file = fopen("/dev/null", "w");
+    if (!ts[i].file) complain("!fopen errno=%d", errno);
+  }
+  for (int i = 0; i < n; i++) {
+    if (pthread_create(&ts[i].tid, NULL, run_bench, &ts[i]) != 0)
+      complain("!pthread_create");
+  }
+  for (int i = 0; i < n; i++) {
+    pthread_join(ts[i].tid, NULL);
+    fclose(ts[i].file);
+    fwrite_ns += 1000.0 * ts[i].fwrite_micros / g.nops;
+    fputc_ns += 1000.0 * ts[i].fputc_micros / g.nops;
+  }
+
+  printf("%3d thread(s): fwrite %8.2f ns/call, fputc %8.2f ns/call\n", n,
+         fwrite_ns / n, fputc_ns / n);
+
+  free(ts);
+}
+
+/*
+ * main program.
+ */
+int main(int argc, char* argv[]) {
+  int ch;
+
+  argv0 = argv[0];
+
+  /* we want lines!! */
+  setlinebuf(stdout);
+
+  g.nops = DEF_NOPS;
+  g.nthreads = DEF_NTHREADS;
+  g.writesize = DEF_WRITESIZE;
+
+  while ((ch = getopt(argc, argv, "b:n:t:")) != -1) {
+    switch (ch) {
+      case 'b':
+        g.writesize = atoi(optarg);
+        if (g.writesize < 1 || g.writesize > 256) usage("bad write size");
+        break;
+      case 'n':
+        g.nops = atoi(optarg);
+        if (g.nops < 1) usage("bad num ops");
+        break;
+      case 't':
+        g.nthreads = atoi(optarg);
+        if (g.nthreads < 1) usage("bad num threads");
+        break;
+      default:
+        usage(NULL);
+    }
+  }
+
+  printf("== Program options:\n");
+  printf(" > ops per thread: %d\n", g.nops);
+  printf(" > bytes per fwrite: %d\n", g.writesize);
+  printf(" > max threads: %d\n", g.nthreads);
+  printf("\n");
+
+  run_threads(1);
+  if (g.nthreads > 1) {
+    run_threads(g.nthreads);
+  }
+
+  return 0;
+}